@@ -0,0 +1,642 @@
+#include "common.h"
+
+#include "decode.h"
+#include "header.h"
+#include "mpeg.h"
+
+#include <chrono>
+#include <ctime>
+#include <random>
+#include <thread>
+#include <vector>
+
+
+#define LOG(msg)	std::cout << msg << std::endl
+
+
+// Keep the results of measured code alive
+static volatile size_t s_sink;
+
+
+template<typename F>
+static double measure(F&& f_func, uint f_runs = 3)
+{
+	using Clock = std::chrono::steady_clock;
+	double best = 0.0;
+	for(uint i = 0; i < f_runs; ++i)
+	{
+		auto start = Clock::now();
+		f_func();
+		std::chrono::duration<double> d = Clock::now() - start;
+		if(!i || d.count() < best)
+			best = d.count();
+	}
+	return best;
+}
+
+
+/******************************************************************************
+ * First header search on adversarial input
+ *****************************************************************************/
+// The baseline calcFirstHeaderOffset: a byte-wise header search, every candidate sequence verified from scratch
+static size_t baselineFirstHeaderOffset(const uchar* f_data, size_t f_size)
+{
+	auto findHeader = [](const uchar* f_p, size_t f_n)
+	{
+		if(f_n < CHeader::getSize())
+			return f_n;
+		for(size_t i = 0, limit = f_n - CHeader::getSize(); i <= limit; ++i)
+		{
+			if(CHeader::isValid(*reinterpret_cast<const uint*>(f_p + i)))
+				return i;
+		}
+		return f_n;
+	};
+
+	for(size_t offset = 0; offset < f_size; offset++)
+	{
+		offset += findHeader(f_data + offset, f_size - offset);
+		if(MPEG::IStream::verifyFrameSequence(f_data + offset, f_size - offset))
+			return offset;
+	}
+	return f_size;
+}
+
+// A sync-word storm: every period there are 8 free-bitrate headers with a step of 9 bytes between the valid frame sizes
+// (MPEG 1 layer III at 32 kHz: 1440 bytes max, MPEG 2.5 layer II at 8 kHz: 2880 bytes max) 4 bytes apart.
+// Their valid sizes take 8 of the 9 residues, so the rest of the period holds a fixed-bitrate header every 9 bytes
+// at the ninth one: each stops the frame scan of every free-bitrate candidate in reach, yet is never a valid size.
+// The period is a multiple of 9 longer than the maximum frame, and the fixed-bitrate frames (417 bytes)
+// end on no header but the third free-bitrate one, so no sequence is ever confirmed
+static std::vector<uchar> genSyncStorm(size_t f_size, uint f_header, size_t f_period)
+{
+	static const uint Fixed = 0xC490FBFF;
+
+	std::vector<uchar> buf(f_size);
+	for(size_t base = 0; base + f_period <= f_size; base += f_period)
+	{
+		for(size_t i = 0; i < 8; ++i)
+			memcpy(&buf[base + 4 * i], &f_header, sizeof(f_header));
+		for(size_t o = base + 32; o + 4 <= base + f_period; o += 9)
+			memcpy(&buf[o], &Fixed, sizeof(Fixed));
+	}
+	return buf;
+}
+
+// Both searches are linear in the size. The baseline stops at every header in reach of a free-bitrate candidate,
+// while the new search sizes it in O(1) after a pass over the window per step in use. The longer frames
+// don't cost the baseline more per byte here: the candidates of a storm get sparser with their reach
+static void bench_first_header()
+{
+	static const struct
+	{
+		const char*	Name;
+		uint		Header;
+		size_t		Period;
+	}
+	s_storms[] =
+	{
+		{"1440 B", 0xC408FBFF, 1449},
+		{"2880 B", 0xC408E5FF, 2889}
+	};
+
+	LOG("First header search on a sync-word storm");
+	LOG("  max frame   size (MB)   baseline ms   linear ms   baseline ns/B   linear ns/B   ratio");
+	for(auto& storm : s_storms)
+	{
+		for(size_t mb = 1; mb <= 16; mb *= 4)
+		{
+			auto buf = genSyncStorm(mb << 20, storm.Header, storm.Period);
+
+			size_t baseline = 0, linear = 0;
+			auto tBaseline = measure([&]{ baseline = baselineFirstHeaderOffset(&buf[0], buf.size()); }, 1);
+			auto tLinear = measure([&]{ linear = MPEG::IStream::calcFirstHeaderOffset(&buf[0], buf.size()); });
+			if(baseline != buf.size() || linear != buf.size())
+				LOG("  unexpected sync found");
+
+			LOG("  " << storm.Name << "\t" << mb << "\t\t" << (tBaseline * 1e3) << "\t\t" << (tLinear * 1e3) << "\t\t" <<
+				(tBaseline * 1e9 / buf.size()) << "\t\t" << (tLinear * 1e9 / buf.size()) << "\t\t" << (tBaseline / tLinear));
+		}
+	}
+}
+
+
+/******************************************************************************
+ * Frame index memory
+ *****************************************************************************/
+static void bench_index_memory()
+{
+	LOG("Frame index memory (VBR MPEG 1 layer III)");
+	LOG("  frames    full (B)    compact (B)   B/frame   compact lookup ns");
+	static const uint s_headers[] = {0x6CA0FBFF, 0x6CA2FBFF, 0x6C90FBFF, 0x6CB0FBFF, 0x6CB2FBFF};
+	for(uint nFrames : {100000u, 500000u})
+	{
+		std::vector<uchar> buf;
+		for(uint i = 0; i < nFrames; ++i)
+		{
+			auto raw = s_headers[(i * 7 + i / 3) % (sizeof(s_headers) / sizeof(*s_headers))];
+			auto offset = buf.size();
+			buf.resize(offset + CHeader(raw).getFrameSize());
+			memcpy(&buf[offset], &raw, sizeof(raw));
+		}
+
+		MPEG::Options options;
+		options.Borrow = true;
+		auto full = MPEG::IStream::create(&buf[0], buf.size(), options);
+		options.Index = MPEG::IndexMode::Compact;
+		auto compact = MPEG::IStream::create(&buf[0], buf.size(), options);
+
+		auto t = measure([&]{ for(uint i = 0; i < nFrames; i += 7) s_sink += compact->getFrameOffset(i); });
+		LOG("  " << nFrames << "\t" << full->getIndexMemoryUsage() << "\t" << compact->getIndexMemoryUsage() <<
+			"\t" << (double(compact->getIndexMemoryUsage()) / nFrames) << "\t" << (t * 1e9 / (nFrames / 7)));
+	}
+}
+
+
+/******************************************************************************
+ * Implicit CBR index
+ *****************************************************************************/
+static void bench_cbr()
+{
+	LOG("CBR stream open (MPEG 1 layer III, 128 kbps, 44.1 kHz)");
+	LOG("  frames    full ms   full (B)    implicit ms   implicit (B)");
+	const uint sampling = 44100;
+	const uint frac = 144 * 128000 % sampling;
+	for(uint nFrames : {100000u, 1000000u})
+	{
+		std::vector<uchar> buf;
+		int lag = frac;
+		for(uint i = 0; i < nFrames; ++i)
+		{
+			lag -= frac;
+			uint raw = 0x6C90FBFF;
+			if(lag < 0)
+			{
+				lag += sampling;
+				raw |= 0x00020000;
+			}
+			auto offset = buf.size();
+			buf.resize(offset + CHeader(raw).getFrameSize());
+			memcpy(&buf[offset], &raw, sizeof(raw));
+		}
+
+		MPEG::Options options;
+		options.Borrow = true;
+		options.ImplicitCBR = false;
+		std::shared_ptr<MPEG::IStream> full, cbr;
+		auto tFull = measure([&]{ full = MPEG::IStream::create(&buf[0], buf.size(), options); });
+		options.ImplicitCBR = true;
+		auto tCbr = measure([&]{ cbr = MPEG::IStream::create(&buf[0], buf.size(), options); });
+		if(full->getFrameCount() != cbr->getFrameCount())
+			LOG("  frame count mismatch");
+
+		LOG("  " << nFrames << "\t" << (tFull * 1e3) << "\t" << full->getIndexMemoryUsage() <<
+			"\t" << (tCbr * 1e3) << "\t\t" << cbr->getIndexMemoryUsage());
+	}
+}
+
+
+/******************************************************************************
+ * Parallel indexing
+ *****************************************************************************/
+static void bench_parallel()
+{
+	static const uint s_headers[] = {0x6CA0FBFF, 0x6CA2FBFF, 0x6C90FBFF, 0x6CB0FBFF, 0x6CB2FBFF};
+	std::vector<uchar> buf;
+	for(uint i = 0; buf.size() < (256u << 20); ++i)
+	{
+		auto raw = s_headers[(i * 7 + i / 3) % (sizeof(s_headers) / sizeof(*s_headers))];
+		auto offset = buf.size();
+		buf.resize(offset + CHeader(raw).getFrameSize());
+		memcpy(&buf[offset], &raw, sizeof(raw));
+	}
+
+	// The CPU time is the total work of the threads: the stitching overhead shows
+	// even when the threads outnumber the cores (and share them)
+	LOG("Parallel indexing (" << (buf.size() >> 20) << " MB VBR stream, " << std::thread::hardware_concurrency() << " cores)");
+	for(bool columns : {false, true})
+	{
+		LOG((columns ? "  with range stats and side info" : "  frame table only"));
+		LOG("  threads   ms        speedup   CPU ms");
+		double base = 0;
+		auto maxThreads = std::max(4u, std::thread::hardware_concurrency());
+		for(uint threads = 1; threads <= maxThreads; threads *= 2)
+		{
+			MPEG::Options options;
+			options.Borrow = true;
+			options.Threads = threads;
+			options.RangeStats = columns;
+			options.SideInfo = columns;
+			auto cpu = std::clock();
+			auto t = measure([&]{ s_sink += MPEG::IStream::create(&buf[0], buf.size(), options)->getFrameCount(); });
+			cpu = (std::clock() - cpu) / 3;
+			if(threads == 1)
+				base = t;
+			LOG("  " << threads << "\t\t" << (t * 1e3) << "\t" << (base / t) << "\t" << (cpu * 1e3 / CLOCKS_PER_SEC));
+		}
+	}
+}
+
+
+/******************************************************************************
+ * Sidecar index
+ *****************************************************************************/
+static void bench_sidecar()
+{
+	static const uint s_headers[] = {0x6CA0FBFF, 0x6CA2FBFF, 0x6C90FBFF, 0x6CB0FBFF, 0x6CB2FBFF};
+	std::vector<uchar> buf;
+	for(uint i = 0; buf.size() < (64u << 20); ++i)
+	{
+		auto raw = s_headers[(i * 7 + i / 3) % (sizeof(s_headers) / sizeof(*s_headers))];
+		auto offset = buf.size();
+		buf.resize(offset + CHeader(raw).getFrameSize());
+		memcpy(&buf[offset], &raw, sizeof(raw));
+	}
+
+	const char* path = "bench_sidecar.tmp";
+	const char* index = "bench_sidecar.idx";
+	auto f = fopen(path, "wb");
+	if(!f)
+		return;
+	auto written = fwrite(&buf[0], buf.size(), 1, f);
+	fclose(f);
+	if(written != 1)
+		return;
+
+	// The first open writes the sidecar
+	remove(index);
+	MPEG::IStream::open(path, index);
+
+	auto tScan = measure([&]{ s_sink += MPEG::IStream::open(path).Stream->getFrameCount(); });
+	auto tLoad = measure([&]{ s_sink += MPEG::IStream::open(path, index).Stream->getFrameCount(); });
+	LOG("Open (" << (buf.size() >> 20) << " MB VBR file)");
+	LOG("  scan ms   sidecar ms");
+	LOG("  " << (tScan * 1e3) << "\t" << (tLoad * 1e3));
+
+	remove(path);
+	remove(index);
+}
+
+
+/******************************************************************************
+ * Editing
+ *****************************************************************************/
+static void bench_cut()
+{
+	static const uint s_headers[] = {0x6CA0FBFF, 0x6CA2FBFF, 0x6C90FBFF, 0x6CB0FBFF, 0x6CB2FBFF};
+	LOG("Cuts (VBR MPEG 1 layer III)");
+	LOG("  frames    cuts      us/cut    batch us/range  ranges us  copy us");
+	for(uint nFrames : {100000u, 500000u})
+	{
+		std::vector<uchar> buf;
+		for(uint i = 0; i < nFrames; ++i)
+		{
+			auto raw = s_headers[(i * 7 + i / 3) % (sizeof(s_headers) / sizeof(*s_headers))];
+			auto offset = buf.size();
+			buf.resize(offset + CHeader(raw).getFrameSize());
+			memcpy(&buf[offset], &raw, sizeof(raw));
+		}
+
+		const uint cuts = 50;
+		MPEG::Options options;
+		options.Borrow = true;
+		auto stream = MPEG::IStream::create(&buf[0], buf.size(), options);
+		auto t = measure([&]
+		{
+			for(uint i = 0; i < cuts; ++i)
+				stream->cut((i * 7919) % (stream->getFrameCount() - 100), 10);
+		}, 1);
+
+		// The same number of ranges at once
+		std::vector<MPEG::EditRange> ranges;
+		for(uint i = 0; i < cuts; ++i)
+			ranges.push_back({i * (nFrames / cuts), 10, true});
+		stream = MPEG::IStream::create(&buf[0], buf.size(), options);
+		std::vector<unsigned> removed;
+		auto tBatch = measure([&]{ s_sink += stream->edit(ranges, removed); }, 1);
+
+		// Serializing the edited stream: the ranges for writev() vs. a copy
+		std::vector<iovec> iov;
+		std::vector<uchar> out;
+		auto tRanges = measure([&]{ stream->serialize(iov); s_sink += iov.size(); });
+		auto tCopy = measure([&]{ out.clear(); stream->serialize(out); s_sink += out.size(); });
+		LOG("  " << nFrames << "\t" << cuts << "\t\t" << (t * 1e6 / cuts) << "\t" << (tBatch * 1e6 / cuts) << "\t\t"
+			<< (tRanges * 1e6) << "\t" << (tCopy * 1e6));
+	}
+}
+
+
+/******************************************************************************
+ * Header decoding
+ *****************************************************************************/
+static void bench_decode()
+{
+	LOG("Per-frame header decoding (valid headers of all kinds)");
+	LOG("  CHeader ns   table ns");
+	std::vector<uint> headers;
+	for(uint key = 0; key < CDecodeTable::Size; ++key)
+	{
+		uint raw = 0xE0FF | ((key & 0xF) << 9) | (((key >> 4) & 0x7F) << 17) | ((key >> 11) * 0xC0000000);
+		if(CHeader::isValid(raw) && !CHeader(raw).isFreeBitrate())
+			headers.push_back(raw);
+	}
+	const uint runs = 1000;
+
+	auto tHeader = measure([&]
+	{
+		size_t sum = 0;
+		for(uint i = 0; i < runs; ++i)
+			for(auto raw : headers)
+			{
+				if(!CHeader::isValid(raw))
+					continue;
+				CHeader h(raw);
+				sum += h.getFrameSize() + h.getFrameDataOffset() + h.getBitrate() + size_t(h.getFrameLength() * 1e6f);
+			}
+		s_sink += sum;
+	});
+	auto tTable = measure([&]
+	{
+		size_t sum = 0;
+		for(uint i = 0; i < runs; ++i)
+			for(auto raw : headers)
+			{
+				if(!CDecodeTable::isValid(raw))
+					continue;
+				auto& info = CDecodeTable::get(raw);
+				sum += info.FrameSize + info.SideInfoSize + info.Bitrate + size_t(info.Length * 1e6f);
+			}
+		s_sink += sum;
+	});
+
+	auto n = double(runs) * headers.size();
+	LOG("  " << (tHeader * 1e9 / n) << "		" << (tTable * 1e9 / n));
+}
+
+
+/******************************************************************************
+ * Free-format streams
+ *****************************************************************************/
+// A normal frame, free-format frames of 1000 slots (44.1 kHz) with random data, every third one padded,
+// and a normal frame again (a stream must have a non-free-bitrate frame)
+static std::vector<uchar> genFreeStream(uint f_frames)
+{
+	std::mt19937 rng(0xF4EE);
+	const uint normal = 0x6CA0FBFF;
+	std::vector<uchar> buf(CHeader(normal).getFrameSize());
+	memcpy(&buf[0], &normal, sizeof(normal));
+	for(uint i = 0; i < f_frames; ++i)
+	{
+		uint raw = (i % 3) ? 0x6C00FBFF : 0x6C02FBFF;
+		auto offset = buf.size();
+		buf.resize(offset + 1000 + !(i % 3));
+		memcpy(&buf[offset], &raw, sizeof(raw));
+		for(auto j = offset + sizeof(raw); j < buf.size(); ++j)
+			buf[j] = static_cast<uchar>(rng() % 0xFF);
+	}
+	auto offset = buf.size();
+	buf.resize(offset + CHeader(normal).getFrameSize());
+	memcpy(&buf[offset], &normal, sizeof(normal));
+	return buf;
+}
+
+static void bench_free_format()
+{
+	LOG("Free-format frame sizing (layer III, 1000 slots)");
+	LOG("  frames    scan ms   predicted ms   index ms");
+	for(uint nFrames : {10000u, 50000u})
+	{
+		auto buf = genFreeStream(nFrames);
+		auto first = CHeader(0x6CA0FBFF).getFrameSize();
+
+		// Every frame scanned for the next header vs. the size cached from the previous frames
+		auto walk = [&](bool f_predict)
+		{
+			uint slots = 0;
+			size_t offset = first;
+			for(uint i = 0; i < nFrames; ++i)
+			{
+				CHeader h(*reinterpret_cast<const uint*>(&buf[offset]));
+				auto size = f_predict ? h.calcFrameSize(&buf[offset], buf.size() - offset, slots)
+									  : h.calcFrameSize(&buf[offset], buf.size() - offset);
+				if(!size)
+					break;
+				offset += size;
+			}
+			s_sink += offset;
+		};
+		auto tScan = measure([&]{ walk(false); }, 1);
+		auto tPredicted = measure([&]{ walk(true); });
+
+		MPEG::Options options;
+		options.Borrow = true;
+		auto tIndex = measure([&]{ s_sink += MPEG::IStream::create(&buf[0], buf.size(), options)->getFrameCount(); });
+		LOG("  " << nFrames << "\t" << (tScan * 1e3) << "\t" << (tPredicted * 1e3) << "\t\t" << (tIndex * 1e3));
+	}
+}
+
+
+/******************************************************************************
+ * Leading ID3v2 tag (cover art)
+ *****************************************************************************/
+static void bench_id3()
+{
+	LOG("First header search behind an ID3v2 tag of random data");
+	LOG("  tag (MB)    scan ms       skip ms");
+	std::mt19937 rng(0x1D3);
+	const uint frame = 0x6CA0FBFF;
+	for(size_t mb = 1; mb <= 8; mb *= 2)
+	{
+		// The synchsafe size, the tag data and a few frames
+		auto size = mb << 20;
+		std::vector<uchar> buf = {'I', 'D', '3', 3, 0, 0};
+		for(int shift = 21; shift >= 0; shift -= 7)
+			buf.push_back(static_cast<uchar>((size >> shift) & 0x7F));
+		for(size_t i = 0; i < size; ++i)
+			buf.push_back(static_cast<uchar>(rng()));
+		auto audio = buf.size();
+		for(uint i = 0; i < 10; ++i)
+		{
+			auto offset = buf.size();
+			buf.resize(offset + CHeader(frame).getFrameSize());
+			memcpy(&buf[offset], &frame, sizeof(frame));
+		}
+
+		size_t scanned = 0, skipped = 0;
+		auto tScan = measure([&]{ scanned = baselineFirstHeaderOffset(&buf[0], buf.size()); }, 1);
+		auto tSkip = measure([&]{ skipped = MPEG::IStream::calcFirstHeaderOffset(&buf[0], buf.size()); });
+		LOG("  " << mb << "\t\t" << (tScan * 1e3) << "\t\t" << (tSkip * 1e3) << ((scanned != audio) ? "\t(the scan stops in the tag)" : ""));
+		if(skipped != audio)
+			LOG("  unexpected first header offset " << skipped);
+	}
+}
+
+
+/******************************************************************************
+ * Bitrate of frame windows
+ *****************************************************************************/
+static void bench_range_stats()
+{
+	static const uint s_headers[] = {0x6CA0FBFF, 0x6CA2FBFF, 0x6C90FBFF, 0x6CB0FBFF, 0x6CE0FBFF};
+	LOG("Average / peak bitrate of windows (VBR, 500000 frames)");
+	LOG("  window    loop us/query  stats us/query  build ms");
+	const uint nFrames = 500000;
+	std::vector<uchar> buf;
+	for(uint i = 0; i < nFrames; ++i)
+	{
+		auto raw = s_headers[(i * 7 + i / 3) % (sizeof(s_headers) / sizeof(*s_headers))];
+		auto offset = buf.size();
+		buf.resize(offset + CHeader(raw).getFrameSize());
+		memcpy(&buf[offset], &raw, sizeof(raw));
+	}
+
+	MPEG::Options options;
+	options.Borrow = true;
+	auto stream = MPEG::IStream::create(&buf[0], buf.size(), options);
+	// The first query builds the statistics
+	auto tBuild = measure([&]{ s_sink += static_cast<size_t>(stream->getMaxBitrate(0, 1)); }, 1);
+
+	// 10 s, 1 min and 10 min windows at 38 frames per second
+	for(uint window : {383u, 2297u, 22969u})
+	{
+		const uint queries = 1000;
+		auto tLoop = measure([&]
+		{
+			for(uint q = 0; q < queries; ++q)
+			{
+				auto first = (q * 7919) % (nFrames - window);
+				uint64_t bytes = 0;
+				uint peak = 0;
+				for(auto i = first; i < first + window; ++i)
+				{
+					auto size = stream->getFrameSize(i);
+					bytes += size;
+					peak = std::max(peak, size);
+				}
+				s_sink += bytes + peak;
+			}
+		}, 1);
+		auto tStats = measure([&]
+		{
+			for(uint q = 0; q < queries; ++q)
+			{
+				auto first = (q * 7919) % (nFrames - window);
+				s_sink += static_cast<size_t>(stream->getAverageBitrate(first, window) + stream->getMaxBitrate(first, window));
+			}
+		});
+		LOG("  " << window << "		" << (tLoop * 1e6 / queries) << "		" << (tStats * 1e6 / queries) << "		" << (tBuild * 1e3));
+	}
+}
+
+
+/******************************************************************************
+ * Segmenting
+ *****************************************************************************/
+static void bench_segment()
+{
+	static const uint s_headers[] = {0x6CA0FBFF, 0x6CA2FBFF, 0x6C90FBFF, 0x6CB0FBFF, 0x6CB2FBFF};
+	LOG("10 s segments (VBR MPEG 1 layer III)");
+	LOG("  frames    segments  copy+cut ms/segment  segment ms  playlist ms");
+	for(uint nFrames : {100000u, 500000u})
+	{
+		std::vector<uchar> buf;
+		for(uint i = 0; i < nFrames; ++i)
+		{
+			auto raw = s_headers[(i * 7 + i / 3) % (sizeof(s_headers) / sizeof(*s_headers))];
+			auto offset = buf.size();
+			buf.resize(offset + CHeader(raw).getFrameSize());
+			memcpy(&buf[offset], &raw, sizeof(raw));
+		}
+		auto stream = MPEG::IStream::create(&buf[0], buf.size());
+		MPEG::SegmentOptions options;
+		std::vector<MPEG::Segment> segments;
+		auto tSegment = measure([&]{ stream->segment(options, segments); s_sink += segments.size(); });
+		auto tPlaylist = measure([&]{ s_sink += MPEG::IStream::playlist(segments, stream->getSamplingRate(),
+																		[](size_t f_index) { return std::to_string(f_index) + ".mp3"; }).size(); });
+
+		// The way it was done before: a stream copy cut down to every segment (a few segments only)
+		const uint legacy = 5;
+		auto tLegacy = measure([&]
+		{
+			for(uint i = 0; i < legacy; ++i)
+			{
+				auto& segment = segments[i * segments.size() / legacy];
+				auto copy = MPEG::IStream::create(&buf[0], buf.size());
+				copy->truncate(segment.Frame + segment.Count);
+				copy->cut(0, segment.Frame);
+				std::vector<uchar> out;
+				copy->serialize(out);
+				s_sink += out.size();
+			}
+		}, 1);
+		LOG("  " << nFrames << "\t" << segments.size() << "\t\t" << (tLegacy * 1e3 / legacy) << "\t\t\t" << (tSegment * 1e3) <<
+			"\t" << (tPlaylist * 1e3));
+	}
+}
+
+
+/******************************************************************************
+ * Layer III side information
+ *****************************************************************************/
+static void bench_side_info()
+{
+	static const uint s_headers[] = {0x6CA0FBFF, 0x6CA2FBFF, 0x6C90FBFF, 0x6CB0FBFF, 0x6CB2FBFF};
+	LOG("Side information columns (VBR MPEG 1 layer III stereo, random payload)");
+	LOG("  frames    index ms  +side info ms  ns/frame  bytes/frame  gain scan ms");
+	std::mt19937 rng(0x5D);
+	for(uint nFrames : {100000u, 500000u})
+	{
+		std::vector<uchar> buf;
+		for(uint i = 0; i < nFrames; ++i)
+		{
+			auto raw = s_headers[(i * 7 + i / 3) % (sizeof(s_headers) / sizeof(*s_headers))];
+			auto offset = buf.size();
+			buf.resize(offset + CHeader(raw).getFrameSize());
+			memcpy(&buf[offset], &raw, sizeof(raw));
+			for(auto j = offset + sizeof(raw); j < offset + sizeof(raw) + 32; ++j)
+				buf[j] = static_cast<uchar>(rng());
+		}
+
+		MPEG::Options options;
+		options.Borrow = true;
+		std::shared_ptr<MPEG::IStream> plain, decoded;
+		auto tPlain = measure([&]{ plain = MPEG::IStream::create(&buf[0], buf.size(), options); });
+		options.SideInfo = true;
+		auto tDecoded = measure([&]{ decoded = MPEG::IStream::create(&buf[0], buf.size(), options); });
+		auto bytes = double(decoded->getIndexMemoryUsage() - plain->getIndexMemoryUsage()) / nFrames;
+
+		// A loudness estimate: the average quantizer step over all the granules
+		auto tGain = measure([&]
+		{
+			uint64_t sum = 0;
+			MPEG::SideInfo info;
+			for(uint i = 0; i < decoded->getFrameCount(); ++i)
+			{
+				decoded->getSideInfo(i, info);
+				for(uint gr = 0; gr < info.Granules; ++gr)
+					sum += info.GlobalGain[gr][0] + info.GlobalGain[gr][1];
+			}
+			s_sink += sum;
+		});
+		LOG("  " << nFrames << "\t" << (tPlain * 1e3) << "\t" << (tDecoded * 1e3) << "\t" <<
+			((tDecoded - tPlain) * 1e9 / nFrames) << "\t" << bytes << "\t\t" << (tGain * 1e3));
+	}
+}
+
+
+int main(int, char**)
+{
+	bench_first_header();
+	bench_id3();
+	bench_index_memory();
+	bench_decode();
+	bench_cbr();
+	bench_parallel();
+	bench_sidecar();
+	bench_cut();
+	bench_free_format();
+	bench_range_stats();
+	bench_segment();
+	bench_side_info();
+	return 0;
+}
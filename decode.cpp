@@ -0,0 +1,110 @@
+#include "decode.h"
+
+#include "header_raw.h"
+
+
+// All the tables are the same as in CHeader (header.cpp), but usable at compile time
+namespace
+{
+	struct Tables
+	{
+		// kbps: V1 L1, V1 L2, V1 L3, V2 L1, V2 L2/L3
+		uint Bitrate[5][16];
+		uint Frequency[4][3];
+		// Samples Per Frame / 8 (layer I value is in slots, 4 bytes each)
+		uint SPF8[2][3];
+		uint SPF[2][3];
+		uint SlotSize[3];
+		uint SideInfo[2][2];
+		// MPEG 1 layer II: allowed bitrates [bitrate][mono]
+		bool Layer2[16][2];
+	};
+
+	constexpr Tables c_tables =
+	{
+		{
+			{0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448, 0},
+			{0, 32, 48, 56,  64,  80,  96, 112, 128, 160, 192, 224, 256, 320, 384, 0},
+			{0, 32, 40, 48,  56,  64,  80,  96, 112, 128, 160, 192, 224, 256, 320, 0},
+			{0, 32, 48, 56,  64,  80,  96, 112, 128, 144, 160, 176, 192, 224, 256, 0},
+			{0,  8, 16, 24,  32,  40,  48,  56,  64,  80,  96, 112, 128, 144, 160, 0}
+		},
+		{
+			{11025, 12000,  8000},
+			{    0,     0,     0},
+			{22050, 24000, 16000},
+			{44100, 48000, 32000}
+		},
+		// Indexed by the raw layer value - 1 (III, II, I)
+		{
+			{144, 144, 12},
+			{ 72, 144, 12}
+		},
+		{
+			{1152, 1152, 384},
+			{ 576, 1152, 384}
+		},
+		{1, 1, 4},
+		{
+			{32, 17},
+			{17,  9}
+		},
+		{
+			{ true,  true}, {false,  true}, {false,  true}, {false,  true},
+			{ true,  true}, {false,  true}, { true,  true}, { true,  true},
+			{ true,  true}, { true,  true}, { true,  true}, { true, false},
+			{ true, false}, { true, false}, { true, false}, {false, false}
+		}
+	};
+
+	constexpr HeaderInfo makeInfo(uint f_key)
+	{
+		HeaderInfo info = {0.0f, 0, 0, 0, 0, false};
+
+		auto layer		= f_key & 0x3;
+		auto version	= (f_key >> 2) & 0x3;
+		auto padding	= (f_key >> 4) & 0x1;
+		auto sampling	= (f_key >> 5) & 0x3;
+		auto bitrate	= (f_key >> 7) & 0xF;
+		auto mono		= (f_key >> 11) & 0x1;
+
+		if(layer == Header::LayerReserved ||
+		   version == static_cast<uint>(MPEG::Version::vReserved) ||
+		   bitrate == Header::BitrateBad ||
+		   sampling == Header::SamplingRateReserved)
+			return info;
+		if(version == static_cast<uint>(MPEG::Version::v1) && layer == Header::Layer2 && !c_tables.Layer2[bitrate][mono])
+			return info;
+
+		auto v2 = (version != static_cast<uint>(MPEG::Version::v1)) ? 1u : 0u;
+		auto i = layer - 1;
+		auto frequency = c_tables.Frequency[version][sampling];
+
+		info.Valid = true;
+		info.Samples = static_cast<ushort>(c_tables.SPF[v2][i]);
+		info.Length = static_cast<float>(c_tables.SPF[v2][i]) / frequency;
+		info.Bitrate = static_cast<ushort>(c_tables.Bitrate[v2 ? (3 + (layer != Header::Layer1)) : (3 - layer)][bitrate]);
+		info.FrameSize = static_cast<ushort>(
+			((c_tables.SPF8[v2][i] * info.Bitrate * 1000 / frequency) + padding) * c_tables.SlotSize[i]);
+		if(!info.Bitrate)
+			info.FrameSize = 0;
+		info.SideInfoSize = static_cast<uchar>((layer == Header::Layer3) ? c_tables.SideInfo[v2][mono] : 0);
+		return info;
+	}
+
+	constexpr CDecodeTable::Table makeTable()
+	{
+		CDecodeTable::Table table = {};
+		for(uint key = 0; key < CDecodeTable::Size; ++key)
+			table.Entries[key] = makeInfo(key);
+		return table;
+	}
+
+	// MPEG 1 layer III, 128 kbps, 44.1 kHz, padded, joint stereo (0x6C92FBFF)
+	static_assert(makeInfo(0x0D | (0x49 << 4)).FrameSize == 418, "Invalid decode table");
+	static_assert(makeInfo(0x0D | (0x49 << 4)).SideInfoSize == 32, "Invalid decode table");
+}
+
+const uint CDecodeTable::Size;
+// Constant initialization: the table is generated at compile time
+const CDecodeTable::Table CDecodeTable::s_table = makeTable();
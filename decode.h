@@ -0,0 +1,57 @@
+#pragma once
+
+#include "common.h"
+
+
+// Everything the frame index needs from a header, precomputed for all the combinations
+// of version, layer, bitrate, sampling rate, padding and mono / non-mono channel mode
+struct HeaderInfo
+{
+	// Seconds
+	float	Length;
+	// 0 - free bitrate
+	ushort	FrameSize;
+	ushort	Samples;
+	// kbps, 0 - free bitrate
+	ushort	Bitrate;
+	uchar	SideInfoSize;
+	// Version, layer, bitrate, sampling rate and the MPEG 1 layer II mode check
+	bool	Valid;
+};
+
+
+class CDecodeTable
+{
+public:
+	// Header bits (raw little-endian layout):
+	//   9..12 - layer + version, 17..23 - padding + sampling rate + bitrate, 30..31 - channel mode
+	static uint					getKey		(uint f_header)
+	{
+		return ((f_header >> 9) & 0xF) |
+			   ((f_header >> 13) & 0x7F0) |
+			   // Mono (both channel mode bits set)
+			   (((f_header >> 31) & (f_header >> 30) & 1) << 11);
+	}
+
+	static const HeaderInfo&	get			(uint f_header) { return s_table.Entries[getKey(f_header)]; }
+
+	// The full header validation: sync, reserved emphasis and the table bits
+	static bool					isValid		(uint f_header)
+	{
+		static const uint SyncMask = 0xE0FF;
+		return ((f_header & SyncMask) == SyncMask) &&
+			   (((f_header >> 24) & 0x3) != 2 /*reserved emphasis*/) &&
+			   get(f_header).Valid;
+	}
+
+public:
+	static const uint Size = 1 << 12;
+
+	struct Table
+	{
+		HeaderInfo Entries[Size];
+	};
+
+private:
+	static const Table s_table;
+};
@@ -1,6 +1,7 @@
 #include "header.h"
 
 #include "common.h"
+#include "sync.h"
 
 
 /******************************************************************************
@@ -92,16 +93,39 @@ uint CHeader::calcFrameSize(const uchar* f_data, size_t f_size)
 	if(size > f_size)
 		size = static_cast<uint>(f_size);
 
+	// Jump over non-sync bytes
 	for(size_t o = CHeader::getSize(); o + CHeader::getSize() <= size; ++o)
 	{
-		auto rawHeader = *reinterpret_cast<const uint*>(f_data + o);
-		if(CHeader::isValid(rawHeader) && isValidSize(o))
+		o += CSync::find(f_data + o, size - o);
+		if(o + CHeader::getSize() <= size && isValidSize(o))
 			return o;
 	}
 
 	return 0;
 }
 
+uint CHeader::calcFrameSize(const uchar* f_data, size_t f_size, uint& f_slots)
+{
+	ASSERT(isFreeBitrate());
+
+	if(f_slots)
+	{
+		auto size = (f_slots + m_header.Padding) * s_slotSize[m_header.Layer - 1];
+		if(size + CHeader::getSize() <= f_size && isValid(*reinterpret_cast<const uint*>(f_data + size)))
+			return size;
+	}
+
+	auto size = calcFrameSize(f_data, f_size);
+	if(size)
+		f_slots = getSlotCount(size);
+	return size;
+}
+
+uint CHeader::getSlotCount(uint f_size) const
+{
+	return f_size / s_slotSize[m_header.Layer - 1] - m_header.Padding;
+}
+
 bool CHeader::isValidSize(uint f_size) const
 {
 	uint i = m_header.Layer - 1;
@@ -116,15 +140,43 @@ bool CHeader::isValidSize(uint f_size) const
 	return (y * spf8 == x);
 }
 
+void CHeader::getFreeSizes(uint& f_min, uint& f_step, uint& f_max) const
+{
+	ASSERT(isFreeBitrate());
+	uint i = m_header.Layer - 1;
+
+	// isValidSize(): (slots - padding) * sampling rate is a multiple of spf8
+	auto spf8 = s_SPF8[m_header.isV2()][i];
+	auto gcd = spf8;
+	for(auto b = getSamplingRate(); b; )
+	{
+		auto r = gcd % b;
+		gcd = b;
+		b = r;
+	}
+	f_step = spf8 / gcd * s_slotSize[i];
+
+	// The frame holds its header at least
+	f_min = m_header.Padding * s_slotSize[i];
+	while(f_min < getSize())
+		f_min += f_step;
+	f_max = getFrameSize(getBitrate(Header::BitrateBad - 1));
+}
+
 
 float CHeader::getFrameLength() const
 {
-	static const float s_SPF[][3] =
+	return static_cast<float>(getFrameSamples()) / getSamplingRate();
+}
+
+uint CHeader::getFrameSamples() const
+{
+	static const uint s_SPF[][3] =
 	{
-		{1152.0, 1152.0, 384.0},
-		{ 576.0, 1152.0, 384.0}
+		{1152, 1152, 384},
+		{ 576, 1152, 384}
 	};
-	return s_SPF[m_header.isV2()][m_header.Layer - 1] / getSamplingRate();
+	return s_SPF[m_header.isV2()][m_header.Layer - 1];
 }
 
 
@@ -140,6 +192,14 @@ uint CHeader::getSideInfoSize() const
 		   : 0;
 }
 
+uint CHeader::getMainDataBegin(const uchar* f_frame) const
+{
+	ASSERT(m_header.Layer == Header::Layer3);
+	auto p = f_frame + getSize() + (isProtected() ? 2 : 0);
+	// 9 bits in MPEG 1, 8 bits in MPEG 2 / 2.5
+	return m_header.isV2() ? p[0] : ((p[0] << 1) | (p[1] >> 7));
+}
+
 /******************************************************************************
  * Xing Header
  *****************************************************************************/
@@ -149,6 +209,14 @@ static uint fromBigEndian(const uint* f_pBE)
 	return (static_cast<uint>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
 }
 
+static void toBigEndian(uchar* f_pBE, uint f_value)
+{
+	f_pBE[0] = static_cast<uchar>(f_value >> 24);
+	f_pBE[1] = static_cast<uchar>(f_value >> 16);
+	f_pBE[2] = static_cast<uchar>(f_value >> 8);
+	f_pBE[3] = static_cast<uchar>(f_value);
+}
+
 CXingHeader::CXingHeader(const uchar* f_data, size_t f_size):
 	CHeader(*reinterpret_cast<const uint*>(f_data)),
 	m_vbr(false),
@@ -199,3 +267,106 @@ CXingHeader::CXingHeader(const uchar* f_data, size_t f_size):
 	}
 }
 
+std::unique_ptr<CXingFrame> CXingFrame::create(uint f_header, bool f_vbr)
+{
+	Header raw(f_header);
+	if(raw.Layer != Header::Layer3 || raw.isFreeBitrate())
+		return nullptr;
+	// No CRC, no padding
+	raw.Protection = 1;
+	raw.Padding = 0;
+
+	// The tag, the flags, the frames, the bytes and the TOC
+	static const uint FieldsSize = 4 * sizeof(uint) + 100;
+	for(uint bitrate = f_vbr ? 1 : raw.Bitrate; bitrate < Header::BitrateBad; ++bitrate)
+	{
+		raw.Bitrate = bitrate;
+		CHeader header(raw.uCell);
+		auto size = header.getFrameSize();
+		auto p = header.getFrameDataOffset();
+		if(p + FieldsSize > size)
+			continue;
+
+		std::vector<uchar> data(size, 0);
+		memcpy(&data[0], &raw.uCell, sizeof(raw.uCell));
+		memcpy(&data[p], f_vbr ? "Xing" : "Info", sizeof(uint));
+		toBigEndian(&data[p + sizeof(uint)], static_cast<uint>(CXingHeader::Flags::Frames) |
+											 static_cast<uint>(CXingHeader::Flags::Bytes) |
+											 static_cast<uint>(CXingHeader::Flags::TOC));
+		return std::make_unique<CXingFrame>(&data[0], size);
+	}
+	return nullptr;
+}
+
+void CXingFrame::sync()
+{
+	// The counts follow the "Xing" tag and the flags
+	auto p = &m_data[m_header.getFrameDataOffset() + 2 * sizeof(uint)];
+	if(m_header.m_flags & static_cast<uint>(CXingHeader::Flags::Frames))
+	{
+		toBigEndian(p, m_header.m_frames);
+		p += sizeof(uint);
+	}
+	if(m_header.m_flags & static_cast<uint>(CXingHeader::Flags::Bytes))
+		toBigEndian(p, m_header.m_bytes);
+
+	m_header.m_modified = false;
+}
+
+/******************************************************************************
+ * VBRI Header
+ *****************************************************************************/
+static uint fromBigEndian(const uchar* f_p, uint f_size)
+{
+	uint value = 0;
+	for(uint i = 0; i < f_size; ++i)
+		value = (value << 8) | f_p[i];
+	return value;
+}
+
+bool CVbriHeader::isValid(const uchar* f_data, size_t f_size)
+{
+	if(f_size < Size || *reinterpret_cast<const uint*>(f_data) != FOUR_CC('V','B','R','I'))
+		return false;
+
+	// The seek table must fit into the frame
+	auto entries = fromBigEndian(f_data + 18, 2);
+	auto entrySize = fromBigEndian(f_data + 22, 2);
+	return (entrySize >= 1 && entrySize <= 4 && Size + entries * entrySize <= f_size);
+}
+
+CVbriHeader::CVbriHeader(const uchar* f_data, size_t f_size):
+	CHeader(*reinterpret_cast<const uint*>(f_data))
+{
+	ASSERT(f_size >= Offset);
+	auto p = f_data + Offset;
+	ASSERT(isValid(p, f_size - Offset));
+
+	m_delay			 = fromBigEndian(p +  6, 2);
+	m_quality		 = fromBigEndian(p +  8, 2);
+	m_bytes			 = fromBigEndian(p + 10, 4);
+	m_frames		 = fromBigEndian(p + 14, 4);
+	auto entries	 = fromBigEndian(p + 18, 2);
+	auto scale		 = fromBigEndian(p + 20, 2);
+	auto entrySize	 = fromBigEndian(p + 22, 2);
+	m_framesPerEntry = fromBigEndian(p + 24, 2);
+
+	p += Size;
+	m_offsets.reserve(entries + 1);
+	m_offsets.push_back(f_size);
+	for(uint i = 0; i < entries; ++i, p += entrySize)
+		m_offsets.push_back(m_offsets.back() + static_cast<size_t>(fromBigEndian(p, entrySize)) * scale);
+}
+
+size_t CVbriHeader::getSeekOffset(uint f_frame) const
+{
+	ASSERT(hasSeekInfo());
+
+	auto entry = f_frame / m_framesPerEntry;
+	if(entry >= getEntryCount())
+		return m_offsets.back();
+
+	auto a = m_offsets[entry];
+	auto b = m_offsets[entry + 1];
+	return a + (b - a) * (f_frame % m_framesPerEntry) / m_framesPerEntry;
+}
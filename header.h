@@ -4,6 +4,8 @@
 #include "header_raw.h"
 #include "common.h"
 
+#include <cstring>
+#include <memory>
 #include <vector>
 
 
@@ -43,9 +45,21 @@ public:
 	// Complex
 	uint						getFrameSize		() const { ASSERT(!isFreeBitrate()); return getFrameSize(getBitrate()); }
 	float						getFrameLength		() const;
+	uint						getFrameSamples		() const;
 	uint						getFrameDataOffset	() const { return getSize() + getSideInfoSize(); }
+	// Layer III: the number of bytes of the previous frames (the bit reservoir) the main data of the frame
+	// starts with: main_data_begin, the first side information field (after the CRC if any)
+	uint						getMainDataBegin	(const uchar* f_frame) const;
 
 	uint						calcFrameSize		(const uchar* f_data, size_t f_size);
+	// The same for a free-format stream with its slot count (0 - unknown yet, updated by the call):
+	// the frames differ by the padding only, so the next header is expected right after the known size.
+	// The data is scanned only if it is not there
+	uint						calcFrameSize		(const uchar* f_data, size_t f_size, uint& f_slots);
+	// The frame size in slots without padding
+	uint						getSlotCount		(uint f_size) const;
+	// The sizes a free-bitrate frame may take: f_min + k * f_step up to f_max (the size at the largest bitrate)
+	void						getFreeSizes		(uint& f_min, uint& f_step, uint& f_max) const;
 
 	bool						operator==			(const CHeader& f_header) const { return (m_header == f_header.m_header); }
 	bool						operator!=			(const CHeader& f_header) const { return !(*this == f_header); }
@@ -88,6 +102,15 @@ public:
 	uint getByteCount	() const { return m_bytes;      }
 	uint getTOCsOffset	() const { return m_TOCsOffset; }
 	uint getQuality		() const { return m_quality;    }
+	bool hasTOC			() const { return (m_flags & static_cast<uint>(Flags::TOC)); }
+	// The frame / byte counts differ from the serialized ones
+	bool isModified		() const { return m_modified; }
+	// Frames, bytes and TOC: enough to seek without a frame index
+	bool hasSeekInfo	() const
+	{
+		static const uint Mask = static_cast<uint>(Flags::Frames) | static_cast<uint>(Flags::Bytes) | static_cast<uint>(Flags::TOC);
+		return ((m_flags & Mask) == Mask) && m_frames && m_bytes;
+	}
 	// Setters
 	void setFrameCount(uint f_frames)
 	{
@@ -164,6 +187,11 @@ public:
 		return CXingHeader::isValid(f_data + dataOffset, f_size - dataOffset) ? size : 0;
 	}
 
+	// A new Xing (VBR) / Info (CBR) frame of a layer III stream with zero frames, bytes and TOC fields.
+	// The bitrate of the header is kept for CBR if the fields fit (the lowest fitting one is used otherwise),
+	// null if none fits
+	static std::unique_ptr<CXingFrame> create(uint f_header, bool f_vbr);
+
 	CXingFrame(const uchar* f_data, size_t f_size):
 		m_header(f_data, f_size),
 		m_data(f_size)
@@ -173,16 +201,111 @@ public:
 	CXingFrame() = delete;
 
 	CXingHeader& getHeader() { return m_header; }
+	const CXingHeader& getHeader() const { return m_header; }
+	size_t getFrameSize() const { return m_data.size(); }
+	// 100 TOC entries or nullptr
+	const uchar* getTOC() const { return m_header.hasTOC() ? &m_data[m_header.getTOCsOffset()] : nullptr; }
+	// Replace the 100 TOC entries (if the frame has a TOC)
+	void setTOC(const uchar* f_toc)
+	{
+		if(m_header.hasTOC())
+			memcpy(&m_data[m_header.getTOCsOffset()], f_toc, 100);
+	}
 
-	void serialize(std::vector<uchar>& /*f_outStream*/)
+	// The frame with the modified counts written back (the counts missing in the frame are not added)
+	const uchar* getData()
+	{
+		if(m_header.isModified())
+			sync();
+		return &m_data[0];
+	}
+	void serialize(std::vector<uchar>& f_outStream)
 	{
-		ASSERT(!"Not implemented");
-		//if(m_header.isModified())
-		//	sync();
+		auto data = getData();
+		f_outStream.insert(f_outStream.end(), data, data + m_data.size());
 	}
 
+private:
+	void sync();
+
 private:
 	CXingHeader m_header;
 	std::vector<uchar> m_data;
 };
 
+// ====================================
+// VBRI Header (Fraunhofer encoder)
+// Always 32 bytes after the MPEG header, followed by a scaled seek table
+// https://www.codeproject.com/articles/8295/mpeg-audio-frame-header#VBRIHeader
+class CVbriHeader : public CHeader
+{
+public:
+	// Relative to the beginning of the frame
+	static const uint Offset	= 4 + 32;
+	// The fixed part ("VBRI" ... frames per table entry)
+	static const uint Size		= 26;
+
+	static bool isValid(const uchar* f_data, size_t f_size);
+
+public:
+	CVbriHeader(const uchar* f_data, size_t f_size);
+	CVbriHeader() = delete;
+
+	uint getDelay			() const { return m_delay;			}
+	uint getQuality			() const { return m_quality;		}
+	uint getFrameCount		() const { return m_frames;			}
+	uint getByteCount		() const { return m_bytes;			}
+	uint getFramesPerEntry	() const { return m_framesPerEntry;	}
+	uint getEntryCount		() const { return static_cast<uint>(m_offsets.size()) - 1; }
+
+	bool hasSeekInfo		() const { return m_frames && m_bytes && getEntryCount() && m_framesPerEntry; }
+
+	// An offset of a frame relative to the beginning of the VBRI frame,
+	// interpolated inside a table entry
+	size_t getSeekOffset(uint f_frame) const;
+
+private:
+	// All the serialized fields are Big-Endian
+	uint m_delay;
+	uint m_quality;
+	// The number of "real" data frames (without VBRI)
+	uint m_frames;
+	// The size of the stream
+	uint m_bytes;
+	uint m_framesPerEntry;
+	// Prefix sums of the scaled table entries starting from the end of the VBRI frame
+	std::vector<size_t> m_offsets;
+};
+
+
+class CVbriFrame
+{
+public:
+	static size_t getSize(const uchar* f_data, size_t f_size)
+	{
+		if(f_size < sizeof(uint))
+			return 0;
+		CHeader header(*reinterpret_cast<const uint*>(f_data));
+		if(header.isFreeBitrate() || header.getLayer() != 3)
+			return 0;
+
+		auto size = header.getFrameSize();
+		if(size > f_size || CVbriHeader::Offset + CVbriHeader::Size > size)
+			return 0;
+
+		return CVbriHeader::isValid(f_data + CVbriHeader::Offset, size - CVbriHeader::Offset) ? size : 0;
+	}
+
+	CVbriFrame(const uchar* f_data, size_t f_size):
+		m_header(f_data, f_size),
+		m_size(f_size)
+	{}
+	CVbriFrame() = delete;
+
+	const CVbriHeader& getHeader() const { return m_header; }
+	size_t getFrameSize() const { return m_size; }
+
+private:
+	CVbriHeader m_header;
+	size_t m_size;
+};
@@ -0,0 +1,492 @@
+#include "index.h"
+#include "decode.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+
+std::unique_ptr<CFrameIndex> CFrameIndex::create(const MPEG::Options& f_options, uint f_samplingRate)
+{
+	switch(f_options.Index)
+	{
+	case MPEG::IndexMode::Full:		return std::make_unique<CFullIndex>();
+	case MPEG::IndexMode::Compact:	return std::make_unique<CCompactIndex>();
+	case MPEG::IndexMode::Sparse:
+		return std::make_unique<CSparseIndex>(f_options.SparseFrames,
+											  static_cast<uint64_t>(std::max(f_options.SparseTime, 0.0f) * static_cast<double>(f_samplingRate)));
+	}
+	ASSERT(!"Unknown index mode");
+}
+
+
+void CFrameIndex::append(const FrameInfo* f_frames, uint f_count, uint64_t f_shift, uint f_lastSamples)
+{
+	for(uint i = 0; i < f_count; ++i)
+	{
+		auto frame = f_frames[i];
+		frame.Sample += f_shift;
+		push(frame, (i + 1 < f_count) ? static_cast<uint>(f_frames[i + 1].Sample - f_frames[i].Sample) : f_lastSamples);
+	}
+}
+
+
+uint CFrameIndex::findNext(uint64_t f_sample, uint f_first) const
+{
+	auto n = getCount();
+	if(f_first >= n || get(f_first).Sample > f_sample)
+		return f_first;
+
+	// get(lo).Sample <= f_sample < get(hi).Sample
+	uint lo = f_first, hi = f_first + 1;
+	for(uint step = 1; hi < n && get(hi).Sample <= f_sample; step *= 2)
+	{
+		lo = hi;
+		hi = (n - hi > step) ? (hi + step) : n;
+	}
+
+	while(hi - lo > 1)
+	{
+		auto mid = lo + (hi - lo) / 2;
+		if(get(mid).Sample <= f_sample)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return hi;
+}
+
+
+/******************************************************************************
+ * Full Index
+ *****************************************************************************/
+void CFullIndex::append(const FrameInfo* f_frames, uint f_count, uint64_t f_shift, uint)
+{
+	auto first = m_frames.size();
+	m_frames.insert(m_frames.end(), f_frames, f_frames + f_count);
+	for(auto i = first; i < m_frames.size(); ++i)
+		m_frames[i].Sample += f_shift;
+}
+
+
+void CFullIndex::shrink(uint f_count)
+{
+	if(f_count < m_frames.size())
+		m_frames.erase(m_frames.begin() + f_count, m_frames.end());
+}
+
+
+/******************************************************************************
+ * Compact Index
+ *****************************************************************************/
+const uint CCompactIndex::BlockSize;
+
+CCompactIndex::CCompactIndex():
+	m_last(0, 0, 0, 0),
+	m_lastSamples(0),
+	m_lastClass(0)
+{}
+
+
+void CCompactIndex::push(const FrameInfo& f_frame, uint f_samples)
+{
+	auto n = getCount();
+	size_t gap = 0;
+	if(n % BlockSize)
+	{
+		ASSERT(f_frame.Offset >= m_last.Offset + m_last.Size);
+		gap = f_frame.Offset - (m_last.Offset + m_last.Size);
+	}
+	else
+		m_checkpoints.push_back({f_frame.Offset, f_frame.Sample, static_cast<uint>(m_varints.size())});
+
+	auto c = getClass(f_frame, f_samples);
+	m_frames.push_back(c | (gap ? GapFlag : 0));
+	if(gap)
+		putVarint(gap);
+	if(c == ClassEscape)
+	{
+		putVarint(f_frame.Size);
+		putVarint(f_frame.DataRelOffset);
+		putVarint(f_samples);
+	}
+
+	m_last = f_frame;
+	m_lastSamples = f_samples;
+}
+
+
+uchar CCompactIndex::getClass(const FrameInfo& f_frame, uint f_samples)
+{
+	auto match = [&](const Class& f_class)
+	{
+		return (f_class.Size == f_frame.Size &&
+				f_class.DataRelOffset == f_frame.DataRelOffset &&
+				f_class.Samples == f_samples);
+	};
+
+	// Neighbour frames mostly share a class
+	if(m_lastClass < m_classes.size() && match(m_classes[m_lastClass]))
+		return m_lastClass;
+
+	for(uint i = 0; i < m_classes.size(); ++i)
+	{
+		if(match(m_classes[i]))
+			return (m_lastClass = static_cast<uchar>(i));
+	}
+
+	if(m_classes.size() == ClassEscape)
+		return ClassEscape;
+	m_classes.push_back({f_frame.Size, f_frame.DataRelOffset, f_samples});
+	return (m_lastClass = static_cast<uchar>(m_classes.size() - 1));
+}
+
+
+FrameInfo CCompactIndex::get(uint f_index) const
+{
+	FrameInfo frame(0, 0, 0, 0);
+	uint samples;
+	decode(f_index, frame, samples);
+	return frame;
+}
+
+
+uint CCompactIndex::decode(uint f_index, FrameInfo& f_frame, uint& f_samples) const
+{
+	ASSERT(f_index < getCount());
+
+	auto& cp = m_checkpoints[f_index / BlockSize];
+	auto pos = cp.Pos;
+	auto offset = cp.Offset;
+	auto sample = cp.Sample;
+
+	for(auto i = f_index - f_index % BlockSize;; ++i)
+	{
+		auto c = m_frames[i];
+		if(c & GapFlag)
+			offset += getVarint(pos);
+
+		uint size, dataRelOffset, samples;
+		if((c & ClassMask) == ClassEscape)
+		{
+			size = static_cast<uint>(getVarint(pos));
+			dataRelOffset = static_cast<uint>(getVarint(pos));
+			samples = static_cast<uint>(getVarint(pos));
+		}
+		else
+		{
+			auto& cl = m_classes[c & ClassMask];
+			size = cl.Size;
+			dataRelOffset = cl.DataRelOffset;
+			samples = cl.Samples;
+		}
+
+		if(i == f_index)
+		{
+			f_frame = FrameInfo(offset, size, sample, dataRelOffset);
+			f_samples = samples;
+			return pos;
+		}
+
+		offset += size;
+		sample += samples;
+	}
+}
+
+
+void CCompactIndex::shrink(uint f_count)
+{
+	if(f_count >= getCount())
+		return;
+
+	if(!f_count)
+	{
+		m_checkpoints.clear();
+		m_frames.clear();
+		m_varints.clear();
+		return;
+	}
+
+	m_lastClass = m_frames[f_count - 1] & ClassMask;
+	auto pos = decode(f_count - 1, m_last, m_lastSamples);
+	m_checkpoints.resize((f_count + BlockSize - 1) / BlockSize);
+	m_frames.resize(f_count);
+	m_varints.resize(pos);
+}
+
+
+size_t CCompactIndex::getMemoryUsage() const
+{
+	return m_classes.capacity() * sizeof(Class) +
+		   m_checkpoints.capacity() * sizeof(Checkpoint) +
+		   m_frames.capacity() +
+		   m_varints.capacity();
+}
+
+
+void CCompactIndex::putVarint(size_t f_value)
+{
+	for(; f_value >= 0x80; f_value >>= 7)
+		m_varints.push_back(static_cast<uchar>(f_value | 0x80));
+	m_varints.push_back(static_cast<uchar>(f_value));
+}
+
+size_t CCompactIndex::getVarint(uint& f_pos) const
+{
+	size_t value = 0;
+	for(uint shift = 0;; shift += 7)
+	{
+		auto b = m_varints[f_pos++];
+		value |= static_cast<size_t>(b & 0x7F) << shift;
+		if(!(b & 0x80))
+			return value;
+	}
+}
+
+
+/******************************************************************************
+ * Sparse Index
+ *****************************************************************************/
+CSparseIndex::CSparseIndex(uint f_frames, uint64_t f_samples):
+	m_step(f_frames ? f_frames : 1),
+	m_samples(f_samples),
+	m_data(nullptr),
+	m_size(0),
+	m_count(0),
+	m_last(0, 0, 0, 0)
+{}
+
+
+void CSparseIndex::attach(const uchar* f_data, size_t f_size)
+{
+	m_data = f_data;
+	m_size = f_size;
+}
+
+
+void CSparseIndex::push(const FrameInfo& f_frame, uint)
+{
+	bool checkpoint = m_checkpoints.empty() ||
+					  (m_count - m_checkpoints.back().Index >= m_step) ||
+					  (m_samples && f_frame.Sample - m_checkpoints.back().Frame.Sample >= m_samples) ||
+					  // A gap cannot be rescanned
+					  (f_frame.Offset != m_last.Offset + m_last.Size);
+	if(checkpoint)
+		m_checkpoints.push_back({m_count, f_frame});
+
+	m_last = f_frame;
+	++m_count;
+}
+
+
+std::vector<CSparseIndex::Checkpoint>::const_iterator CSparseIndex::getCheckpoint(uint f_index) const
+{
+	auto it = std::upper_bound(m_checkpoints.cbegin(), m_checkpoints.cend(), f_index,
+							   [](uint f_i, const Checkpoint& f_cp) { return f_i < f_cp.Index; });
+	return --it;
+}
+
+
+void CSparseIndex::next(FrameInfo& f_frame) const
+{
+	ASSERT(m_data);
+
+	// The frames were validated on push, so only the sizes need to be recalculated
+	auto raw = *reinterpret_cast<const uint*>(m_data + f_frame.Offset);
+	CHeader h(raw);
+	auto offset = f_frame.Offset + f_frame.Size;
+	CHeader n(*reinterpret_cast<const uint*>(m_data + offset));
+
+	f_frame.Sample += CDecodeTable::get(raw).Samples;
+	f_frame.Offset = offset;
+	if(n.isFreeBitrate())
+	{
+		// Free-format frames of the same size (but the padding) follow each other
+		uint slots = h.isFreeBitrate() ? h.getSlotCount(f_frame.Size) : 0;
+		f_frame.Size = n.calcFrameSize(m_data + offset, m_size - offset, slots);
+	}
+	else
+		f_frame.Size = n.getFrameSize();
+	f_frame.DataRelOffset = n.getFrameDataOffset();
+}
+
+
+FrameInfo CSparseIndex::get(uint f_index) const
+{
+	ASSERT(f_index < m_count);
+
+	auto it = getCheckpoint(f_index);
+	auto frame = it->Frame;
+	for(auto i = it->Index; i != f_index; ++i)
+		next(frame);
+	return frame;
+}
+
+
+uint CSparseIndex::findNext(uint64_t f_sample, uint f_first) const
+{
+	if(f_first >= m_count)
+		return f_first;
+
+	// The last checkpoint not after the sample (but not before f_first)
+	auto it = std::upper_bound(m_checkpoints.cbegin(), m_checkpoints.cend(), f_sample,
+							   [](uint64_t f_s, const Checkpoint& f_cp) { return f_s < f_cp.Frame.Sample; });
+	auto first = getCheckpoint(f_first);
+	if(it <= first)
+		it = first + 1;
+	--it;
+
+	auto end = ((it + 1) != m_checkpoints.cend()) ? (it + 1)->Index : m_count;
+	auto frame = it->Frame;
+	auto i = it->Index;
+	for(;; next(frame))
+	{
+		if(i >= f_first && frame.Sample > f_sample)
+			return i;
+		if(++i == end)
+			return end;
+	}
+}
+
+
+void CSparseIndex::shrink(uint f_count)
+{
+	if(f_count >= m_count)
+		return;
+
+	m_count = f_count;
+	while(!m_checkpoints.empty() && m_checkpoints.back().Index >= f_count)
+		m_checkpoints.pop_back();
+	if(f_count)
+		m_last = get(f_count - 1);
+}
+
+
+/******************************************************************************
+ * CBR Index
+ *****************************************************************************/
+const uint CCbrIndex::ProbeFrames;
+
+std::unique_ptr<CCbrIndex> CCbrIndex::detect(const uchar* f_data, size_t f_offset, size_t f_size)
+{
+	// Version, layer, bitrate, sampling rate, channel mode and emphasis are the same in all the frames,
+	// the padding bit follows the pattern, the rest doesn't affect the frame layout
+	static const uint Mask		= 0xC3FC1E00;
+	static const uint Padding	= 0x00020000;
+
+	if(f_offset + sizeof(uint) > f_size)
+		return nullptr;
+	auto first = *reinterpret_cast<const uint*>(f_data + f_offset);
+	if(!CDecodeTable::isValid(first))
+		return nullptr;
+	auto& info = CDecodeTable::get(first & ~Padding);
+	if(!info.FrameSize)
+		return nullptr;
+
+	std::unique_ptr<CCbrIndex> index(new CCbrIndex());
+	index->m_offset			= f_offset;
+	index->m_size			= info.FrameSize;
+	index->m_slot			= CDecodeTable::get(first | Padding).FrameSize - info.FrameSize;
+	index->m_dataRelOffset	= static_cast<uint>(CHeader::getSize()) + info.SideInfoSize;
+	index->m_samples		= info.Samples;
+
+	auto isFrame = [&](size_t f_pos, bool& f_padded)
+	{
+		if(f_pos + sizeof(uint) > f_size)
+			return false;
+		auto raw = *reinterpret_cast<const uint*>(f_data + f_pos);
+		f_padded = (raw & Padding);
+		return CDecodeTable::isValid(raw) && !((raw ^ first) & Mask);
+	};
+
+	// pads[i] - the number of padded frames before frame #i
+	uint64_t pads[ProbeFrames + 1] = {0};
+	size_t offset = f_offset;
+	for(uint i = 0; i < ProbeFrames; ++i)
+	{
+		bool padded;
+		if(!isFrame(offset, padded))
+			return nullptr;
+		pads[i + 1] = pads[i] + padded;
+		offset += index->m_size + (padded ? index->m_slot : 0);
+	}
+	// A short stream is left for the regular scan
+	if(offset > f_size)
+		return nullptr;
+
+	// Encoders pad a frame when the accumulated fraction of a slot exceeds one:
+	// the fraction per frame is (slots per frame * bitrate) % sampling rate / sampling rate.
+	// All or none of the frames can be padded too
+	const uint64_t den = CHeader(first).getSamplingRate();
+	const uint64_t frac = static_cast<uint64_t>(info.Samples / 8 / index->m_slot) * info.Bitrate * 1000 % den;
+	bool found = false;
+	for(uint64_t num : {frac, uint64_t(0), den})
+	{
+		// Intersect the phase ranges matching the probed frames
+		int64_t lo = 0, hi = static_cast<int64_t>(den);
+		for(uint i = 1; i <= ProbeFrames && lo < hi; ++i)
+		{
+			auto shift = static_cast<int64_t>(i * num);
+			lo = std::max<int64_t>(lo, static_cast<int64_t>(pads[i] * den) - shift);
+			hi = std::min<int64_t>(hi, static_cast<int64_t>((pads[i] + 1) * den) - shift);
+		}
+		if(lo < hi)
+		{
+			index->m_padNum		= num;
+			index->m_padDen		= den;
+			index->m_padPhase	= static_cast<uint64_t>(lo);
+			found = true;
+			break;
+		}
+	}
+	if(!found)
+		return nullptr;
+
+	// The number of frames fitting the data
+	auto average = index->m_size + index->m_slot * static_cast<double>(index->m_padNum) / den;
+	auto n = static_cast<uint64_t>((f_size - f_offset) / average);
+	while(n > ProbeFrames && index->getOffset(n) > f_size)
+		--n;
+	while(index->getOffset(n + 1) <= f_size)
+		++n;
+	if(n > std::numeric_limits<uint>::max())
+		return nullptr;
+
+	// The data after the last frame must not look like a frame (it's left for the regular scan to report)
+	auto end = index->getOffset(n);
+	if(end != f_size && (end + sizeof(uint) > f_size || CDecodeTable::isValid(*reinterpret_cast<const uint*>(f_data + end))))
+		return nullptr;
+
+	// Every computed frame must have a header of the format and the predicted padding: a corrupt frame
+	// anywhere leaves the stream to the regular scan (one header read per frame, nothing is stored)
+	bool padded;
+	offset = index->getOffset(ProbeFrames);
+	for(uint64_t i = ProbeFrames; i < n; ++i)
+	{
+		auto pad = index->getPads(i + 1) != index->getPads(i);
+		if(!isFrame(offset, padded) || padded != pad)
+			return nullptr;
+		offset += index->m_size + (pad ? index->m_slot : 0);
+	}
+
+	index->m_count = static_cast<uint>(n);
+	return index;
+}
+
+
+FrameInfo CCbrIndex::get(uint f_index) const
+{
+	ASSERT(f_index < m_count);
+	auto offset = getOffset(f_index);
+	return FrameInfo(offset, static_cast<uint>(getOffset(f_index + 1) - offset), getSample(f_index), m_dataRelOffset);
+}
+
+
+uint CCbrIndex::findNext(uint64_t f_sample, uint f_first) const
+{
+	if(f_first >= m_count || getSample(f_first) > f_sample)
+		return f_first;
+
+	// Exact: frame #i starts at i * m_samples
+	return static_cast<uint>(std::min<uint64_t>(f_sample / m_samples + 1, m_count));
+}
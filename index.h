@@ -0,0 +1,286 @@
+#pragma once
+
+#include "common.h"
+#include "mpeg.h"
+#include "header.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+
+struct FrameInfo
+{
+	FrameInfo(size_t f_offset, uint f_size, uint64_t f_sample, uint f_dataRelOffset):
+		Offset(f_offset),
+		Sample(f_sample),
+		Size(f_size),
+		DataRelOffset(f_dataRelOffset)
+	{}
+
+	size_t		Offset;
+	// The number of samples before the frame (exact, the time is Sample / sampling rate)
+	uint64_t	Sample;
+	uint		Size;
+	uint		DataRelOffset;
+};
+
+
+// Frame index storage
+class CFrameIndex
+{
+public:
+	// The sampling rate converts Options::SparseTime to samples
+	static std::unique_ptr<CFrameIndex> create(const MPEG::Options& f_options, uint f_samplingRate);
+
+public:
+	// The stream data the frame offsets refer to (needed by indexes that rescan the data)
+	virtual void		attach			(const uchar* /*f_data*/, size_t /*f_size*/) {}
+
+	virtual uint		getCount		() const = 0;
+	virtual FrameInfo	get				(uint f_index) const = 0;
+
+	// f_samples is the duration of the frame (the next one starts at f_frame.Sample + f_samples)
+	virtual void		push			(const FrameInfo& f_frame, uint f_samples) = 0;
+	// Push f_count frames at once: f_frames[i] starts at f_frames[i].Sample + f_shift (modulo 2^64)
+	// and lasts until the next one, the last one lasts f_lastSamples
+	virtual void		append			(const FrameInfo* f_frames, uint f_count, uint64_t f_shift, uint f_lastSamples);
+	// Drop the frames starting from f_count
+	virtual void		shrink			(uint f_count) = 0;
+	void				clear			() { shrink(0); }
+
+	// Heap memory used by the index
+	virtual size_t		getMemoryUsage	() const = 0;
+
+	// The first frame (not before f_first) starting after the sample or getCount().
+	// The search gallops from f_first, so a series of increasing samples costs O(m log(n / m))
+	virtual uint		findNext		(uint64_t f_sample, uint f_first) const;
+
+	virtual				~CFrameIndex	() {}
+};
+
+
+// One record per frame
+class CFullIndex final : public CFrameIndex
+{
+public:
+	uint		getCount		() const final override { return static_cast<uint>(m_frames.size()); }
+	FrameInfo	get				(uint f_index) const final override { return m_frames[f_index]; }
+
+	void		push			(const FrameInfo& f_frame, uint) final override { m_frames.push_back(f_frame); }
+	void		append			(const FrameInfo* f_frames, uint f_count, uint64_t f_shift, uint f_lastSamples) final override;
+	void		shrink			(uint f_count) final override;
+
+	size_t		getMemoryUsage	() const final override { return m_frames.capacity() * sizeof(FrameInfo); }
+
+private:
+	std::vector<FrameInfo> m_frames;
+};
+
+
+// A frame table used in place (e.g. in a mapped sidecar file): nothing is copied,
+// the owner keeps the memory alive
+class CTableIndex final : public CFrameIndex
+{
+public:
+	// The table record (little-endian, 8-byte aligned)
+	struct Record
+	{
+		uint64_t	Offset;
+		uint64_t	Sample;
+		uint32_t	Size;
+		uint32_t	DataRelOffset;
+	};
+
+public:
+				CTableIndex		(const Record* f_records, uint f_count, std::shared_ptr<const void> f_owner):
+		m_records(f_records),
+		m_count(f_count),
+		m_owner(std::move(f_owner))
+	{}
+
+	uint		getCount		() const final override { return m_count; }
+	FrameInfo	get				(uint f_index) const final override
+	{
+		auto& r = m_records[f_index];
+		return FrameInfo(static_cast<size_t>(r.Offset), r.Size, r.Sample, r.DataRelOffset);
+	}
+
+	// The table is read-only
+	void		push			(const FrameInfo&, uint) final override { ASSERT(!"Not supported by a table index"); }
+	void		shrink			(uint f_count) final override { m_count = std::min(m_count, f_count); }
+
+	// The table is not on the heap
+	size_t		getMemoryUsage	() const final override { return 0; }
+
+private:
+	const Record*				m_records;
+	uint						m_count;
+	std::shared_ptr<const void>	m_owner;
+};
+static_assert(sizeof(CTableIndex::Record) == 24, "Invalid frame table record size");
+
+
+// Frames are split into fixed-size blocks with a full checkpoint (offset, sample) each.
+// A frame is a 1-byte class (an index in a small table of size / data offset / sample count
+// triples), optionally followed by a varint gap from the end of the previous frame,
+// so a lookup decodes at most BlockSize entries
+class CCompactIndex final : public CFrameIndex
+{
+public:
+	static const uint BlockSize = 16;
+
+public:
+				CCompactIndex	();
+
+	uint		getCount		() const final override { return static_cast<uint>(m_frames.size()); }
+	FrameInfo	get				(uint f_index) const final override;
+
+	void		push			(const FrameInfo& f_frame, uint f_samples) final override;
+	void		shrink			(uint f_count) final override;
+
+	size_t		getMemoryUsage	() const final override;
+
+private:
+	// The class byte: the lower bits are a class index, the high bit marks a gap
+	enum
+	{
+		ClassMask	= 0x7F,
+		// An escaped frame has no class: its fields are stored as varints
+		ClassEscape	= ClassMask,
+		GapFlag		= 0x80
+	};
+
+	struct Class
+	{
+		uint	Size;
+		uint	DataRelOffset;
+		uint	Samples;
+	};
+
+	struct Checkpoint
+	{
+		size_t		Offset;
+		uint64_t	Sample;
+		// Position of the first varint of the block
+		uint		Pos;
+	};
+
+private:
+	// Decode the frames of the block up to f_index, return the varint position after the frame
+	uint		decode			(uint f_index, FrameInfo& f_frame, uint& f_samples) const;
+	uchar		getClass		(const FrameInfo& f_frame, uint f_samples);
+	void		putVarint		(size_t f_value);
+	size_t		getVarint		(uint& f_pos) const;
+
+private:
+	std::vector<Class>		m_classes;
+	std::vector<Checkpoint>	m_checkpoints;
+	std::vector<uchar>		m_frames;
+	std::vector<uchar>		m_varints;
+
+	// The last pushed frame (to calculate a gap and the next sample)
+	FrameInfo				m_last;
+	uint					m_lastSamples;
+	uchar					m_lastClass;
+};
+
+
+// Checkpoints only: a frame between checkpoints is found by parsing
+// the frames starting from the nearest checkpoint
+class CSparseIndex final : public CFrameIndex
+{
+public:
+				CSparseIndex	(uint f_frames, uint64_t f_samples);
+
+	void		attach			(const uchar* f_data, size_t f_size) final override;
+
+	uint		getCount		() const final override { return m_count; }
+	FrameInfo	get				(uint f_index) const final override;
+
+	void		push			(const FrameInfo& f_frame, uint f_samples) final override;
+	void		shrink			(uint f_count) final override;
+
+	size_t		getMemoryUsage	() const final override { return m_checkpoints.capacity() * sizeof(Checkpoint); }
+
+	uint		findNext		(uint64_t f_sample, uint f_first) const final override;
+
+private:
+	struct Checkpoint
+	{
+		uint		Index;
+		FrameInfo	Frame;
+	};
+
+private:
+	// The checkpoint at or before the frame
+	std::vector<Checkpoint>::const_iterator	getCheckpoint	(uint f_index) const;
+	// Parse the frame following f_frame
+	void									next			(FrameInfo& f_frame) const;
+
+private:
+	const uint				m_step;
+	// 0 - no limit
+	const uint64_t			m_samples;
+
+	const uchar*			m_data;
+	size_t					m_size;
+
+	std::vector<Checkpoint>	m_checkpoints;
+	uint					m_count;
+	// The last pushed frame (a frame not adjacent to it becomes a checkpoint)
+	FrameInfo				m_last;
+};
+
+
+// No per-frame storage: a constant-bitrate stream is described by the first frame
+// and the padding pattern, pads(i) = (i * PadNum + PadPhase) / PadDen padded frames precede frame #i
+class CCbrIndex final : public CFrameIndex
+{
+public:
+	// The first frames are parsed to learn the padding pattern
+	static const uint ProbeFrames	= 128;
+
+	// A CBR index of the stream starting at f_offset or nullptr if the stream doesn't fit.
+	// The stream must end exactly at the end of the last frame or an invalid header
+	static std::unique_ptr<CCbrIndex> detect(const uchar* f_data, size_t f_offset, size_t f_size);
+
+public:
+	uint		getCount		() const final override { return m_count; }
+	FrameInfo	get				(uint f_index) const final override;
+
+	// The frames are never pushed: the index is complete after detection
+	void		push			(const FrameInfo&, uint) final override { ASSERT(!"Not supported by a CBR index"); }
+	void		shrink			(uint f_count) final override { m_count = std::min(m_count, f_count); }
+
+	size_t		getMemoryUsage	() const final override { return 0; }
+
+	uint		findNext		(uint64_t f_sample, uint f_first) const final override;
+
+	// The end of the last frame
+	size_t		getEnd			() const { return getOffset(m_count); }
+	uint64_t	getSampleCount	() const { return getSample(m_count); }
+
+private:
+	CCbrIndex() = default;
+
+	uint64_t	getPads			(uint64_t f_index) const { return (f_index * m_padNum + m_padPhase) / m_padDen; }
+	size_t		getOffset		(uint64_t f_index) const { return m_offset + f_index * m_size + m_slot * getPads(f_index); }
+	uint64_t	getSample		(uint64_t f_index) const { return f_index * m_samples; }
+
+private:
+	size_t		m_offset;
+	// The size of an unpadded frame and the padding slot
+	uint		m_size;
+	uint		m_slot;
+	uint		m_dataRelOffset;
+	// Samples per frame
+	uint		m_samples;
+
+	uint64_t	m_padNum;
+	uint64_t	m_padDen;
+	uint64_t	m_padPhase;
+
+	uint		m_count;
+};
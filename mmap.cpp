@@ -0,0 +1,66 @@
+#include "mmap.h"
+
+#include <cerrno>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+CMappedFile::CMappedFile(const std::string& f_path):
+	m_data(nullptr),
+	m_size(0),
+	m_mtime(0)
+{
+	auto fd = ::open(f_path.c_str(), O_RDONLY);
+	if(fd < 0)
+		throw std::system_error(errno, std::generic_category(), "failed to open \"" + f_path + '"');
+
+	struct stat st;
+	if(fstat(fd, &st))
+	{
+		auto err = errno;
+		::close(fd);
+		throw std::system_error(err, std::generic_category(), "failed to stat \"" + f_path + '"');
+	}
+
+	m_size = static_cast<size_t>(st.st_size);
+	m_mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+	// Zero-length mappings are not allowed
+	if(m_size)
+	{
+		auto p = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(p == MAP_FAILED)
+		{
+			auto err = errno;
+			::close(fd);
+			throw std::system_error(err, std::generic_category(), "failed to map \"" + f_path + '"');
+		}
+		m_data = static_cast<const uchar*>(p);
+	}
+
+	// The mapping stays valid after the descriptor is closed
+	::close(fd);
+}
+
+
+CMappedFile::~CMappedFile()
+{
+	if(m_data)
+		munmap(const_cast<uchar*>(m_data), m_size);
+}
+
+
+void CMappedFile::adviseSequential() const
+{
+	if(m_data)
+		madvise(const_cast<uchar*>(m_data), m_size, MADV_SEQUENTIAL);
+}
+
+void CMappedFile::adviseNormal() const
+{
+	if(m_data)
+		madvise(const_cast<uchar*>(m_data), m_size, MADV_NORMAL);
+}
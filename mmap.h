@@ -0,0 +1,33 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <string>
+
+
+// Read-only memory-mapped file
+class CMappedFile
+{
+public:
+	// Throw std::system_error if the file cannot be opened or mapped
+	explicit		CMappedFile		(const std::string& f_path);
+					CMappedFile		() = delete;
+					CMappedFile		(const CMappedFile&) = delete;
+	CMappedFile&	operator=		(const CMappedFile&) = delete;
+					~CMappedFile	();
+
+	const uchar*	getData			() const { return m_data; }
+	size_t			getSize			() const { return m_size; }
+	// Nanoseconds since the epoch
+	int64_t			getModificationTime() const { return m_mtime; }
+
+	// Access pattern hints
+	void			adviseSequential() const;
+	void			adviseNormal	() const;
+
+private:
+	const uchar*	m_data;
+	size_t			m_size;
+	int64_t			m_mtime;
+};
@@ -2,65 +2,297 @@
 
 #include "stream.h"
 #include "header.h"
+#include "sync.h"
+#include "mmap.h"
+#include "sidecar.h"
+#include "tags.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <sstream>
+#include <system_error>
 
 
 namespace MPEG
 {
-	std::shared_ptr<IStream> IStream::create(const unsigned char* f_data, size_t f_size)
+	std::shared_ptr<IStream> IStream::create(const unsigned char* f_data, size_t f_size, const Options& f_options)
 	{
-		return std::make_shared<CStream>(f_data, f_size);
+		return std::make_shared<CStream>(f_data, f_size, f_options);
 	}
 
 
-	static size_t findHeader(const unsigned char* f_data, size_t f_size)
+	// Parse the stream right on the mapping
+	static File openMapped(const std::shared_ptr<CMappedFile>& f_file, const Options& f_options)
 	{
-		if(f_size < CHeader::getSize())
-			return f_size;
+		auto data = f_file->getData();
+		auto size = f_file->getSize();
 
-		for(size_t i = 0, limit = f_size - CHeader::getSize(); i <= limit; ++i)
+		File result = {nullptr, size, size, 0, {}};
+
+		// The stream ends before the trailing tags (the search checks the leading ones itself)
+		auto begin = CTags::findLeading(data, size, &result.Tags);
+		auto end = CTags::findTrailing(data, begin, size, &result.Tags);
+
+		f_file->adviseSequential();
+		auto offset = IStream::calcFirstHeaderOffset(data, end);
+		if(offset < end)
 		{
-			if(CHeader::isValid( *reinterpret_cast<const uint*>(f_data + i)) )
-				return i;
+			auto options = f_options;
+			options.Borrow = true;
+			auto stream = std::make_shared<CStream>(data + offset, end - offset, options);
+			// The mapping lives as long as the stream
+			stream->keepAlive(f_file);
+
+			result.Offset = offset;
+			result.Trailing = size - offset - stream->getSize();
+			result.Stream = std::move(stream);
 		}
+		f_file->adviseNormal();
 
-		return f_size;
+		return result;
 	}
 
-	size_t IStream::calcFirstHeaderOffset(const uchar* f_data, size_t f_size)
+
+	File IStream::open(const std::string& f_path, const Options& f_options)
+	{
+		return openMapped(std::make_shared<CMappedFile>(f_path), f_options);
+	}
+
+
+	File IStream::open(const std::string& f_path, const std::string& f_indexPath, const Options& f_options)
 	{
-		for(size_t offset = 0; offset < f_size; offset++)
+		auto file = std::make_shared<CMappedFile>(f_path);
+
+		std::shared_ptr<CMappedFile> sidecar;
+		try
 		{
-			offset += findHeader(f_data + offset, f_size - offset);
-			if( verifyFrameSequence(f_data + offset, f_size - offset) )
-				return offset;
+			sidecar = std::make_shared<CMappedFile>(f_indexPath);
 		}
-		return f_size;
+		catch(const std::system_error&)
+		{
+			// No sidecar yet
+		}
+		if(sidecar)
+		{
+			auto result = CSidecar::load(sidecar, file, f_options);
+			if(result.Stream)
+			{
+				result.Tags = findTags(file->getData(), file->getSize());
+				return result;
+			}
+		}
+
+		// Scan the file and (re)write the sidecar
+		auto result = openMapped(file, f_options);
+		if(result.Stream)
+		{
+			std::vector<uchar> buf;
+			CSidecar::write(result, *file, buf);
+			try
+			{
+				CSidecar::save(f_indexPath, buf);
+			}
+			catch(const std::system_error&)
+			{
+				// The sidecar is a cache: the next open scans again
+			}
+		}
+		return result;
 	}
 
 
-	bool IStream::verifyFrameSequence(const unsigned char* f_data, size_t f_size)
+	static size_t findHeader(const unsigned char* f_data, size_t f_size)
 	{
-		static const uint HeadersToVerify = 3;
-		for(size_t nFrames = HeadersToVerify, offset = 0; nFrames; --nFrames)
+		return CSync::find(f_data, f_size);
+	}
+
+	static const uint HeadersToVerify = CSync::HeadersToVerify;
+
+	// Return the size of a frame at the beginning of the data or 0 if the header is invalid
+	// or the size cannot be calculated (a free-bitrate frame with no next header)
+	static size_t getValidFrameSize(const unsigned char* f_data, size_t f_size)
+	{
+		if(CHeader::getSize() > f_size)
+			return 0;
+
+		auto rawHeader = *reinterpret_cast<const uint*>(f_data);
+		if(!CHeader::isValid(rawHeader))
+			return 0;
+
+		CHeader h(rawHeader);
+		// Try handle a free-bitrate frame
+		return h.isFreeBitrate() ? h.calcFrameSize(f_data, f_size) : h.getFrameSize();
+	}
+
+
+	// Frame sizes for the search in O(1), a free-bitrate frame too. Such a frame ends at the first valid header
+	// at one of its possible sizes (CHeader::calcFrameSize()): min + k * step, the step depending on the version,
+	// layer and sampling rate only (up to 16 bytes). So the next valid header step bytes apart is precalculated
+	// for every step in use and every offset is checked once per step instead of once per candidate frame.
+	// The search only moves forward, so this is done for a window of candidates and the reach of their sequences,
+	// and only once the frames scanned in the window add up to its size (a few candidates are sized right away):
+	// each window costs O(its size * (1 + the steps in use)) either way
+	class CFrameSizes
+	{
+	public:
+		// Candidates per window
+		static const size_t Window = 16 << 10;
+		// The largest frame (MPEG 2.5 layer II at 160 kbps and 8 kHz, padded)
+		static const size_t MaxFrameSize = 2881;
+		// The frames of a sequence (the last one is sized too)
+		static const size_t Reach = HeadersToVerify * MaxFrameSize;
+
+	public:
+		CFrameSizes(const uchar* f_data, size_t f_size): m_data(f_data), m_size(f_size), m_begin(0), m_end(0), m_scanned(0) {}
+
+		// Start a window at a candidate unless the current one holds it
+		void seek(size_t f_offset)
 		{
-			if(offset + CHeader::getSize() > f_size)
-				return false;
+			if(m_end && f_offset >= m_begin && f_offset < m_begin + Window)
+				return;
 
-			auto rawHeader = *reinterpret_cast<const uint*>(f_data + offset);
+			m_begin = f_offset;
+			m_end = std::min(m_size, m_begin + Window + Reach);
+			m_scanned = 0;
+			m_valid.clear();
+			for(auto& next : m_next)
+				next.clear();
+		}
+
+		// The size of a frame of a sequence or 0 if the header is invalid
+		// or the size cannot be calculated (a free-bitrate frame with no next header)
+		size_t get(size_t f_offset)
+		{
+			if(f_offset + CHeader::getSize() > m_size)
+				return 0;
+
+			auto rawHeader = *reinterpret_cast<const uint*>(m_data + f_offset);
 			if(!CHeader::isValid(rawHeader))
-				return false;
+				return 0;
 
 			CHeader h(rawHeader);
-			if(h.isFreeBitrate())
+			if(!h.isFreeBitrate())
+				return h.getFrameSize();
+
+			uint min, step, max;
+			h.getFreeSizes(min, step, max);
+			ASSERT(step < m_next.size());
+			if(m_next[step].empty() && m_scanned + max <= m_end - m_begin)
+			{
+				m_scanned += max;
+				return h.calcFrameSize(m_data + f_offset, m_size - f_offset);
+			}
+
+			ASSERT(f_offset >= m_begin && f_offset + max <= m_begin + Window + Reach);
+			// The next header is within the data
+			auto end = std::min<size_t>(f_offset + max, m_size);
+			if(f_offset + min + CHeader::getSize() > end)
+				return 0;
+
+			auto next = getNext(step)[f_offset + min - m_begin];
+			return (next != None && m_begin + next + CHeader::getSize() <= end) ? m_begin + next - f_offset : 0;
+		}
+
+	private:
+		static const uint32_t None = UINT32_MAX;
+
+		// The window offset of the first valid header at or after each one, step bytes apart
+		const std::vector<uint32_t>& getNext(uint f_step)
+		{
+			auto& next = m_next[f_step];
+			if(!next.empty())
+				return next;
+
+			auto size = m_end - m_begin;
+			if(m_valid.empty())
+			{
+				// The headers start in the window and end in the data
+				auto data = m_data + m_begin;
+				auto limit = std::min(m_size - m_begin, size + CHeader::getSize() - 1);
+				m_valid.assign(size, 0);
+				for(size_t o = 0; o < size; ++o)
+				{
+					o += CSync::find(data + o, limit - o);
+					if(o < size)
+						m_valid[o] = 1;
+				}
+			}
+
+			next.resize(size);
+			for(auto i = size; i--; )
+				next[i] = m_valid[i] ? static_cast<uint32_t>(i) : ((i + f_step < size) ? next[i + f_step] : None);
+			return next;
+		}
+
+	private:
+		const uchar*							m_data;
+		size_t									m_size;
+		// The window: candidates from m_begin and their sequences up to m_end
+		size_t									m_begin;
+		size_t									m_end;
+		// By the frames sized without the precalculated headers
+		size_t									m_scanned;
+		std::vector<uchar>						m_valid;
+		// By step
+		std::array<std::vector<uint32_t>, 17>	m_next;
+	};
+	const size_t CFrameSizes::Window;
+	const size_t CFrameSizes::Reach;
+
+
+	std::vector<Tag> IStream::findTags(const unsigned char* f_data, size_t f_size)
+	{
+		std::vector<Tag> tags;
+		auto begin = CTags::findLeading(f_data, f_size, &tags);
+		CTags::findTrailing(f_data, begin, f_size, &tags);
+		return tags;
+	}
+
+
+	size_t IStream::calcFirstHeaderOffset(const uchar* f_data, size_t f_size)
+	{
+		// A candidate takes up to HeadersToVerify frame sizes in O(1), so the search is O(n)
+		// even on a sync-word storm of free-bitrate headers
+		CFrameSizes sizes(f_data, f_size);
+		auto isSequence = [&sizes](size_t f_offset)
+		{
+			sizes.seek(f_offset);
+			for(uint nFrames = HeadersToVerify; nFrames; --nFrames)
 			{
-				// Try handle a free-bitrate frame
-				auto size = h.calcFrameSize(f_data + offset, f_size - offset);
+				auto size = sizes.get(f_offset);
 				if(!size)
 					return false;
-				offset += size;
+				f_offset += size;
 			}
-			else
-				offset += h.getFrameSize();
+			return true;
+		};
+
+		// ID3v2 sizes are often wrong: the tags are skipped only if the frames start right after them,
+		// otherwise the whole data is searched
+		auto begin = CTags::findLeading(f_data, f_size, nullptr);
+		if(begin && !isSequence(begin))
+			begin = 0;
+		for(size_t offset = begin; offset < f_size; offset++)
+		{
+			offset += findHeader(f_data + offset, f_size - offset);
+			if(isSequence(offset))
+				return offset;
+		}
+		return f_size;
+	}
+
+
+	bool IStream::verifyFrameSequence(const unsigned char* f_data, size_t f_size)
+	{
+		for(size_t nFrames = HeadersToVerify, offset = 0; nFrames; --nFrames)
+		{
+			auto size = getValidFrameSize(f_data + offset, f_size - offset);
+			if(!size)
+				return false;
+			offset += size;
+			if(offset > f_size)
+				offset = f_size;
 		}
 
 		return true;
@@ -83,6 +315,27 @@ namespace MPEG
 	}
 
 
+	std::string IStream::playlist(const std::vector<Segment>& f_segments, unsigned f_samplingRate,
+								  const std::function<std::string(size_t)>& f_uri)
+	{
+		// The target duration must not be less than any segment duration rounded to an integer
+		uint64_t longest = 0;
+		for(auto& segment : f_segments)
+			longest = std::max(longest, segment.Samples);
+		auto target = static_cast<uint64_t>(std::ceil(static_cast<double>(longest) / f_samplingRate));
+
+		std::ostringstream oss;
+		oss << "#EXTM3U\n#EXT-X-VERSION:3\n#EXT-X-TARGETDURATION:" << target <<
+			   "\n#EXT-X-MEDIA-SEQUENCE:0\n#EXT-X-PLAYLIST-TYPE:VOD\n";
+		oss.setf(std::ios::fixed);
+		oss.precision(6);
+		for(size_t i = 0; i < f_segments.size(); ++i)
+			oss << "#EXTINF:" << static_cast<double>(f_segments[i].Samples) / f_samplingRate << ",\n" << f_uri(i) << '\n';
+		oss << "#EXT-X-ENDLIST\n";
+		return oss.str();
+	}
+
+
 	const std::string& IStream::str(MPEG::Version f_version)	{ return CHeader::str(f_version);	}
 	const std::string& IStream::str(MPEG::ChannelMode f_mode)	{ return CHeader::str(f_mode);		}
 	const std::string& IStream::str(MPEG::Emphasis f_emphasis)	{ return CHeader::str(f_emphasis);	}
@@ -1,8 +1,13 @@
 #pragma once
 
+#include <cstdint>
+#include <functional>
 #include <memory>
+#include <string>
 #include <vector>
 
+#include <sys/uio.h>
+
 
 namespace MPEG
 {
@@ -31,12 +36,182 @@ namespace MPEG
 	};
 
 
+	enum class IndexMode
+	{
+		// A record per frame
+		Full,
+		// Block checkpoints + 1-2 bytes per frame (slower random access)
+		Compact,
+		// A checkpoint every SparseFrames frames / SparseTime seconds,
+		// other frames are found by rescanning the data from the nearest checkpoint
+		Sparse
+	};
+
+	struct Options
+	{
+		IndexMode Index = IndexMode::Full;
+		unsigned SparseFrames = 64;
+		// 0 - no time limit
+		float SparseTime = 0.0f;
+		// Take the stream info from a Xing/Info header with frames, bytes and TOC (if any)
+		// instead of scanning the frames. The frame index is built on the first per-frame access
+		bool Quick = false;
+
+		// Don't copy the data: the caller keeps the buffer alive (and unchanged) for the lifetime
+		// of the stream. Edits never change the data (see cut())
+		bool Borrow = false;
+
+		// Compute the frames of a constant-bitrate stream arithmetically (no per-frame storage)
+		// when the padding pattern of the first frames holds for the headers of all the frames.
+		// Otherwise (or when disabled) the index of the above mode is built
+		bool ImplicitCBR = true;
+
+		// The number of threads parsing the frames (0 - one per core). The data is split
+		// into chunks parsed in parallel, the frame index is the same as the sequential one
+		unsigned Threads = 1;
+
+		// Skip corrupt regions instead of stopping the stream there: the next sequence of frames of the stream
+		// format is searched up to RecoverLimit bytes away. Frames of another format are skipped too,
+		// the regions are reported by IStream::getGaps(). The implicit CBR index is not used then
+		bool Recover = false;
+		size_t RecoverLimit = 64 << 10;
+
+		// Build the frame size statistics of IStream::getAverageBitrate() / getMaxBitrate() during the scan
+		// (4 bytes per frame). Otherwise they are built from the frame index on the first query
+		bool RangeStats = false;
+
+		// Decode the layer III side information of IStream::getSideInfo() during the scan
+		// (2 bytes per frame + 3 bytes per granule and channel). Otherwise it is decoded on the first query
+		bool SideInfo = false;
+	};
+
+
+	// Layer III side information fields of a frame
+	struct SideInfo
+	{
+		// The number of bytes of the previous frames (the bit reservoir) the main data starts with
+		unsigned	MainDataBegin;
+		// 2 granules in MPEG 1, 1 in MPEG 2 / 2.5; 1 channel in mono, 2 otherwise
+		unsigned	Granules;
+		unsigned	Channels;
+		// [granule][channel]: the number of bits of the scale factors and the Huffman data, the quantizer step size
+		unsigned	Part23Length[2][2];
+		unsigned	GlobalGain[2][2];
+	};
+
+
+	enum class GapReason
+	{
+		// No valid frame sequence (e.g. damaged bytes)
+		Corrupt,
+		// Frames of another version, layer, sampling rate, channel mode or emphasis
+		FormatChange,
+		// The size of a free-bitrate frame cannot be calculated
+		FreeBitrate
+	};
+
+	// A region of the data skipped by the recovery (between the frames)
+	struct Gap
+	{
+		size_t		Offset;
+		size_t		Size;
+		GapReason	Reason;
+	};
+
+
+	class IStream;
+
+	struct SegmentOptions
+	{
+		// The target duration (seconds): the boundaries are the first frames starting at its multiples
+		float Duration = 10.0f;
+		// Layer III: a boundary moves forward by up to that many frames to a frame that doesn't use
+		// the bit reservoir (main_data_begin = 0). Otherwise the segment needs preroll frames
+		unsigned ReservoirSearch = 8;
+		// Start the ranges of a segment with its preroll frames, so that a decoder starting there
+		// gets the whole main data of the first frame (the preroll audio repeats the end of the previous segment)
+		bool Preroll = true;
+	};
+
+	// A segment of IStream::segment()
+	struct Segment
+	{
+		// The frames [Frame, Frame + Count), the number of samples before them and their duration
+		unsigned			Frame;
+		unsigned			Count;
+		uint64_t			Sample;
+		uint64_t			Samples;
+		// The number of frames before Frame holding the bit reservoir of the first frame (0 - self-contained)
+		unsigned			Preroll;
+		// The bytes of the frames (preceded by the preroll frames with SegmentOptions::Preroll) right in the data
+		// of the stream: a range per piece of the edited stream. Valid until the stream is edited or destroyed
+		std::vector<iovec>	Ranges;
+	};
+
+	// A range of frames for IStream::edit()
+	struct EditRange
+	{
+		unsigned	Frame;
+		unsigned	Count;
+		// Drop or keep the frames (the frames out of all the ranges are kept too)
+		bool		Drop;
+	};
+
+	enum class TagType
+	{
+		ID3v2,
+		APEv2,
+		Lyrics3,
+		ID3v1
+	};
+
+	// A tag container (the header / footer included)
+	struct Tag
+	{
+		size_t		Offset;
+		size_t		Size;
+		TagType		Type;
+	};
+
+	struct File
+	{
+		// Null if no MPEG stream is found
+		std::shared_ptr<IStream>	Stream;
+
+		size_t						Size;
+		// The number of bytes before the first frame (e.g. an ID3v2 tag)
+		size_t						Offset;
+		// The number of bytes after the last frame (e.g. ID3v1 / APE tags)
+		size_t						Trailing;
+		// The tags before and after the stream (in the order of their offsets)
+		std::vector<Tag>			Tags;
+	};
+
+
 	class IStream
 	{
 	public:
-		static std::shared_ptr<IStream>	create					(const unsigned char* f_data, size_t f_size);
+		// Map a file and parse the stream right on the mapping (the data is always borrowed).
+		// Throw std::system_error on I/O failures
+		static File						open					(const std::string& f_path,
+																 const Options& f_options = Options());
+		// The same with a sidecar frame index: if the sidecar matches the file (size, mtime and
+		// a hash of the head and the tail) and its records are intact, the stream is restored from it without
+		// scanning the frames. Otherwise the file is scanned and the sidecar is (re)written if possible
+		// (a failed write doesn't fail the open). A sidecar written with other recovery options (or an implicit
+		// CBR index the options disable) is rewritten the same way; its frame table is used whatever Options::Index
+		static File						open					(const std::string& f_path, const std::string& f_indexPath,
+																 const Options& f_options = Options());
 
+		static std::shared_ptr<IStream>	create					(const unsigned char* f_data, size_t f_size,
+																 const Options& f_options = Options());
+
+		// Leading ID3v2 tags are skipped by their sizes if a frame sequence follows them,
+		// otherwise (a wrong tag size) the search starts at the beginning of the data
 		static size_t					calcFirstHeaderOffset	(const unsigned char* f_data, size_t f_size);
+		// ID3v2 tags at the beginning, APEv2 / Lyrics3 / ID3v1 (and appended ID3v2) tags at the end of the data.
+		// O(1) per tag: the sizes are taken from the headers / footers
+		static std::vector<Tag>			findTags				(const unsigned char* f_data, size_t f_size);
 		static bool						verifyFrameSequence		(const unsigned char* f_data, size_t f_size);
 
 		static bool						isIncompleteFrame		(const unsigned char* f_data, size_t f_size);
@@ -45,6 +220,10 @@ namespace MPEG
 		static const std::string&		str						(ChannelMode f_mode);
 		static const std::string&		str						(Emphasis f_emphasis);
 
+		// An HLS media playlist (VOD) of the segments, f_uri names the segment by its number
+		static std::string				playlist				(const std::vector<Segment>& f_segments, unsigned f_samplingRate,
+																 const std::function<std::string(size_t)>& f_uri);
+
 	public:
 		virtual bool			hasIssues		() const = 0;
 
@@ -60,17 +239,109 @@ namespace MPEG
 		virtual ChannelMode		getChannelMode	() const = 0;
 		virtual Emphasis		getEmphasis		() const = 0;
 
+		// Heap memory used by the frame index (the list of edits is not counted)
+		virtual size_t			getIndexMemoryUsage() const = 0;
+
+		// The regions skipped by Options::Recover (sorted by offset, offsets in the data before the edits).
+		// The bytes stay in the stream: they are serialized unless cut out with the frames around them
+		virtual const std::vector<Gap>&	getGaps	() const = 0;
+
 		virtual size_t			getFrameOffset	(unsigned f_index) const = 0;
 		virtual unsigned		getFrameSize	(unsigned f_index) const = 0;
 		virtual float			getFrameTime	(unsigned f_index) const = 0;
 
+		// The exact timeline in samples (per channel): the number of samples before the frame
+		// (getSampleCount() for getFrameCount()) and of the f_count frames from f_frame (clamped to the end).
+		// The cost of a frame lookup, the times are these divided by getSamplingRate()
+		virtual uint64_t		getSampleCount	() const = 0;
+		virtual uint64_t		getFrameSample	(unsigned f_index) const = 0;
+		virtual uint64_t		getDuration		(unsigned f_frame, unsigned f_count) const = 0;
+
+		// The average (bytes over duration) and the peak (the largest frame) bitrate in kbps of the f_count frames
+		// from f_frame (clamped to the end, 0 for no frames). O(1) per range of the indexed frames: an edited range
+		// costs one such query per piece it spans (see Options::RangeStats)
+		virtual float			getAverageBitrate(unsigned f_frame, unsigned f_count) const = 0;
+		virtual float			getMaxBitrate	(unsigned f_frame, unsigned f_count) const = 0;
+
+		// The layer III side information of the frame (false for other layers or past the end), see Options::SideInfo
+		virtual bool			getSideInfo		(unsigned f_index, SideInfo& f_info) const = 0;
+
+		// The offset of a frame header at the time (getSize() if the time is past the end).
+		// In quick mode the offset comes from the Xing TOC and is approximate
+		virtual size_t			getSeekOffset	(float f_time) const = 0;
+
+		// The frame playing at the time (O(log n)), getFrameCount() if the time is past the end
+		virtual unsigned		getFrameNumber	(float f_time) const = 0;
+		// The same for times sorted in ascending order, resolved in a single pass
+		virtual void			getFrameNumbers	(const std::vector<float>& f_times, std::vector<unsigned>& f_frames) const = 0;
+
+		// The edited stream with the Xing frame counts and TOC updated (an unedited stream is written as is
+		// unless addInfoFrame() was called). A VBRI frame is kept as is while its counts match the frames,
+		// otherwise it is replaced as by addInfoFrame() (or dropped if that fails)
 		virtual void			serialize		(std::vector<unsigned char>& f_outStream) = 0;
+		// The same without copying: the Xing frame and the ranges of the data left after the edits,
+		// ready for writev() / pwritev() (in batches of IOV_MAX). The ranges are valid until the next call
+		// or the stream destruction
+		virtual void			serialize		(std::vector<iovec>& f_ranges) = 0;
 
-		// Return the number of processed frames
+		// Replace the Xing / VBRI frame (or add one if there is none) with a Xing (VBR) / Info (CBR) frame
+		// having the frames, bytes and TOC fields (filled by serialize()): O(1) seeking for players.
+		// The frame offsets move by the difference of the frame sizes. False for free bitrate and
+		// non layer III streams (nothing is changed then)
+		virtual bool			addInfoFrame	() = 0;
+
+		// Split the (edited) stream into segments at frame boundaries in a single pass over the boundaries:
+		// no data is copied, the segments refer to the stream data. The Xing / VBRI frame is not included.
+		// Throw std::invalid_argument for a non-positive duration
+		virtual void			segment			(const SegmentOptions& f_options, std::vector<Segment>& f_segments) const = 0;
+
+		// Return the number of processed frames. The edits change the list of frame ranges only
+		// (O(log n) to find a frame), the bytes are gathered by serialize()
 		virtual unsigned		cut				(unsigned f_frame, unsigned f_count) = 0;
 		virtual unsigned		truncate		(unsigned f_frames) = 0;
+		// Apply sorted non-overlapping ranges (the frame numbers are the ones before the edit) at once:
+		// O(number of frame ranges + number of edit ranges). f_removed gets the number of frames removed
+		// by every range, the total is returned. Throw std::invalid_argument for unsorted / overlapping
+		// ranges and std::out_of_range for a range starting past the end (nothing is changed then)
+		virtual unsigned		edit			(const std::vector<EditRange>& f_ranges, std::vector<unsigned>& f_removed) = 0;
 
 		virtual					~IStream		();
 	};
+
+
+	// Incremental (push) parser: data is fed in arbitrary chunks and frames are reported
+	// as soon as they are complete
+	struct Frame
+	{
+		// Offset from the beginning of the fed data
+		size_t		Offset;
+		unsigned	Size;
+		// The number of samples before the frame and the same in seconds
+		uint64_t	Sample;
+		float		Time;
+		// Header + side information size
+		unsigned	DataRelOffset;
+	};
+
+	class IParser
+	{
+	public:
+		using Callback = std::function<void(const Frame&)>;
+
+		static std::shared_ptr<IParser>	create			(Callback f_onFrame);
+
+	public:
+		// Parse the next chunk (f_onFrame is called for every frame completed by the chunk)
+		virtual void			feed			(const unsigned char* f_data, size_t f_size) = 0;
+
+		virtual unsigned		getFrameCount	() const = 0;
+		virtual float			getLength		() const = 0;
+		// The total number of fed bytes
+		virtual size_t			getSize			() const = 0;
+		// The number of fed bytes kept for the next chunk (an incomplete frame or sync candidate)
+		virtual size_t			getBufferedSize	() const = 0;
+
+		virtual					~IParser		();
+	};
 }
 
@@ -0,0 +1,187 @@
+#include "parser.h"
+
+#include "sync.h"
+
+#include <algorithm>
+
+
+namespace MPEG
+{
+	std::shared_ptr<IParser> IParser::create(Callback f_onFrame)
+	{
+		return std::make_shared<CParser>(std::move(f_onFrame));
+	}
+
+	IParser::~IParser() {}
+}
+
+
+const size_t CParser::MaxFrameSize;
+const size_t CParser::Window;
+
+
+CParser::CParser(Callback f_onFrame):
+	m_onFrame(std::move(f_onFrame)),
+	m_synced(false),
+	m_first(0),
+	m_freeSlots(0),
+	m_offset(0),
+	m_pendingOffset(0),
+	m_pendingSize(0),
+	m_frames(0),
+	m_samples(0)
+{
+	m_buffer.reserve(2 * Window);
+}
+
+
+void CParser::feed(const uchar* f_data, size_t f_size)
+{
+	while(f_size)
+	{
+		if(m_buffer.empty())
+		{
+			// Parse the caller's chunk in place and keep the tail only
+			auto consumed = process(f_data, f_size);
+			m_offset += consumed;
+			m_buffer.assign(f_data + consumed, f_data + f_size);
+			break;
+		}
+
+		// Complete the carried data with a limited portion of the chunk
+		auto carried = m_buffer.size();
+		auto n = std::min(f_size, Window);
+		m_buffer.insert(m_buffer.end(), f_data, f_data + n);
+
+		auto consumed = process(&m_buffer[0], m_buffer.size());
+		m_offset += consumed;
+		if(consumed >= carried)
+		{
+			// The carried data is done: continue with the chunk
+			auto used = consumed - carried;
+			f_data += used;
+			f_size -= used;
+			m_buffer.clear();
+		}
+		else
+		{
+			f_data += n;
+			f_size -= n;
+			m_buffer.erase(m_buffer.begin(), m_buffer.begin() + consumed);
+		}
+	}
+}
+
+
+size_t CParser::process(const uchar* f_data, size_t f_size)
+{
+	for(size_t pos = 0;;)
+	{
+		if(!m_synced)
+		{
+			auto candidate = pos + CSync::find(f_data + pos, f_size - pos);
+			if(candidate == f_size)
+			{
+				// Keep the last bytes: a header may be split between chunks
+				return std::max(pos, (f_size < CHeader::getSize()) ? 0 : f_size - CHeader::getSize() + 1);
+			}
+
+			auto verdict = verify(f_data + candidate, f_size - candidate);
+			if(verdict == Verdict::More)
+				return candidate;
+			if(verdict == Verdict::No)
+			{
+				pos = candidate + 1;
+				continue;
+			}
+
+			m_synced = true;
+			m_first = CHeader(*reinterpret_cast<const uint*>(f_data + candidate));
+			pos = candidate;
+		}
+
+		if(pos + CHeader::getSize() > f_size)
+			return pos;
+
+		auto rawHeader = *reinterpret_cast<const uint*>(f_data + pos);
+		CHeader h(rawHeader);
+		uint size;
+		if(m_pendingSize && m_pendingOffset == m_offset + pos)
+			size = m_pendingSize;
+		else
+		{
+			if(!CHeader::isValid(rawHeader) || (!h.isFreeBitrate() && !m_first.isFreeBitrate() && h != m_first))
+			{
+				// Lost sync
+				m_synced = false;
+				continue;
+			}
+
+			if(h.isFreeBitrate())
+			{
+				size = h.calcFrameSize(f_data + pos, f_size - pos, m_freeSlots);
+				if(!size)
+				{
+					if(f_size - pos < MaxFrameSize)
+						return pos;
+					m_synced = false;
+					++pos;
+					continue;
+				}
+			}
+			else
+			{
+				if(m_first.isFreeBitrate())
+					m_first = h;
+				size = h.getFrameSize();
+			}
+		}
+
+		if(pos + size > f_size)
+		{
+			m_pendingOffset = m_offset + pos;
+			m_pendingSize = size;
+			return pos;
+		}
+		m_pendingSize = 0;
+
+		auto time = static_cast<float>(static_cast<double>(m_samples) / h.getSamplingRate());
+		MPEG::Frame frame = {m_offset + pos, size, m_samples, time, h.getFrameDataOffset()};
+		++m_frames;
+		m_samples += h.getFrameSamples();
+		pos += size;
+
+		if(m_onFrame)
+			m_onFrame(frame);
+	}
+}
+
+
+CParser::Verdict CParser::verify(const uchar* f_data, size_t f_size) const
+{
+	// The same check as IStream::verifyFrameSequence, but a sequence cut by
+	// the end of the data is not rejected
+	size_t offset = 0;
+	for(auto nFrames = CSync::HeadersToVerify; nFrames; --nFrames)
+	{
+		if(offset + CHeader::getSize() > f_size)
+			return Verdict::More;
+
+		auto rawHeader = *reinterpret_cast<const uint*>(f_data + offset);
+		if(!CHeader::isValid(rawHeader))
+			return Verdict::No;
+
+		CHeader h(rawHeader);
+		if(h.isFreeBitrate())
+		{
+			auto size = h.calcFrameSize(f_data + offset, f_size - offset);
+			if(!size)
+				return (f_size - offset < MaxFrameSize) ? Verdict::More : Verdict::No;
+			offset += size;
+		}
+		else
+			offset += h.getFrameSize();
+	}
+
+	return Verdict::Yes;
+}
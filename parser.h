@@ -0,0 +1,62 @@
+#pragma once
+
+#include "common.h"
+#include "mpeg.h"
+#include "header.h"
+
+#include <vector>
+
+
+class CParser final : public MPEG::IParser
+{
+public:
+	// The largest possible frame (MPEG 2 layer II, 160 kbps @ 8 kHz, padded)
+	static const size_t	MaxFrameSize	= 2881;
+	// Synchronization looks ahead for a few frames, the rest needs one frame at most
+	static const size_t	Window			= 4 * MaxFrameSize;
+
+public:
+						CParser			(Callback f_onFrame);
+						CParser			() = delete;
+
+	void				feed			(const uchar* f_data, size_t f_size) final override;
+
+	uint				getFrameCount	() const final override { return m_frames;			}
+	float				getLength		() const final override
+	{
+		return m_frames ? static_cast<float>(static_cast<double>(m_samples) / m_first.getSamplingRate()) : 0.0f;
+	}
+	size_t				getSize			() const final override { return m_offset + m_buffer.size(); }
+	size_t				getBufferedSize	() const final override { return m_buffer.size();	}
+
+private:
+	// Return the number of consumed bytes: the rest must be passed again with more data
+	size_t				process			(const uchar* f_data, size_t f_size);
+
+	enum class Verdict
+	{
+		Yes,
+		No,
+		More
+	};
+	Verdict				verify			(const uchar* f_data, size_t f_size) const;
+
+private:
+	Callback			m_onFrame;
+
+	bool				m_synced;
+	CHeader				m_first;
+	// The free-format frame size (in slots) established by the previous frames
+	uint				m_freeSlots;
+
+	// Absolute offset of the first unconsumed byte
+	size_t				m_offset;
+	std::vector<uchar>	m_buffer;
+
+	// The header of an incomplete frame is parsed only once
+	size_t				m_pendingOffset;
+	uint				m_pendingSize;
+
+	uint				m_frames;
+	uint64_t			m_samples;
+};
@@ -0,0 +1,192 @@
+#include "pieces.h"
+
+#include <algorithm>
+
+
+CPieceTable::CPieceTable():
+	m_index(nullptr),
+	m_begin(0),
+	m_count(0),
+	m_size(0),
+	m_samples(0)
+{}
+
+
+void CPieceTable::reset(const CFrameIndex* f_index, size_t f_end, uint64_t f_samples)
+{
+	m_index = f_index;
+	m_pieces.clear();
+
+	auto n = f_index->getCount();
+	m_begin = n ? f_index->get(0).Offset : f_end;
+	if(n)
+	{
+		Piece piece;
+		piece.First			= 0;
+		piece.Last			= n;
+		piece.IndexBegin	= m_begin;
+		piece.IndexEnd		= f_end;
+		piece.IndexSample	= 0;
+		piece.IndexEndSample= f_samples;
+		m_pieces.push_back(piece);
+	}
+	update(0);
+}
+
+
+std::vector<CPieceTable::Piece>::const_iterator CPieceTable::find(uint f_frame) const
+{
+	ASSERT(f_frame < m_count);
+	auto it = std::upper_bound(m_pieces.cbegin(), m_pieces.cend(), f_frame,
+							   [](uint f_f, const Piece& f_piece) { return f_f < f_piece.Frame; });
+	return --it;
+}
+
+
+uint CPieceTable::getIndexed(uint f_frame) const
+{
+	auto it = find(f_frame);
+	return it->First + (f_frame - it->Frame);
+}
+
+
+FrameInfo CPieceTable::get(uint f_frame) const
+{
+	auto it = find(f_frame);
+	auto frame = m_index->get(it->First + (f_frame - it->Frame));
+	frame.Offset = it->Offset + (frame.Offset - it->IndexBegin);
+	frame.Sample = it->Sample + (frame.Sample - it->IndexSample);
+	return frame;
+}
+
+
+uint CPieceTable::findNext(uint64_t f_sample, uint f_first) const
+{
+	if(f_first >= m_count || get(f_first).Sample > f_sample)
+		return f_first;
+
+	// The last piece starting not after the sample (but not before the one with f_first)
+	auto first = find(f_first);
+	auto it = std::upper_bound(first, m_pieces.cend(), f_sample,
+							   [](uint64_t f_s, const Piece& f_piece) { return f_s < f_piece.Sample; });
+	it = (it == first) ? first : (it - 1);
+	auto from = std::max(f_first, it->Frame);
+
+	// Search the indexed samples of the piece (the next piece starts after the sample)
+	auto next = std::min(m_index->findNext(f_sample - it->Sample + it->IndexSample, it->First + (from - it->Frame)), it->Last);
+	return it->Frame + (next - it->First);
+}
+
+
+CPieceTable::Piece CPieceTable::make(uint f_first, uint f_last, const Piece& f_bounds) const
+{
+	auto piece = f_bounds;
+	if(f_first != piece.First)
+	{
+		auto frame = m_index->get(f_first);
+		piece.First		= f_first;
+		piece.IndexBegin	= frame.Offset;
+		piece.IndexSample	= frame.Sample;
+	}
+	if(f_last != piece.Last)
+	{
+		auto frame = m_index->get(f_last);
+		piece.Last			= f_last;
+		piece.IndexEnd		= frame.Offset;
+		piece.IndexEndSample= frame.Sample;
+	}
+	return piece;
+}
+
+
+void CPieceTable::cut(uint f_frame, uint f_count)
+{
+	ASSERT(f_count && f_frame + f_count <= m_count);
+
+	// The pieces with the first and the last removed frames
+	auto first = find(f_frame);
+	auto last = find(f_frame + f_count - 1);
+	auto cutBegin = first->First + (f_frame - first->Frame);
+	auto cutEnd = last->First + (f_frame + f_count - last->Frame);
+
+	// What is left of them
+	std::vector<Piece> rest;
+	if(cutBegin != first->First)
+		rest.push_back(make(first->First, cutBegin, *first));
+	if(cutEnd != last->Last)
+		rest.push_back(make(cutEnd, last->Last, *last));
+
+	auto pos = first - m_pieces.cbegin();
+	auto it = m_pieces.erase(first, last + 1);
+	m_pieces.insert(it, rest.begin(), rest.end());
+	update(pos);
+}
+
+
+void CPieceTable::cut(const std::vector<Range>& f_ranges)
+{
+	std::vector<Piece> pieces;
+	pieces.reserve(m_pieces.size() + f_ranges.size());
+
+	auto r = f_ranges.cbegin();
+	for(auto& piece : m_pieces)
+	{
+		// Keep the frames of the piece out of the ranges
+		auto pos = piece.Frame;
+		auto end = piece.Frame + piece.getCount();
+		auto keep = [&](uint f_begin, uint f_end)
+		{
+			pieces.push_back(make(piece.First + (f_begin - piece.Frame), piece.First + (f_end - piece.Frame), piece));
+		};
+		while(pos < end)
+		{
+			while(r != f_ranges.cend() && r->Frame + r->Count <= pos)
+				++r;
+			if(r == f_ranges.cend() || r->Frame >= end)
+			{
+				keep(pos, end);
+				break;
+			}
+			if(r->Frame > pos)
+				keep(pos, r->Frame);
+			pos = std::min(end, r->Frame + r->Count);
+		}
+	}
+
+	m_pieces.swap(pieces);
+	update(0);
+}
+
+
+void CPieceTable::update(size_t f_piece)
+{
+	for(auto i = f_piece; i < m_pieces.size(); ++i)
+	{
+		auto& piece = m_pieces[i];
+		if(i)
+		{
+			auto& prev = m_pieces[i - 1];
+			piece.Frame		= prev.Frame + prev.getCount();
+			piece.Offset	= prev.Offset + prev.getSize();
+			piece.Sample	= prev.Sample + prev.getSamples();
+		}
+		else
+		{
+			piece.Frame		= 0;
+			piece.Offset	= m_begin;
+			piece.Sample	= 0;
+		}
+	}
+
+	if(m_pieces.empty())
+	{
+		m_count = 0;
+		m_size = m_begin;
+		m_samples = 0;
+		return;
+	}
+	auto& last = m_pieces.back();
+	m_count		= last.Frame + last.getCount();
+	m_size		= last.Offset + last.getSize();
+	m_samples	= last.Sample + last.getSamples();
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include "common.h"
+#include "index.h"
+
+#include <vector>
+
+
+// The frames of an edited stream: ranges (pieces) of the indexed frames.
+// An edit changes the pieces only, the data and the frame index stay intact,
+// the bytes are gathered when the stream is serialized
+class CPieceTable
+{
+public:
+	// The indexed frames [First, Last) and their position in the edited stream
+	struct Piece
+	{
+		uint	First;
+		uint	Last;
+		// The indexed offsets / samples of First and Last
+		size_t		IndexBegin;
+		size_t		IndexEnd;
+		uint64_t	IndexSample;
+		uint64_t	IndexEndSample;
+
+		// The number of edited frames before the piece, the offset and the first sample of the piece
+		uint		Frame;
+		size_t		Offset;
+		uint64_t	Sample;
+
+		uint		getCount	() const { return Last - First; }
+		size_t		getSize		() const { return IndexEnd - IndexBegin; }
+		uint64_t	getSamples	() const { return IndexEndSample - IndexSample; }
+	};
+
+	// Edited frames [Frame, Frame + Count)
+	struct Range
+	{
+		uint	Frame;
+		uint	Count;
+	};
+
+public:
+					CPieceTable		();
+
+	// A single piece with all the frames of the index; f_end and f_samples are the end and the duration
+	// of the indexed stream. The index must outlive the table (or the next reset)
+	void			reset			(const CFrameIndex* f_index, size_t f_end, uint64_t f_samples);
+
+	// The edited stream starts at f_begin instead of the first indexed offset (e.g. after a new info frame)
+	void			setBegin		(size_t f_begin) { m_begin = f_begin; update(0); }
+
+	uint			getCount		() const { return m_count; }
+	// The end of the edited stream
+	size_t			getSize			() const { return m_size; }
+	uint64_t		getSampleCount	() const { return m_samples; }
+	// Whether any frame is removed
+	bool			isEdited		() const { return m_count != (m_index ? m_index->getCount() : 0); }
+
+	const std::vector<Piece>&	getPieces	() const { return m_pieces; }
+	// The indexed frame of an edited one
+	uint			getIndexed		(uint f_frame) const;
+
+	FrameInfo		get				(uint f_frame) const;
+	// Call f_func(first, last) for the indexed frames of the edited frames [f_frame, f_frame + f_count),
+	// a range per piece: O(log P) + the number of pieces
+	template<typename Func>
+	void			forIndexed		(uint f_frame, uint f_count, Func f_func) const
+	{
+		forPieces(f_frame, f_count, [&](const Piece&, uint f_first, uint f_last) { f_func(f_first, f_last); });
+	}
+	// The same with the byte ranges [begin, end) of the frames in the indexed data
+	template<typename Func>
+	void			forIndexedBytes	(uint f_frame, uint f_count, Func f_func) const
+	{
+		forPieces(f_frame, f_count, [&](const Piece& f_piece, uint f_first, uint f_last)
+		{
+			f_func((f_first == f_piece.First) ? f_piece.IndexBegin : m_index->get(f_first).Offset,
+				   (f_last == f_piece.Last) ? f_piece.IndexEnd : m_index->get(f_last).Offset);
+		});
+	}
+	// The same as CFrameIndex::findNext for the edited frames
+	uint			findNext		(uint64_t f_sample, uint f_first) const;
+
+	// Remove f_count frames starting from f_frame: O(log P) to find the pieces + O(P) to move them
+	void			cut				(uint f_frame, uint f_count);
+	// Remove sorted non-overlapping ranges in one pass over the pieces: O(P + R)
+	void			cut				(const std::vector<Range>& f_ranges);
+
+	size_t			getMemoryUsage	() const { return m_pieces.capacity() * sizeof(Piece); }
+
+private:
+	// The piece with the edited frame
+	std::vector<Piece>::const_iterator	find	(uint f_frame) const;
+	// Call f_func(piece, first, last) for the pieces of the edited frames (see forIndexed)
+	template<typename Func>
+	void			forPieces		(uint f_frame, uint f_count, Func f_func) const
+	{
+		ASSERT(f_frame + f_count <= m_count);
+		auto end = f_frame + f_count;
+		for(auto it = f_count ? find(f_frame) : m_pieces.cend(); it != m_pieces.cend() && it->Frame < end; ++it)
+		{
+			auto first = std::max(f_frame, it->Frame);
+			auto last = std::min(end, it->Frame + it->getCount());
+			f_func(*it, it->First + (first - it->Frame), it->First + (last - it->Frame));
+		}
+	}
+	// A piece of the indexed frames [f_first, f_last) with the known bounds
+	Piece			make			(uint f_first, uint f_last, const Piece& f_bounds) const;
+	// Recalculate the positions of the pieces starting from f_piece
+	void			update			(size_t f_piece);
+
+private:
+	const CFrameIndex*	m_index;
+	// The offset of the edited stream frames (the first indexed frame offset unless set)
+	size_t				m_begin;
+
+	std::vector<Piece>	m_pieces;
+	uint				m_count;
+	size_t				m_size;
+	uint64_t			m_samples;
+};
@@ -0,0 +1,239 @@
+#include "sidecar.h"
+
+#include "stream.h"
+#include "index.h"
+
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+const uint CSidecar::Version;
+const size_t CSidecar::HashedSize;
+
+static const char s_magic[4] = {'M', 'P', 'I', 'X'};
+
+
+CSidecar::Fingerprint CSidecar::getFingerprint(const CMappedFile& f_data)
+{
+	auto data = f_data.getData();
+	auto size = f_data.getSize();
+
+	// FNV-1a of the head and the tail
+	uint64_t hash = 0xCBF29CE484222325ull;
+	auto add = [&hash](const uchar* f_begin, const uchar* f_end)
+	{
+		for(auto p = f_begin; p != f_end; ++p)
+			hash = (hash ^ *p) * 0x100000001B3ull;
+	};
+	auto head = std::min(size, HashedSize);
+	add(data, data + head);
+	add(data + std::max(head, size - std::min(size, HashedSize)), data + size);
+
+	return {size, f_data.getModificationTime(), hash};
+}
+
+
+uint64_t CSidecar::getChecksum(const uchar* f_data, size_t f_size)
+{
+	ASSERT(!(f_size % sizeof(uint64_t)));
+	uint64_t hash = 0xCBF29CE484222325ull;
+	for(size_t i = 0; i < f_size; i += sizeof(uint64_t))
+	{
+		uint64_t word;
+		memcpy(&word, f_data + i, sizeof(word));
+		hash = (hash ^ word) * 0x100000001B3ull;
+	}
+	return hash;
+}
+
+
+void CSidecar::write(const MPEG::File& f_file, const CMappedFile& f_data, std::vector<uchar>& f_out)
+{
+	ASSERT(f_file.Stream);
+	auto& stream = dynamic_cast<const CStream&>(*f_file.Stream);
+	stream.ensureIndex();
+	// The sidecar describes the file as it is
+	ASSERT(!stream.m_pieces.isEdited());
+
+	auto fingerprint = getFingerprint(f_data);
+	auto cbr = dynamic_cast<const CCbrIndex*>(stream.m_frames.get());
+	auto count = stream.getFrameCount();
+
+	Header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.Magic, s_magic, sizeof(h.Magic));
+	h.Version		= Version;
+	h.FileSize		= fingerprint.Size;
+	h.MTime			= fingerprint.MTime;
+	h.Hash			= fingerprint.Hash;
+	h.Offset		= f_file.Offset;
+	h.Size			= stream.getSize();
+	h.Samples		= stream.m_samples;
+	h.FrameCount	= count;
+	h.Bitrate		= stream.m_abr;
+	h.SamplingRate	= stream.m_sampling_rate;
+	h.MpegVersion	= static_cast<uint8_t>(stream.m_version);
+	h.Layer			= static_cast<uint8_t>(stream.m_layer);
+	h.VBR			= stream.m_vbr;
+	h.ChannelMode	= static_cast<uint8_t>(stream.m_channel_mode);
+	h.Emphasis		= static_cast<uint8_t>(stream.m_emphasis);
+	h.Info			= stream.m_xing ? InfoFrame::Xing : (stream.m_vbri ? InfoFrame::VBRI : InfoFrame::None);
+	h.Frames		= cbr ? Index::CBR : Index::Table;
+	h.Warnings		= stream.m_warnings;
+	h.GapCount		= static_cast<uint32_t>(stream.m_gaps.size());
+	h.RecoverLimit	= stream.m_options.Recover ? stream.m_options.RecoverLimit : 0;
+
+	f_out.resize(sizeof(h) + (cbr ? 0 : count * sizeof(CTableIndex::Record)) + h.GapCount * sizeof(GapRecord));
+
+	auto p = &f_out[sizeof(h)];
+	for(uint i = 0; !cbr && i < count; ++i, p += sizeof(CTableIndex::Record))
+	{
+		auto frame = stream.m_frames->get(i);
+		CTableIndex::Record r = {frame.Offset, frame.Sample, frame.Size, frame.DataRelOffset};
+		memcpy(p, &r, sizeof(r));
+	}
+	for(auto& gap : stream.m_gaps)
+	{
+		GapRecord r = {gap.Offset, gap.Size, static_cast<uint32_t>(gap.Reason), 0};
+		memcpy(p, &r, sizeof(r));
+		p += sizeof(r);
+	}
+
+	h.Checksum = getChecksum(&f_out[sizeof(h)], f_out.size() - sizeof(h));
+	memcpy(&f_out[0], &h, sizeof(h));
+}
+
+
+void CSidecar::save(const std::string& f_path, const std::vector<uchar>& f_sidecar)
+{
+	// In the same directory: the rename must not cross file systems
+	auto tmp = f_path + ".XXXXXX";
+	auto fd = ::mkstemp(&tmp[0]);
+	if(fd < 0)
+		throw std::system_error(errno, std::generic_category(), "failed to create \"" + tmp + '"');
+	// mkstemp() creates the file for the owner only
+	::fchmod(fd, 0644);
+
+	for(size_t written = 0; written < f_sidecar.size();)
+	{
+		auto n = ::write(fd, &f_sidecar[written], f_sidecar.size() - written);
+		if(n < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			auto err = errno;
+			::close(fd);
+			::unlink(tmp.c_str());
+			throw std::system_error(err, std::generic_category(), "failed to write \"" + tmp + '"');
+		}
+		written += static_cast<size_t>(n);
+	}
+	if(::close(fd))
+	{
+		auto err = errno;
+		::unlink(tmp.c_str());
+		throw std::system_error(err, std::generic_category(), "failed to write \"" + tmp + '"');
+	}
+
+	if(::rename(tmp.c_str(), f_path.c_str()))
+	{
+		auto err = errno;
+		::unlink(tmp.c_str());
+		throw std::system_error(err, std::generic_category(), "failed to rename \"" + tmp + '"');
+	}
+}
+
+
+MPEG::File CSidecar::load(const std::shared_ptr<const CMappedFile>& f_sidecar,
+						  const std::shared_ptr<const CMappedFile>& f_data, const MPEG::Options& f_options)
+{
+	MPEG::File result = {nullptr, f_data->getSize(), f_data->getSize(), 0, {}};
+
+	auto size = f_sidecar->getSize();
+	if(size < sizeof(Header))
+		return result;
+	auto& h = *reinterpret_cast<const Header*>(f_sidecar->getData());
+
+	auto fingerprint = getFingerprint(*f_data);
+	if(memcmp(h.Magic, s_magic, sizeof(h.Magic)) || h.Version != Version ||
+	   h.FileSize != fingerprint.Size || h.MTime != fingerprint.MTime || h.Hash != fingerprint.Hash)
+		return result;
+	if(!h.Size || h.Offset + h.Size > f_data->getSize() || !h.FrameCount)
+		return result;
+	// Scanned the same way
+	if(h.RecoverLimit != (f_options.Recover ? f_options.RecoverLimit : 0))
+		return result;
+
+	auto data = f_data->getData() + h.Offset;
+	auto options = f_options;
+	options.Borrow = true;
+	std::shared_ptr<CStream> stream(new CStream(data, h.Size, options, nullptr));
+
+	auto info = stream->m_xing ? InfoFrame::Xing : (stream->m_vbri ? InfoFrame::VBRI : InfoFrame::None);
+	if(info != h.Info)
+		return result;
+
+	auto tableSize = (h.Frames == Index::Table) ? h.FrameCount * sizeof(CTableIndex::Record) : 0;
+	if(size != sizeof(Header) + tableSize + h.GapCount * sizeof(GapRecord) ||
+	   h.Checksum != getChecksum(f_sidecar->getData() + sizeof(Header), size - sizeof(Header)))
+		return result;
+
+	if(h.Frames == Index::Table)
+	{
+		// The sidecar mapping lives as long as the index
+		auto records = reinterpret_cast<const CTableIndex::Record*>(&h + 1);
+		// The frames follow each other (maybe with gaps) within the stream, so do their samples
+		for(uint i = 0; i < h.FrameCount; ++i)
+		{
+			auto& r = records[i];
+			if(!r.Size || r.Offset + r.Size > h.Size || r.Sample >= h.Samples)
+				return result;
+			if(i && (r.Offset < records[i - 1].Offset + records[i - 1].Size || r.Sample <= records[i - 1].Sample))
+				return result;
+		}
+		stream->m_frames = std::make_unique<CTableIndex>(records, h.FrameCount, f_sidecar);
+	}
+	else if(h.Frames == Index::CBR)
+	{
+		// The stream would have a frame table
+		if(!f_options.ImplicitCBR || f_options.Recover)
+			return result;
+		// The padding pattern is detected again (a header read per frame, no scan)
+		auto cbr = CCbrIndex::detect(data, stream->getInfoFrameSize(), h.Size);
+		if(!cbr || cbr->getCount() != h.FrameCount || cbr->getEnd() != h.Size)
+			return result;
+		stream->m_frames = std::move(cbr);
+	}
+	else
+		return result;
+
+	stream->m_samples		= h.Samples;
+	stream->m_version		= static_cast<MPEG::Version>(h.MpegVersion);
+	stream->m_layer			= h.Layer;
+	stream->m_abr			= h.Bitrate;
+	stream->m_vbr			= h.VBR;
+	stream->m_sampling_rate	= h.SamplingRate;
+	stream->m_channel_mode	= static_cast<MPEG::ChannelMode>(h.ChannelMode);
+	stream->m_emphasis		= static_cast<MPEG::Emphasis>(h.Emphasis);
+	stream->m_warnings		= h.Warnings;
+	auto gaps = reinterpret_cast<const GapRecord*>(f_sidecar->getData() + sizeof(Header) + tableSize);
+	for(uint i = 0; i < h.GapCount; ++i)
+	{
+		if(gaps[i].Reason > static_cast<uint32_t>(MPEG::GapReason::FreeBitrate) || gaps[i].Offset + gaps[i].Size > h.Size)
+			return result;
+		stream->m_gaps.push_back({gaps[i].Offset, gaps[i].Size, static_cast<MPEG::GapReason>(gaps[i].Reason)});
+	}
+	stream->m_pieces.reset(stream->m_frames.get(), h.Size, h.Samples);
+	// The file mapping lives as long as the stream
+	stream->keepAlive(f_data);
+
+	result.Offset = h.Offset;
+	result.Trailing = f_data->getSize() - h.Offset - h.Size;
+	result.Stream = std::move(stream);
+	return result;
+}
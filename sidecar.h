@@ -0,0 +1,110 @@
+#pragma once
+
+#include "common.h"
+#include "mpeg.h"
+#include "mmap.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+
+// Frame index sidecar file: a header with the fingerprint of the MPEG file and the stream info
+// followed by the frame table and the gaps skipped by the recovery. The format is little-endian and 8-byte aligned, so a mapped
+// sidecar is used in place (loading costs the fingerprint check, a checksum and a bounds check of the records)
+class CSidecar
+{
+public:
+	static const uint	Version		= 4;
+	// The bytes hashed at the head and at the tail of the file
+	static const size_t	HashedSize	= 64 << 10;
+
+	// Serialize the stream of an opened file
+	static void			write			(const MPEG::File& f_file, const CMappedFile& f_data, std::vector<uchar>& f_out);
+	// Write to a unique temporary file next to it and rename it, so readers never see a partial sidecar
+	// and concurrent writers don't collide (the last rename wins). Throw std::system_error on I/O failures
+	static void			save			(const std::string& f_path, const std::vector<uchar>& f_sidecar);
+	// Restore the stream of the file from a mapped sidecar without scanning the frames.
+	// File::Stream is null if the sidecar doesn't match the file (or is broken) or the options: the recovery
+	// must be the same and the implicit CBR index allowed if the sidecar has no table. A table is used
+	// in place whatever Options::Index (it takes no heap memory)
+	static MPEG::File	load			(const std::shared_ptr<const CMappedFile>& f_sidecar,
+										 const std::shared_ptr<const CMappedFile>& f_data, const MPEG::Options& f_options);
+
+	CSidecar() = delete;
+
+private:
+	// Binds a sidecar to the file contents
+	struct Fingerprint
+	{
+		uint64_t	Size;
+		int64_t		MTime;
+		uint64_t	Hash;
+	};
+
+	enum class InfoFrame : uint8_t
+	{
+		None,
+		Xing,
+		VBRI
+	};
+
+	enum class Index : uint8_t
+	{
+		// The frame table follows the header
+		Table,
+		// No table: the implicit CBR index is detected again
+		CBR
+	};
+
+	struct Header
+	{
+		char		Magic[4];
+		uint32_t	Version;
+
+		// The fingerprint of the MPEG file
+		uint64_t	FileSize;
+		int64_t		MTime;
+		uint64_t	Hash;
+
+		// The stream position in the file
+		uint64_t	Offset;
+		uint64_t	Size;
+
+		// The stream info
+		uint64_t	Samples;
+		uint32_t	FrameCount;
+		uint32_t	Bitrate;
+		uint32_t	SamplingRate;
+		uint8_t		MpegVersion;
+		uint8_t		Layer;
+		uint8_t		VBR;
+		uint8_t		ChannelMode;
+		uint8_t		Emphasis;
+		InfoFrame	Info;
+		Index		Frames;
+		uint8_t		Reserved0;
+		uint32_t	Warnings;
+		uint32_t	GapCount;
+		uint32_t	Reserved1;
+		// Of the frame table and the gaps
+		uint64_t	Checksum;
+		// Options::RecoverLimit of the scan (0 - no recovery): the frames and the gaps depend on it
+		uint64_t	RecoverLimit;
+	};
+	static_assert(sizeof(Header) % 8 == 0, "The frame table must be 8-byte aligned");
+
+	struct GapRecord
+	{
+		uint64_t	Offset;
+		uint64_t	Size;
+		uint32_t	Reason;
+		uint32_t	Reserved;
+	};
+
+private:
+	static Fingerprint	getFingerprint	(const CMappedFile& f_data);
+	// FNV-1a over 8-byte words (the records are 8-byte aligned and sized)
+	static uint64_t		getChecksum		(const uchar* f_data, size_t f_size);
+};
@@ -0,0 +1,140 @@
+#include "sideinfo.h"
+
+
+namespace
+{
+	// The bit positions of the fields (ISO/IEC 11172-3 2.4.1.7, ISO/IEC 13818-3 2.4.1.7)
+	template<bool V2, bool Mono>
+	struct Layout
+	{
+		static const uint Granules		= V2 ? 1 : 2;
+		static const uint Channels		= Mono ? 1 : 2;
+		static const uint MainDataBegin	= V2 ? 8 : 9;
+		// main_data_begin, private_bits and (MPEG 1) scfsi
+		static const uint Head			= V2 ? (8 + (Mono ? 1 : 2)) : (9 + (Mono ? 5 : 3) + 4 * Channels);
+		// part2_3_length 12, big_values 9, global_gain 8, scalefac_compress 4 / 9, window_switching_flag 1,
+		// 22 bits either way, preflag (MPEG 1), scalefac_scale, count1table_select
+		static const uint ChannelBits	= V2 ? 63 : 59;
+
+		static constexpr uint getPos(uint f_granule, uint f_channel)
+		{
+			return Head + (f_granule * Channels + f_channel) * ChannelBits;
+		}
+	};
+
+	// A big-endian field (within 4 bytes) at a constant bit position
+	template<uint Pos, uint Bits>
+	uint getBits(const uchar* f_p)
+	{
+		static_assert(Bits && Pos % 8 + Bits <= 32, "The field must fit 4 bytes");
+		const uint First = Pos / 8;
+		const uint Last = (Pos + Bits - 1) / 8;
+		uint value = 0;
+		for(uint i = First; i <= Last; ++i)
+			value = (value << 8) | f_p[i];
+		return (value >> (7 - (Pos + Bits - 1) % 8)) & ((1u << Bits) - 1);
+	}
+
+	template<bool V2, bool Mono, uint Granule, uint Channel>
+	void decodeChannel(const uchar* f_p, MPEG::SideInfo& f_info)
+	{
+		const uint Pos = Layout<V2, Mono>::getPos(Granule, Channel);
+		f_info.Part23Length[Granule][Channel]	= getBits<Pos, 12>(f_p);
+		f_info.GlobalGain[Granule][Channel]		= getBits<Pos + 12 + 9, 8>(f_p);
+	}
+
+	template<bool V2, bool Mono>
+	void decode(const uchar* f_p, MPEG::SideInfo& f_info)
+	{
+		using L = Layout<V2, Mono>;
+		f_info.MainDataBegin	= getBits<0, L::MainDataBegin>(f_p);
+		f_info.Granules			= L::Granules;
+		f_info.Channels			= L::Channels;
+
+		// The conditions are constant
+		decodeChannel<V2, Mono, 0, 0>(f_p, f_info);
+		if(!Mono)
+			decodeChannel<V2, Mono, 0, 1>(f_p, f_info);
+		if(!V2)
+		{
+			decodeChannel<V2, Mono, 1, 0>(f_p, f_info);
+			if(!Mono)
+				decodeChannel<V2, Mono, 1, 1>(f_p, f_info);
+		}
+	}
+}
+
+
+CSideInfoIndex::Decoder CSideInfoIndex::getDecoder(bool f_v2, bool f_mono)
+{
+	static const Decoder s_decoders[2][2] =
+	{
+		{decode<false, false>,	decode<false, true>},
+		{decode<true, false>,	decode<true, true>}
+	};
+	return s_decoders[f_v2][f_mono];
+}
+
+
+CSideInfoIndex::CSideInfoIndex(const CHeader& f_header):
+	m_granules((f_header.getVersion() == MPEG::Version::v1) ? 2 : 1),
+	m_channels((f_header.getChannelMode() == MPEG::ChannelMode::Mono) ? 1 : 2)
+{
+	ASSERT(f_header.getLayer() == 3);
+	m_decode = getDecoder(m_granules == 1, m_channels == 1);
+}
+
+
+void CSideInfoIndex::push(const uchar* f_frame)
+{
+	// The protection bit is clear when a CRC follows the header
+	MPEG::SideInfo info;
+	m_decode(f_frame + CHeader::getSize() + ((f_frame[1] & 1) ? 0 : 2), info);
+
+	m_mainDataBegin.push_back(static_cast<uint16_t>(info.MainDataBegin));
+	for(uint gr = 0; gr < m_granules; ++gr)
+	{
+		for(uint ch = 0; ch < m_channels; ++ch)
+		{
+			m_part23Length.push_back(static_cast<uint16_t>(info.Part23Length[gr][ch]));
+			m_globalGain.push_back(static_cast<uint8_t>(info.GlobalGain[gr][ch]));
+		}
+	}
+}
+
+
+void CSideInfoIndex::append(const CSideInfoIndex& f_index, uint f_first)
+{
+	ASSERT(f_index.m_granules == m_granules && f_index.m_channels == m_channels && f_first <= f_index.getCount());
+	auto values = f_first * m_granules * m_channels;
+	m_mainDataBegin.insert(m_mainDataBegin.end(), f_index.m_mainDataBegin.begin() + f_first, f_index.m_mainDataBegin.end());
+	m_part23Length.insert(m_part23Length.end(), f_index.m_part23Length.begin() + values, f_index.m_part23Length.end());
+	m_globalGain.insert(m_globalGain.end(), f_index.m_globalGain.begin() + values, f_index.m_globalGain.end());
+}
+
+
+void CSideInfoIndex::get(uint f_index, MPEG::SideInfo& f_info) const
+{
+	ASSERT(f_index < getCount());
+	f_info = MPEG::SideInfo();
+	f_info.MainDataBegin	= m_mainDataBegin[f_index];
+	f_info.Granules			= m_granules;
+	f_info.Channels			= m_channels;
+
+	auto i = f_index * m_granules * m_channels;
+	for(uint gr = 0; gr < m_granules; ++gr)
+	{
+		for(uint ch = 0; ch < m_channels; ++ch, ++i)
+		{
+			f_info.Part23Length[gr][ch]	= m_part23Length[i];
+			f_info.GlobalGain[gr][ch]	= m_globalGain[i];
+		}
+	}
+}
+
+
+size_t CSideInfoIndex::getMemoryUsage() const
+{
+	return m_mainDataBegin.capacity() * sizeof(uint16_t) + m_part23Length.capacity() * sizeof(uint16_t) +
+		   m_globalGain.capacity() * sizeof(uint8_t);
+}
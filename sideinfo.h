@@ -0,0 +1,45 @@
+#pragma once
+
+#include "common.h"
+#include "mpeg.h"
+#include "header.h"
+
+#include <cstdint>
+#include <vector>
+
+
+// Layer III side information columns of the indexed frames: main_data_begin and part2_3_length / global_gain
+// of every granule and channel. The fields have fixed bit positions for a version and a channel count
+// (the window switching branches are 22 bits both), so a decoder per combination reads them directly
+class CSideInfoIndex
+{
+public:
+	// The format of the frames (layer III)
+					CSideInfoIndex	(const CHeader& f_header);
+					CSideInfoIndex	() = delete;
+
+	// Decode the side information of the next frame (the whole frame is in the data)
+	void			push			(const uchar* f_frame);
+	// Append the frames [f_first, getCount()) of another index of the same format
+	void			append			(const CSideInfoIndex& f_index, uint f_first);
+
+	uint			getCount		() const { return static_cast<uint>(m_mainDataBegin.size()); }
+	void			get				(uint f_index, MPEG::SideInfo& f_info) const;
+	uint			getMainDataBegin(uint f_index) const { return m_mainDataBegin[f_index]; }
+
+	size_t			getMemoryUsage	() const;
+
+	// Decode the side information following the header (and the CRC)
+	using Decoder = void (*)(const uchar* f_sideInfo, MPEG::SideInfo& f_info);
+	static Decoder	getDecoder		(bool f_v2, bool f_mono);
+
+private:
+	Decoder					m_decode;
+	uint					m_granules;
+	uint					m_channels;
+
+	std::vector<uint16_t>	m_mainDataBegin;
+	// m_granules * m_channels per frame
+	std::vector<uint16_t>	m_part23Length;
+	std::vector<uint8_t>	m_globalGain;
+};
@@ -0,0 +1,83 @@
+#include "stats.h"
+
+#include <algorithm>
+
+
+const uint CFrameStats::BlockSize;
+
+
+CFrameStats::CFrameStats():
+	m_count(0),
+	m_total(0)
+{}
+
+
+void CFrameStats::push(uint f_size)
+{
+	if(!(m_count % BlockSize))
+		m_blockSums.push_back(m_total);
+	m_sums.push_back(static_cast<uint32_t>(m_total - m_blockSums.back()));
+	m_total += f_size;
+	++m_count;
+}
+
+
+void CFrameStats::build()
+{
+	// The level 0: the maxima of the blocks (the last one may be partial)
+	m_maxima.assign(1, std::vector<uint>(m_blockSums.size(), 0));
+	for(uint i = 0; i < m_count; ++i)
+		m_maxima[0][i / BlockSize] = std::max(m_maxima[0][i / BlockSize], getSize(i));
+
+	for(size_t width = 2; width <= m_blockSums.size(); width *= 2)
+	{
+		auto& prev = m_maxima.back();
+		std::vector<uint> level(m_blockSums.size() - width + 1);
+		for(size_t b = 0; b < level.size(); ++b)
+			level[b] = std::max(prev[b], prev[b + width / 2]);
+		m_maxima.push_back(std::move(level));
+	}
+}
+
+
+uint CFrameStats::getMaxSize(uint f_first, uint f_last) const
+{
+	ASSERT(f_first < f_last && f_last <= m_count && !m_maxima.empty());
+	uint result = 0;
+	auto firstBlock = f_first / BlockSize;
+	auto lastBlock = (f_last - 1) / BlockSize;
+
+	// The partial blocks at the ends are scanned
+	auto scan = [&](uint f_begin, uint f_end)
+	{
+		for(auto i = f_begin; i < f_end; ++i)
+			result = std::max(result, getSize(i));
+	};
+	if(firstBlock == lastBlock)
+	{
+		scan(f_first, f_last);
+		return result;
+	}
+	scan(f_first, (firstBlock + 1) * BlockSize);
+	scan(lastBlock * BlockSize, f_last);
+
+	// The whole blocks between them: two overlapping power-of-two spans
+	if(firstBlock + 1 < lastBlock)
+	{
+		auto count = lastBlock - firstBlock - 1;
+		uint level = 0;
+		while((2u << level) <= count)
+			++level;
+		result = std::max({result, m_maxima[level][firstBlock + 1], m_maxima[level][lastBlock - (1u << level)]});
+	}
+	return result;
+}
+
+
+size_t CFrameStats::getMemoryUsage() const
+{
+	size_t result = m_blockSums.capacity() * sizeof(uint64_t) + m_sums.capacity() * sizeof(uint32_t);
+	for(auto& level : m_maxima)
+		result += level.capacity() * sizeof(uint);
+	return result;
+}
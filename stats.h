@@ -0,0 +1,48 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <vector>
+
+
+// Frame size statistics over ranges of the indexed frames: byte sums from prefix sums,
+// the largest frame from a sparse table of block maxima. A query touches at most two partial
+// blocks (2 * BlockSize sizes) and two table entries, whatever the length of the range
+class CFrameStats
+{
+public:
+	static const uint	BlockSize	= 64;
+
+public:
+					CFrameStats		();
+
+	// Frames are added in index order, build() makes the maxima queryable
+	void			push			(uint f_size);
+	void			build			();
+
+	uint			getCount		() const { return m_count; }
+	// The total size and the largest size of the frames [f_first, f_last), f_first < f_last <= getCount()
+	uint64_t		getBytes		(uint f_first, uint f_last) const { return getSum(f_last) - getSum(f_first); }
+	uint			getMaxSize		(uint f_first, uint f_last) const;
+
+	size_t			getMemoryUsage	() const;
+
+private:
+	// The total size of the frames before the frame (f_frame <= getCount())
+	uint64_t		getSum			(uint f_frame) const
+	{
+		return (f_frame == m_count) ? m_total : (m_blockSums[f_frame / BlockSize] + m_sums[f_frame]);
+	}
+	uint			getSize			(uint f_frame) const { return static_cast<uint>(getSum(f_frame + 1) - getSum(f_frame)); }
+
+private:
+	// The sum before every block and the sums within the block before every frame
+	std::vector<uint64_t>			m_blockSums;
+	std::vector<uint32_t>			m_sums;
+	uint							m_count;
+	uint64_t						m_total;
+
+	// m_maxima[k][b] - the largest frame of the blocks [b, b + 2^k)
+	std::vector<std::vector<uint>>	m_maxima;
+};
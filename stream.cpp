@@ -1,23 +1,197 @@
-// check vbri consistency
 // mp3 padding fix
 
 #include "stream.h"
 #include "header.h"
+#include "decode.h"
+#include "sync.h"
 
+#include <algorithm>
 #include <sstream>
+#include <thread>
 
 
-CStream::CStream(const uchar* f_data, size_t f_size):
+// The stream split into chunks indexed by several threads: every thread resyncs at the start of its chunk
+// and builds a partial frame table of the frames starting in the chunk (the samples relative to the chunk)
+// with the aggregates the stream needs. The sequential parsing appends the rest of a chunk at once
+// when it reaches one of its frames (i.e. the chunk resync found the same frame) and parses the frames
+// itself otherwise (gaps, free-format frames, format changes and false resyncs)
+class CChunkIndex
+{
+public:
+	// A chunk is at least that large (a smaller stream is parsed sequentially)
+	static const size_t ChunkSizeMin = 1 << 20;
+
+	struct Chunk
+	{
+		Chunk(): Samples(0), LastChange(0), End(0) {}
+
+		std::vector<FrameInfo>			Frames;
+		// The bitrate sum (kbps) before every frame and of all of them
+		std::vector<uint64_t>			Bitrates;
+		uint64_t						Samples;
+		// The last frame with a bitrate other than the one of the previous frame (0 if none)
+		uint							LastChange;
+		// The offset after the last frame
+		size_t							End;
+		std::unique_ptr<CSideInfoIndex>	SideInfo;
+
+		uint	getBitrate	(uint f_frame) const { return static_cast<uint>(Bitrates[f_frame + 1] - Bitrates[f_frame]); }
+	};
+
+public:
+	// A free-format first frame leaves the format to the sequential parsing
+	CChunkIndex(const uchar* f_data, size_t f_offset, size_t f_size, const CHeader& f_first, bool f_sideInfo, uint f_threads):
+		m_chunk(0)
+	{
+		uint threads = f_threads ? f_threads : std::max(1u, std::thread::hardware_concurrency());
+		threads = static_cast<uint>(std::min<size_t>(threads, (f_size - f_offset) / ChunkSizeMin));
+		if(threads < 2 || f_first.isFreeBitrate())
+			return;
+
+		m_chunks.resize(threads);
+		std::vector<std::thread> workers;
+		auto step = (f_size - f_offset) / threads;
+		for(uint i = 1; i < threads; ++i)
+		{
+			auto begin = f_offset + i * step;
+			auto end = (i + 1 < threads) ? (begin + step) : f_size;
+			workers.emplace_back(parse, f_data, f_size, begin, end, true, f_first, f_sideInfo, std::ref(m_chunks[i]));
+		}
+		// The first chunk is indexed by this thread
+		parse(f_data, f_size, f_offset, f_offset + step, false, f_first, f_sideInfo, m_chunks[0]);
+		for(auto& worker : workers)
+			worker.join();
+	}
+
+	// The chunk having a frame at the offset (f_frame is set to its number) or nullptr. The offsets must increase
+	const Chunk* find(size_t f_offset, uint& f_frame)
+	{
+		for(; m_chunk < m_chunks.size(); ++m_chunk)
+		{
+			auto& frames = m_chunks[m_chunk].Frames;
+			if(!frames.empty() && frames.back().Offset >= f_offset)
+			{
+				auto i = std::lower_bound(frames.cbegin(), frames.cend(), f_offset,
+										  [](const FrameInfo& f_frame, size_t f_o) { return f_frame.Offset < f_o; });
+				if(i->Offset != f_offset)
+					return nullptr;
+				f_frame = static_cast<uint>(i - frames.cbegin());
+				return &m_chunks[m_chunk];
+			}
+			// The chunk is done
+			m_chunks[m_chunk] = Chunk();
+		}
+		return nullptr;
+	}
+
+private:
+	// Index the frames starting in [f_begin, f_end) until the first one the sequential parsing handles itself
+	static void parse(const uchar* f_data, size_t f_size, size_t f_begin, size_t f_end, bool f_resync, CHeader f_first,
+					  bool f_sideInfo, Chunk& f_chunk)
+	{
+		auto offset = f_begin;
+		if(f_resync)
+			offset += MPEG::IStream::calcFirstHeaderOffset(f_data + f_begin, f_size - f_begin);
+		if(f_sideInfo)
+			f_chunk.SideInfo = std::make_unique<CSideInfoIndex>(f_first);
+
+		f_chunk.Frames.reserve((f_end - f_begin) / f_first.getFrameSize() + 1);
+		f_chunk.Bitrates.push_back(0);
+		while(offset < f_end && offset + sizeof(uint) <= f_size)
+		{
+			auto rawHeader = *reinterpret_cast<const uint*>(f_data + offset);
+			if(!CDecodeTable::isValid(rawHeader))
+				break;
+			// A free-format size depends on the slot count of the previous frames
+			auto& info = CDecodeTable::get(rawHeader);
+			if(!info.FrameSize || offset + info.FrameSize > f_size || CHeader(rawHeader) != f_first)
+				break;
+
+			auto count = static_cast<uint>(f_chunk.Frames.size());
+			if(count && info.Bitrate != f_chunk.getBitrate(count - 1))
+				f_chunk.LastChange = count;
+			f_chunk.Frames.emplace_back(offset, info.FrameSize, f_chunk.Samples, CHeader::getSize() + info.SideInfoSize);
+			f_chunk.Samples += info.Samples;
+			f_chunk.Bitrates.push_back(f_chunk.Bitrates.back() + info.Bitrate);
+			if(f_chunk.SideInfo)
+				f_chunk.SideInfo->push(f_data + offset);
+			offset += info.FrameSize;
+		}
+		f_chunk.End = offset;
+	}
+
+private:
+	std::vector<Chunk>	m_chunks;
+	// The current chunk
+	size_t				m_chunk;
+};
+const size_t CChunkIndex::ChunkSizeMin;
+
+
+CStream::CStream(const uchar* f_data, size_t f_size, const MPEG::Options& f_options):
+	m_options(f_options),
+	m_infoAdded(false),
+	m_quick(false),
+	m_quickFrames(0),
+	m_quickSize(0),
+	m_frames(CFrameIndex::create(f_options, 0)),
+	m_bitrateDirty(false),
+	m_data(nullptr),
+	m_size(0),
 	m_warnings(0)
 {
-	size_t offset = 0;
+	initInfoFrame(f_data, f_size);
 
-	// Handle Xing-header frame
-	if(auto size = CXingFrame::getSize(f_data, f_size))
+	bool quick = f_options.Quick &&
+				 ((m_xing && m_xing->getHeader().hasSeekInfo()) || (m_vbri && m_vbri->getHeader().hasSeekInfo()));
+	m_size = quick ? initQuick(f_size) : index(f_data, f_size);
+
+	if(f_options.Borrow)
+		m_data = f_data;
+	else
 	{
-		m_xing = std::make_unique<CXingFrame>(f_data, size);
-		offset += size;
+		// Copy all frame data
+		m_buffer.assign(f_data, f_data + m_size);
+		m_data = &m_buffer[0];
+		m_frames->attach(m_data, m_size);
 	}
+}
+
+
+CStream::CStream(const uchar* f_data, size_t f_size, const MPEG::Options& f_options,
+				 std::unique_ptr<CFrameIndex> f_frames):
+	m_samples(0),
+	m_options(f_options),
+	m_infoAdded(false),
+	m_quick(false),
+	m_quickFrames(0),
+	m_quickSize(0),
+	m_frames(std::move(f_frames)),
+	m_bitrateDirty(false),
+	m_data(f_data),
+	m_size(f_size),
+	m_warnings(0)
+{
+	ASSERT(f_options.Borrow);
+	initInfoFrame(f_data, f_size);
+}
+
+
+void CStream::initInfoFrame(const uchar* f_data, size_t f_size)
+{
+	// Handle Xing/VBRI-header frame
+	if(auto size = CXingFrame::getSize(f_data, f_size))
+		m_xing = std::make_unique<CXingFrame>(f_data, size);
+	else if(auto size = CVbriFrame::getSize(f_data, f_size))
+		m_vbri = std::make_unique<CVbriFrame>(f_data, size);
+}
+
+
+size_t CStream::index(const uchar* f_data, size_t f_size)
+{
+	m_quick = false;
+
+	size_t offset = getInfoFrameSize();
 	CHeader first(*reinterpret_cast<const uint*>(f_data + offset));
 
 	offset = init(f_data, offset, f_size, true);
@@ -31,33 +205,153 @@ CStream::CStream(const uchar* f_data, size_t f_size):
 			WARNING("XING: MPEG info differs from the rest of the stream");
 		if((h.isVBR() && !m_vbr) || (!h.isVBR() && m_vbr))
 			WARNING("XING: VBR status mismatch (expected " << h.isVBR() << ", actual " << m_vbr << ')');
-		if(h.getFrameCount() != m_frames.size())
-			WARNING("XING: frame count mismatch (expected " << h.getFrameCount() << ", actual " << m_frames.size() << ')');
+		if(h.getFrameCount() != getFrameCount())
+			WARNING("XING: frame count mismatch (expected " << h.getFrameCount() << ", actual " << getFrameCount() << ')');
 		if(h.getByteCount() != offset)
 			WARNING("XING: stream size mismatch (expected " << h.getByteCount() << ", actual " << offset << ')');
 	}
+	// Basic VBRI validation
+	if(m_vbri)
+	{
+		auto& h = m_vbri->getHeader();
+
+		if(h != first)
+			WARNING("VBRI: MPEG info differs from the rest of the stream");
+		if(h.getFrameCount() != getFrameCount())
+			WARNING("VBRI: frame count mismatch (expected " << h.getFrameCount() << ", actual " << getFrameCount() << ')');
+		if(h.getByteCount() != offset)
+			WARNING("VBRI: stream size mismatch (expected " << h.getByteCount() << ", actual " << offset << ')');
+	}
+
+	return offset;
+}
+
+
+size_t CStream::initQuick(size_t f_size)
+{
+	const CHeader& h = m_xing ? static_cast<const CHeader&>(m_xing->getHeader()) : m_vbri->getHeader();
+	auto bytes = m_xing ? m_xing->getHeader().getByteCount() : m_vbri->getHeader().getByteCount();
+	m_quickFrames = m_xing ? m_xing->getHeader().getFrameCount() : m_vbri->getHeader().getFrameCount();
+	m_quick = true;
+
+	m_version		= h.getVersion();
+	m_layer			= h.getLayer();
+	m_sampling_rate	= h.getSamplingRate();
+	m_channel_mode	= h.getChannelMode();
+	m_emphasis		= h.getEmphasis();
+
+	// VBRI is written by VBR encoders only
+	m_vbr = m_xing ? m_xing->getHeader().isVBR() : true;
+	m_samples = static_cast<uint64_t>(h.getFrameSamples()) * m_quickFrames;
+	m_abr = static_cast<uint>(bytes * 8 / getLength() / 1000);
+
+	// The header may be stale: it is trusted for the figures reported before indexing only
+	m_quickSize = std::min<size_t>(bytes, f_size);
+	return f_size;
+}
+
+
+size_t CStream::getSeekOffset(float f_time) const
+{
+	if(!m_quick)
+		return getFrameOffset(getFrameNumber(f_time));
+	auto length = getLength();
+	if(f_time >= length)
+		return m_quickSize;
+
+	size_t offset;
+	if(m_xing)
+	{
+		// Interpolate between the TOC entries
+		auto toc = m_xing->getTOC();
+		auto percent = std::max(f_time, 0.0f) * 100.0f / length;
+		auto i = std::min(static_cast<uint>(percent), 99u);
+		float a = toc[i];
+		float b = (i < 99) ? toc[i + 1] : 256.0f;
+		offset = static_cast<size_t>((a + (b - a) * (percent - i)) / 256.0f * m_xing->getHeader().getByteCount());
+	}
+	else
+	{
+		auto frame = static_cast<uint>(std::max(f_time, 0.0f) / length * m_quickFrames);
+		offset = m_vbri->getHeader().getSeekOffset(frame);
+	}
 
-	// Copy all frame data
-	m_data.resize(offset);
-	memcpy(&m_data[0], f_data, offset);
+	// Resync to a real frame
+	offset = std::max(offset, getInfoFrameSize());
+	if(offset >= m_quickSize)
+		return m_quickSize;
+	return offset + calcFirstHeaderOffset(m_data + offset, m_size - offset);
 }
 
 
 size_t CStream::init(const uchar* f_data, size_t f_offset, size_t f_size, bool f_bFirstInit)
 {
-	m_length = 0.0f;
+	ASSERT(f_offset + CHeader::getSize() <= f_size);
+	CHeader first(*reinterpret_cast<const uint*>(f_data + f_offset));
+
+	size_t offset;
+	m_stats.reset();
+	m_sideInfo.reset();
+	// A Xing (not Info) or VBRI frame means a VBR stream, so there is no point in trying
+	// The corrupt regions are found by the full scan only
+	bool cbr = m_options.ImplicitCBR && !m_options.Recover && !m_vbri && !(m_xing && m_xing->getHeader().isVBR());
+	if(auto index = cbr ? CCbrIndex::detect(f_data, f_offset, f_size) : nullptr)
+	{
+		m_samples = index->getSampleCount();
+		m_abr = first.getBitrate() / 1000;
+		m_vbr = false;
+		offset = index->getEnd();
+		m_frames = std::move(index);
+		// There is no scan to decode the side information in
+		if(m_options.SideInfo && first.getLayer() == 3)
+			buildSideInfo(f_data);
+	}
+	else
+	{
+		m_frames = CFrameIndex::create(m_options, first.getSamplingRate());
+		m_frames->attach(f_data, f_size);
+		offset = scan(f_data, f_offset, f_size, f_bFirstInit, first);
+	}
+
+	// The assert is not really needed, because the assert in scan() is actually the same
+	ASSERT(!first.isFreeBitrate());
+	// Get values here, where the first non-free-bitrate frame is guaranteed to be found
+	m_version		= first.getVersion();
+	m_layer			= first.getLayer();
+	m_sampling_rate	= first.getSamplingRate();
+	m_channel_mode	= first.getChannelMode();
+	m_emphasis		= first.getEmphasis();
+	//m_bCRC			= first.isProtected();
+	//m_copyrighted	= first.isCopyrighted();
+	//m_original		= first.isOriginal();
+
+	m_pieces.reset(m_frames.get(), offset, m_samples);
+	m_bitrateDirty = false;
+
+	return offset;
+}
+
+
+size_t CStream::scan(const uchar* f_data, size_t f_offset, size_t f_size, bool f_bFirstInit, CHeader& f_first)
+{
+	m_samples = 0;
 	m_abr = 0;
 	m_vbr = false;
-	m_frames.clear();
+	m_gaps.clear();
+	if(m_options.RangeStats)
+		m_stats = std::make_unique<CFrameStats>();
+	if(m_options.SideInfo && f_first.getLayer() == 3)
+		m_sideInfo = std::make_unique<CSideInfoIndex>(f_first);
 
 	auto offset = f_offset;
-
-	ASSERT(offset + CHeader::getSize() <= f_size);
-	CHeader first(*reinterpret_cast<const uint*>(f_data + offset));
+	auto& first = f_first;
 
 	// Parse MPEG frames
-	auto firstFrameBitrate = first.getBitrate();
+	auto firstFrameBitrate = first.getBitrate() / 1000;
 	uint nFreeBitrateFrames = 0;
+	// The free-format frame size (in slots) established by the previous frames
+	uint freeSlots = 0;
+	CChunkIndex chunks(f_data, f_offset, f_size, first, m_sideInfo != nullptr, m_options.Threads);
 
 	for(size_t next; offset != f_size/*condition for ideal pure stream*/; offset += next)
 	{
@@ -67,16 +361,49 @@ size_t CStream::init(const uchar* f_data, size_t f_offset, size_t f_size, bool f
 			WARNING("unexpected end of MPEG stream @ relative offset " << offset << " (0x" << OUT_HEX(offset) << ')');
 			break;
 		}
+		uint frame;
+		if(auto chunk = chunks.find(offset, frame))
+		{
+			// The rest of the chunk at once
+			auto& frames = chunk->Frames;
+			auto count = static_cast<uint>(frames.size()) - frame;
+			auto samples = chunk->Samples - frames[frame].Sample;
+			m_frames->append(&frames[frame], count, m_samples - frames[frame].Sample,
+							 static_cast<uint>(chunk->Samples - frames.back().Sample));
+			m_samples += samples;
+			if(m_stats)
+			{
+				for(auto i = frame; i < frames.size(); ++i)
+					m_stats->push(frames[i].Size);
+			}
+			if(m_sideInfo)
+				m_sideInfo->append(*chunk->SideInfo, frame);
+			m_abr += chunk->Bitrates.back() - chunk->Bitrates[frame];
+			if(!m_vbr && (chunk->LastChange > frame || chunk->getBitrate(frame) != firstFrameBitrate))
+				m_vbr = true;
+
+			next = chunk->End - offset;
+			continue;
+		}
+
 		auto rawHeader = *reinterpret_cast<const uint*>(f_data + offset);
-		if(!CHeader::isValid(rawHeader))
+		// All the per-frame values come from the precomputed table
+		auto& info = CDecodeTable::get(rawHeader);
+		if(!CDecodeTable::isValid(rawHeader))
+		{
+			if(m_options.Recover && (next = skip(f_data, offset, f_size, first, MPEG::GapReason::Corrupt)))
+				continue;
 			break;
+		}
 
 		CHeader h(rawHeader);
-		if(h.isFreeBitrate())
+		if(!info.FrameSize)
 		{
-			next = h.calcFrameSize(f_data + offset, f_size - offset);
+			next = h.calcFrameSize(f_data + offset, f_size - offset, freeSlots);
 			if(!next)
 			{
+				if(m_options.Recover && (next = skip(f_data, offset, f_size, first, MPEG::GapReason::FreeBitrate)))
+					continue;
 				ASSERT(f_bFirstInit);
 				WARNING("failed to calculate a size of a free-bitrate frame @ relative offset " << offset << " (0x" << OUT_HEX(offset) << ')');
 				break;
@@ -88,11 +415,19 @@ size_t CStream::init(const uchar* f_data, size_t f_offset, size_t f_size, bool f
 			if(first.isFreeBitrate())
 			{
 				first = CHeader(rawHeader);
-				firstFrameBitrate = first.getBitrate();
+				firstFrameBitrate = info.Bitrate;
 			}
+			next = info.FrameSize;
 			// Check for non-free-bitrate frames only
-			ASSERT_MSG(h == first, "(frame #" + std::to_string(m_frames.size()) + ')');
-			next = h.getFrameSize();
+			if(m_options.Recover && h != first)
+			{
+				// The whole frame is skipped
+				if(offset + next > f_size)
+					break;
+				addGap(offset, next, MPEG::GapReason::FormatChange);
+				continue;
+			}
+			ASSERT_MSG(h == first, "(frame #" + std::to_string(m_frames->getCount()) + ')');
 		}
 
 		if(offset + next > f_size)
@@ -101,42 +436,181 @@ size_t CStream::init(const uchar* f_data, size_t f_offset, size_t f_size, bool f
 			WARNING("unexpected end of MPEG frame @ relative offset " << offset << " (0x" << OUT_HEX(offset) << ')');
 			break;
 		}
-		m_frames.push_back( FrameInfo(offset, next, m_length, h.getFrameDataOffset()) );
-
-		m_length += h.getFrameLength();
-		if(!h.isFreeBitrate())
+		m_frames->push(FrameInfo(offset, next, m_samples, CHeader::getSize() + info.SideInfoSize), info.Samples);
+
+		m_samples += info.Samples;
+		if(m_stats)
+			m_stats->push(static_cast<uint>(next));
+		if(m_sideInfo)
+			m_sideInfo->push(f_data + offset);
+		if(info.Bitrate)
 		{
-			auto bitrate = h.getBitrate();
-			m_abr += bitrate / 1000;
-			if(!m_vbr && bitrate != firstFrameBitrate)
+			m_abr += info.Bitrate;
+			if(!m_vbr && info.Bitrate != firstFrameBitrate)
 				m_vbr = true;
 		}
 	}
-	ASSERT(m_frames.size() != nFreeBitrateFrames);
-	m_abr /= (m_frames.size() - nFreeBitrateFrames);
-
-	// The assert is not really needed, because the assert above is actually the same
-	ASSERT(!first.isFreeBitrate());
-	// Get values here, where the first non-free-bitrate frame is guaranteed to be found
-	m_version		= first.getVersion();
-	m_layer			= first.getLayer();
-	m_sampling_rate	= first.getSamplingRate();
-	m_channel_mode	= first.getChannelMode();
-	m_emphasis		= first.getEmphasis();
-	//m_bCRC			= first.isProtected();
-	//m_copyrighted	= first.isCopyrighted();
-	//m_original		= first.isOriginal();
+	if(m_stats)
+		m_stats->build();
+	ASSERT(m_frames->getCount() != nFreeBitrateFrames);
+	m_abr /= (m_frames->getCount() - nFreeBitrateFrames);
 
 	if(nFreeBitrateFrames && f_bFirstInit)
 		WARNING(nFreeBitrateFrames << " free-bitrate frame" << ((nFreeBitrateFrames > 1) ? "s" : "") << " found");
+	if(!m_gaps.empty() && f_bFirstInit)
+		WARNING(m_gaps.size() << " corrupt region" << ((m_gaps.size() > 1) ? "s" : "") << " skipped");
 
 	return offset;
 }
 
 
+size_t CStream::skip(const uchar* f_data, size_t f_offset, size_t f_size, const CHeader& f_first, MPEG::GapReason f_reason)
+{
+	// The sync words are searched by CSync::find, a candidate must start a frame sequence of the stream format
+	auto end = std::min(f_size, f_offset + m_options.RecoverLimit);
+	for(auto o = f_offset + 1; o + CHeader::getSize() <= end; ++o)
+	{
+		o += CSync::find(f_data + o, end - o);
+		if(o + CHeader::getSize() > end)
+			break;
+
+		CHeader h(*reinterpret_cast<const uint*>(f_data + o));
+		if((h == f_first) && verifyFrameSequence(f_data + o, f_size - o))
+		{
+			addGap(f_offset, o - f_offset, f_reason);
+			return o - f_offset;
+		}
+	}
+	return 0;
+}
+
+
+void CStream::addGap(size_t f_offset, size_t f_size, MPEG::GapReason f_reason)
+{
+	// Adjacent regions of the same kind are merged
+	if(!m_gaps.empty())
+	{
+		auto& last = m_gaps.back();
+		if(last.Reason == f_reason && last.Offset + last.Size == f_offset)
+		{
+			last.Size += f_size;
+			return;
+		}
+	}
+	m_gaps.push_back({f_offset, f_size, f_reason});
+}
+
+
+uint64_t CStream::toSample(float f_time) const
+{
+	// The nearest sample: the frame times converted to float and back stay at their frames
+	return static_cast<uint64_t>(std::max(static_cast<double>(f_time), 0.0) * m_sampling_rate + 0.5);
+}
+
+
+uint64_t CStream::getDuration(unsigned f_frame, unsigned f_count) const
+{
+	auto end = getRangeEnd(f_frame, f_count);
+	return (f_frame < end) ? (getFrameSample(end) - getFrameSample(f_frame)) : 0;
+}
+
+
+float CStream::getAverageBitrate(unsigned f_frame, unsigned f_count) const
+{
+	ensureStats();
+	auto end = getRangeEnd(f_frame, f_count);
+	if(f_frame >= end)
+		return 0.0f;
+
+	uint64_t bytes = 0;
+	m_pieces.forIndexed(f_frame, end - f_frame,
+						[&](uint f_first, uint f_last) { bytes += m_stats->getBytes(f_first, f_last); });
+	return static_cast<float>(static_cast<double>(bytes) * 8 * m_sampling_rate / getDuration(f_frame, end - f_frame) / 1000);
+}
+
+
+float CStream::getMaxBitrate(unsigned f_frame, unsigned f_count) const
+{
+	ensureStats();
+	auto end = getRangeEnd(f_frame, f_count);
+	if(f_frame >= end)
+		return 0.0f;
+
+	uint size = 0;
+	m_pieces.forIndexed(f_frame, end - f_frame,
+						[&](uint f_first, uint f_last) { size = std::max(size, m_stats->getMaxSize(f_first, f_last)); });
+	// All the frames have the same number of samples
+	return static_cast<float>(static_cast<double>(size) * 8 * m_sampling_rate / getDuration(f_frame, 1) / 1000);
+}
+
+
+bool CStream::getSideInfo(unsigned f_index, MPEG::SideInfo& f_info) const
+{
+	ensureIndex();
+	if(m_layer != 3 || f_index >= getFrameCount())
+		return false;
+	ensureSideInfo();
+	m_sideInfo->get(m_pieces.getIndexed(f_index), f_info);
+	return true;
+}
+
+
+void CStream::buildSideInfo(const uchar* f_data)
+{
+	auto first = m_frames->get(0);
+	m_sideInfo = std::make_unique<CSideInfoIndex>(CHeader(*reinterpret_cast<const uint*>(f_data + first.Offset)));
+	for(uint i = 0, count = m_frames->getCount(); i < count; ++i)
+		m_sideInfo->push(f_data + m_frames->get(i).Offset);
+}
+
+
+void CStream::buildStats()
+{
+	m_stats = std::make_unique<CFrameStats>();
+	for(uint i = 0, count = m_frames->getCount(); i < count; ++i)
+		m_stats->push(m_frames->get(i).Size);
+	m_stats->build();
+}
+
+
+unsigned CStream::getFrameNumber(float f_time) const
+{
+	ensureIndex();
+	auto sample = toSample(f_time);
+	if(sample >= getSampleCount())
+		return getFrameCount();
+	// The frame before the first one starting after the sample
+	auto next = m_pieces.findNext(sample, 0);
+	return next ? (next - 1) : 0;
+}
+
+
+void CStream::getFrameNumbers(const std::vector<float>& f_times, std::vector<unsigned>& f_frames) const
+{
+	ensureIndex();
+	f_frames.resize(f_times.size());
+
+	uint next = 0;
+	for(size_t i = 0; i < f_times.size(); ++i)
+	{
+		ASSERT(!i || f_times[i - 1] <= f_times[i]);
+		auto sample = toSample(f_times[i]);
+		if(sample >= getSampleCount())
+		{
+			std::fill(f_frames.begin() + i, f_frames.end(), getFrameCount());
+			break;
+		}
+		// Continue from the previous result
+		next = m_pieces.findNext(sample, next);
+		f_frames[i] = next ? (next - 1) : 0;
+	}
+}
+
+
 unsigned CStream::cut(unsigned f_frame, unsigned f_count)
 {
-	auto nFramesPrev = m_frames.size();
+	ensureIndex();
+	auto nFramesPrev = getFrameCount();
 	if(f_frame >= nFramesPrev)
 	{
 		std::ostringstream oss;
@@ -150,72 +624,276 @@ unsigned CStream::cut(unsigned f_frame, unsigned f_count)
 	if(!count)
 		return 0;
 
-		auto it = m_frames.cbegin();
-	auto offsetFirst = it->Offset;
-		it += f_frame;
-	auto offsetBegin = it->Offset;
-		it += count - 1;
-	auto offsetEnd = it->Offset + it->Size;
+	// The data stays intact: the bytes are gathered by serialize()
+	m_pieces.cut(f_frame, count);
+	m_bitrateDirty = true;
+
+	return count;
+}
 
-	m_data.erase(m_data.cbegin() + offsetBegin, m_data.cbegin() + offsetEnd);
 
-	init(&m_data[0], offsetFirst, m_data.size(), false);
-	if(m_xing)
+unsigned CStream::truncate(unsigned f_frames)
+{
+	ensureIndex();
+	auto n = std::min(f_frames, getFrameCount());
+	if(!n)
+		return 0;
+
+	m_pieces.cut(getFrameCount() - n, n);
+	m_bitrateDirty = true;
+
+	return n;
+}
+
+
+unsigned CStream::edit(const std::vector<MPEG::EditRange>& f_ranges, std::vector<unsigned>& f_removed)
+{
+	ensureIndex();
+	auto n = getFrameCount();
+
+	// Validate everything before changing anything
+	f_removed.assign(f_ranges.size(), 0);
+	std::vector<CPieceTable::Range> cuts;
+	unsigned total = 0;
+	for(size_t i = 0; i < f_ranges.size(); ++i)
 	{
-		ASSERT(!"Not implemented: cut with XING");
+		auto& range = f_ranges[i];
+		if(i && static_cast<uint64_t>(f_ranges[i - 1].Frame) + f_ranges[i - 1].Count > range.Frame)
+		{
+			std::ostringstream oss;
+			oss << "the edit range #" << i << " (frame #" << range.Frame << ") overlaps the previous one or is out of order";
+			throw std::invalid_argument(oss.str());
+		}
+		if(!range.Count)
+			continue;
+		if(range.Frame >= n)
+		{
+			std::ostringstream oss;
+			oss << "the edit range #" << i << " starts at frame #" << range.Frame << " past the total number of frames (" << n << ')';
+			throw std::out_of_range(oss.str());
+		}
+		if(!range.Drop)
+			continue;
+
+		auto count = std::min(range.Count, n - range.Frame);
+		cuts.push_back({range.Frame, count});
+		f_removed[i] = count;
+		total += count;
 	}
-	else
-		ASSERT(offsetFirst == 0);
 
-	return nFramesPrev - m_frames.size();
+	if(!cuts.empty())
+	{
+		m_pieces.cut(cuts);
+		m_bitrateDirty = true;
+	}
+	return total;
 }
 
 
-unsigned CStream::truncate(unsigned f_frames)
+void CStream::updateBitrate()
 {
-	ASSERT(!m_xing);
-	if(!f_frames)
-		return 0;
+	uint64_t sum = 0;
+	uint frames = 0;
+	uint first = 0;
+	m_vbr = false;
+
+	// The same as in scan() for the frames left. The headers are read at the indexed offsets:
+	// a piece may span a region skipped by the recovery
+	for(auto& piece : m_pieces.getPieces())
+	{
+		for(auto i = piece.First; i != piece.Last; ++i)
+		{
+			auto& info = CDecodeTable::get(*reinterpret_cast<const uint*>(m_data + m_frames->get(i).Offset));
+			if(!info.Bitrate)
+				continue;
 
-	auto n = m_frames.size();
-	auto nFramesNew = (f_frames <= n) ? (n - f_frames) : 0;
+			if(!first)
+				first = info.Bitrate;
+			else if(info.Bitrate != first)
+				m_vbr = true;
+			sum += info.Bitrate;
+			++frames;
+		}
+	}
+	m_abr = frames ? static_cast<uint>(sum / frames) : 0;
+	m_bitrateDirty = false;
+}
 
-	m_data.resize( getFrameOffset(nFramesNew) );
-	// n - number of deleted frames
-	n -= nFramesNew;
-	for(auto i = n; i; --i)
-		m_frames.pop_back();
 
-	return n;
+bool CStream::addInfoFrame()
+{
+	ensureIndex();
+	if(!getFrameCount())
+		return false;
+
+	auto rawHeader = *reinterpret_cast<const uint*>(m_data + m_pieces.getPieces().front().IndexBegin);
+	auto xing = CXingFrame::create(rawHeader, isVBR());
+	if(!xing)
+		return false;
+
+	// The frames follow the new frame in the serialized stream
+	m_pieces.setBegin(xing->getFrameSize());
+	m_xing = std::move(xing);
+	m_vbri.reset();
+	m_infoAdded = true;
+	return true;
 }
 
 
-void CStream::serialize(std::vector<unsigned char>& f_outStream)
+void CStream::updateInfoFrame()
 {
-	ASSERT(!"Not implemented"); (void)f_outStream;
+	auto& h = m_xing->getHeader();
+	h.setFrameCount(getFrameCount());
+	h.setByteCount(static_cast<uint>(getSize()));
+	if(!h.hasTOC())
+		return;
+
+	// The offset at every percent of the length relative to the size
+	std::vector<float> times(100);
+	for(uint i = 0; i < times.size(); ++i)
+		times[i] = getLength() * i / 100.0f;
+	std::vector<unsigned> frames;
+	getFrameNumbers(times, frames);
+
+	uchar toc[100];
+	for(uint i = 0; i < times.size(); ++i)
+		toc[i] = static_cast<uchar>(std::min<uint64_t>(255, static_cast<uint64_t>(getFrameOffset(frames[i])) * 256 / getSize()));
+	m_xing->setTOC(toc);
 }
 
 
-/*const CHeader* CStream::getFrameHeader() const
+uint CStream::getPreroll(uint f_frame) const
 {
-	if(f_index >= m_frames.size())
-		return NULL;
-	m_frames[f_index].Time : 0.0f;
-	return CHeader::gen( *(const uint*)(m_data + getFrameOffset(f_index)) );
+	auto frame = getIndexedFrame(f_frame);
+	// The decoded column if there is one
+	auto need = m_sideInfo ? m_sideInfo->getMainDataBegin(m_pieces.getIndexed(f_frame))
+						   : CHeader(*reinterpret_cast<const uint*>(m_data + frame.Offset)).getMainDataBegin(m_data + frame.Offset);
+
+	// The main data of the previous frames follows their side information
+	uint preroll = 0;
+	for(; need && preroll < f_frame; ++preroll)
+	{
+		auto prev = getIndexedFrame(f_frame - preroll - 1);
+		CHeader h(*reinterpret_cast<const uint*>(m_data + prev.Offset));
+		auto dataOffset = prev.DataRelOffset + (h.isProtected() ? 2 : 0);
+		need -= std::min(need, prev.Size - std::min(prev.Size, dataOffset));
+	}
+	return preroll;
 }
-*/
 
-/*uint CStream::getFrameNumber(float f_time) const
+
+void CStream::segment(const MPEG::SegmentOptions& f_options, std::vector<MPEG::Segment>& f_segments) const
 {
-	uint i, n = getFrameCount();
+	if(!(f_options.Duration > 0.0f))
+		throw std::invalid_argument("non-positive segment duration");
+	ensureIndex();
+	f_segments.clear();
+	auto count = getFrameCount();
+	if(!count)
+		return;
 
-	for(i = 0; i < n; i++)
+	// The first frames starting at the multiples of the duration, moved to the frames not using the reservoir
+	auto step = std::max<uint64_t>(toSample(f_options.Duration), 1);
+	auto reservoir = (m_layer == 3);
+	std::vector<uint> boundaries(1, 0);
+	for(auto target = step; target < getSampleCount(); )
 	{
-		if(m_frames[i].length >= f_time)
+		auto frame = m_pieces.findNext(target - 1, boundaries.back());
+		if(frame == count)
 			break;
+		auto end = std::min(count, frame + f_options.ReservoirSearch + 1);
+		for(auto i = frame; reservoir && i < end; ++i)
+		{
+			if(!getPreroll(i))
+			{
+				frame = i;
+				break;
+			}
+		}
+		boundaries.push_back(frame);
+		// The next multiple after the boundary (the search may pass a few)
+		target = (getFrameSample(frame) / step + 1) * step;
 	}
+	boundaries.push_back(count);
 
-	return i;
+	f_segments.resize(boundaries.size() - 1);
+	for(size_t i = 0; i < f_segments.size(); ++i)
+	{
+		auto first = boundaries[i];
+		auto last = boundaries[i + 1];
+		auto& segment = f_segments[i];
+		segment.Frame	= first;
+		segment.Count	= last - first;
+		segment.Sample	= getFrameSample(first);
+		segment.Samples	= getFrameSample(last) - segment.Sample;
+		segment.Preroll	= reservoir ? getPreroll(first) : 0;
+
+		auto from = f_options.Preroll ? (first - segment.Preroll) : first;
+		segment.Ranges.clear();
+		m_pieces.forIndexedBytes(from, last - from, [&](size_t f_begin, size_t f_end)
+		{
+			segment.Ranges.push_back({const_cast<uchar*>(m_data + f_begin), f_end - f_begin});
+		});
+	}
 }
-*/
 
+
+void CStream::serialize(std::vector<unsigned char>& f_outStream)
+{
+	std::vector<iovec> ranges;
+	serialize(ranges);
+
+	f_outStream.reserve(f_outStream.size() + getSize());
+	for(auto& range : ranges)
+	{
+		auto p = static_cast<const uchar*>(range.iov_base);
+		f_outStream.insert(f_outStream.end(), p, p + range.iov_len);
+	}
+}
+
+
+void CStream::serialize(std::vector<iovec>& f_ranges)
+{
+	ensureIndex();
+	f_ranges.clear();
+	f_ranges.reserve(m_pieces.getPieces().size() + 1);
+
+	// An unedited stream is written as is: the Xing / VBRI frame is updated after edits or addInfoFrame() only
+	auto update = m_infoAdded || m_pieces.isEdited();
+
+	// The VBRI seek table has a fixed entry count and scale: an edited stream gets a new Xing frame instead
+	if(update && m_vbri && (m_vbri->getHeader().getFrameCount() != getFrameCount() || m_vbri->getHeader().getByteCount() != getSize()) &&
+	   !addInfoFrame())
+	{
+		m_pieces.setBegin(0);
+		m_vbri.reset();
+	}
+
+	auto add = [&f_ranges](const uchar* f_data, size_t f_size)
+	{
+		if(f_size)
+			f_ranges.push_back({const_cast<uchar*>(f_data), f_size});
+	};
+
+	// The only bytes not taken from the data as is
+	if(m_xing && update)
+	{
+		updateInfoFrame();
+		add(m_xing->getData(), m_xing->getFrameSize());
+	}
+	else
+		add(m_data, getInfoFrameSize());
+
+	for(auto& piece : m_pieces.getPieces())
+		add(m_data + piece.IndexBegin, piece.getSize());
+}
+
+
+/*const CHeader* CStream::getFrameHeader() const
+{
+	if(f_index >= m_frames.size())
+		return NULL;
+	m_frames[f_index].Time : 0.0f;
+	return CHeader::gen( *(const uint*)(m_data + getFrameOffset(f_index)) );
+}
+*/
@@ -3,72 +3,178 @@
 #include "common.h"
 #include "mpeg.h"
 #include "header.h"
+#include "index.h"
+#include "pieces.h"
+#include "stats.h"
+#include "sideinfo.h"
 
 #include <vector>
 
 
 class CStream final : public MPEG::IStream
 {
+	// Restores streams from sidecar files
+	friend class CSidecar;
+
 public:
-						CStream			(const uchar* f_data, size_t f_size);
+						CStream			(const uchar* f_data, size_t f_size, const MPEG::Options& f_options);
 						CStream			() = delete;
+	// Hold the owner of borrowed data (e.g. a file mapping)
+	void				keepAlive		(std::shared_ptr<const void> f_owner) { m_owner = std::move(f_owner); }
 	bool				hasIssues		() const final override { return m_warnings; }
 
-	size_t				getSize			() const final override { return m_data.size();		}
-	uint				getFrameCount	() const final override { return static_cast<uint>(m_frames.size()); }
-	float				getLength		() const final override { return m_length;			}
+	size_t				getSize			() const final override { return m_quick ? m_quickSize : m_pieces.getSize();	}
+	uint				getFrameCount	() const final override
+	{
+		return m_quick ? m_quickFrames : m_pieces.getCount();
+	}
+	float				getLength		() const final override
+	{
+		return static_cast<float>(static_cast<double>(getSampleCount()) / m_sampling_rate);
+	}
 
 	MPEG::Version		getVersion		() const final override { return m_version;			}
 	uint				getLayer		() const final override { return m_layer;			}
-	uint				getBitrate		() const final override { return m_abr;				}
-	bool				isVBR			() const final override { return m_vbr;				}
+	uint				getBitrate		() const final override { ensureBitrate(); return m_abr;	}
+	bool				isVBR			() const final override { ensureBitrate(); return m_vbr;	}
 	uint				getSamplingRate	() const final override { return m_sampling_rate;	}
 	MPEG::ChannelMode	getChannelMode	() const final override { return m_channel_mode;	}
 	MPEG::Emphasis		getEmphasis		() const final override { return m_emphasis;		}
+
+	size_t				getIndexMemoryUsage() const final override
+	{
+		return m_frames->getMemoryUsage() + (m_stats ? m_stats->getMemoryUsage() : 0) +
+			   (m_sideInfo ? m_sideInfo->getMemoryUsage() : 0);
+	}
+	const std::vector<MPEG::Gap>&	getGaps	() const final override { ensureIndex(); return m_gaps; }
 	//bool				isCopyrighted	() const final override { return m_copyrighted;		}
 	//bool				isOriginal		() const final override { return m_original;		}
 	//bool				hasCRC			() const final override { return m_bCRC;			}
 
 	size_t getFrameOffset(unsigned int f_index) const final override
 	{
-		return (f_index < m_frames.size()) ? m_frames[f_index].Offset : m_data.size();
+		ensureIndex();
+		return (f_index < getFrameCount()) ? m_pieces.get(f_index).Offset : getSize();
 	}
 	unsigned int getFrameSize(unsigned int f_index) const final override
 	{
-		return (f_index < m_frames.size()) ? m_frames[f_index].Size : 0;
+		ensureIndex();
+		return (f_index < getFrameCount()) ? m_pieces.get(f_index).Size : 0;
 	}
 	float getFrameTime(unsigned int f_index) const final override
 	{
-		return (f_index < m_frames.size()) ? m_frames[f_index].Time : 0.0f;
+		ensureIndex();
+		return (f_index < getFrameCount()) ? static_cast<float>(static_cast<double>(getFrameSample(f_index)) / m_sampling_rate) : 0.0f;
 	}
 
+	uint64_t			getSampleCount	() const final override { return m_quick ? m_samples : m_pieces.getSampleCount(); }
+	uint64_t getFrameSample(unsigned int f_index) const final override
+	{
+		ensureIndex();
+		return (f_index < getFrameCount()) ? m_pieces.get(f_index).Sample : getSampleCount();
+	}
+	uint64_t			getDuration		(unsigned f_frame, unsigned f_count) const final override;
+
+	float				getAverageBitrate(unsigned f_frame, unsigned f_count) const final override;
+	float				getMaxBitrate	(unsigned f_frame, unsigned f_count) const final override;
+
+	bool				getSideInfo		(unsigned f_index, MPEG::SideInfo& f_info) const final override;
+
+	size_t				getSeekOffset	(float f_time) const final override;
+
+	unsigned			getFrameNumber	(float f_time) const final override;
+	void				getFrameNumbers	(const std::vector<float>& f_times, std::vector<unsigned>& f_frames) const final override;
+
 	void				serialize		(std::vector<unsigned char>& f_outStream) final override;
+	void				serialize		(std::vector<iovec>& f_ranges) final override;
+
+	bool				addInfoFrame	() final override;
+
+	void				segment			(const MPEG::SegmentOptions& f_options, std::vector<MPEG::Segment>& f_segments) const final override;
 
 	// Functional
 	unsigned			cut				(unsigned f_frame, unsigned f_count) final override;
 	unsigned			truncate		(unsigned f_frames) final override;
+	unsigned			edit			(const std::vector<MPEG::EditRange>& f_ranges, std::vector<unsigned>& f_removed) final override;
 
 private:
-	size_t	init	(const uchar* f_data, size_t f_offset, size_t f_size, bool f_bFirstInit);
+	// A stream restored from a sidecar: the stream info is filled by CSidecar
+						CStream			(const uchar* f_data, size_t f_size, const MPEG::Options& f_options,
+										 std::unique_ptr<CFrameIndex> f_frames);
+
+	// Find a Xing / VBRI frame at the start of the data
+	void	initInfoFrame(const uchar* f_data, size_t f_size);
+	// Build the frame index, return the end of the stream
+	size_t	index		(const uchar* f_data, size_t f_size);
+	// Xing / VBRI frame size (0 if there is none)
+	size_t	getInfoFrameSize() const
+	{
+		return m_xing ? m_xing->getFrameSize() : (m_vbri ? m_vbri->getFrameSize() : 0);
+	}
+	// The indexed frame of an edited one (the offset is in the data)
+	FrameInfo	getIndexedFrame	(uint f_frame) const { return m_frames->get(m_pieces.getIndexed(f_frame)); }
+	// Layer III: the number of frames before the edited frame holding its bit reservoir
+	uint	getPreroll		(uint f_frame) const;
+	// Set the Xing frame counts and TOC to the current frames
+	void	updateInfoFrame	();
+	// Take the stream info from the Xing / VBRI header, return the size of the data to index later
+	size_t	initQuick	(size_t f_size);
+	// Quick mode: the frame index is built on demand
+	void	ensureIndex	() const
+	{
+		if(m_quick)
+		{
+			auto self = const_cast<CStream*>(this);
+			self->m_size = self->index(m_data, m_size);
+		}
+	}
 
-private:
-	struct FrameInfo
+	// Index the frames starting from f_offset, return the end of the stream
+	size_t	init		(const uchar* f_data, size_t f_offset, size_t f_size, bool f_bFirstInit);
+	// Parse and index all the frames (the regular path of init)
+	size_t	scan		(const uchar* f_data, size_t f_offset, size_t f_size, bool f_bFirstInit, CHeader& f_first);
+
+	// The bitrate of an edited stream is recalculated on demand
+	void	ensureBitrate	() const
+	{
+		if(m_bitrateDirty)
+			const_cast<CStream*>(this)->updateBitrate();
+	}
+	void	updateBitrate	();
+
+	// The frame size statistics are built from the frame index on the first range query (unless the scan did)
+	void	ensureStats		() const
+	{
+		ensureIndex();
+		if(!m_stats)
+			const_cast<CStream*>(this)->buildStats();
+	}
+	void	buildStats		();
+	// The same for the side information columns (layer III)
+	void	ensureSideInfo	() const
+	{
+		ensureIndex();
+		if(!m_sideInfo)
+			const_cast<CStream*>(this)->buildSideInfo(m_data);
+	}
+	void	buildSideInfo	(const uchar* f_data);
+	// The end of the f_count frames from f_frame clamped to the frame count
+	uint	getRangeEnd		(uint f_frame, uint f_count) const
 	{
-		FrameInfo(size_t f_offset, uint f_size, float f_time, uint f_dataRelOffset):
-			Offset(f_offset),
-			Size(f_size),
-			Time(f_time),
-			DataRelOffset(f_dataRelOffset)
-		{}
-
-		size_t	Offset;
-		uint	Size;
-		float	Time;
-		uint	DataRelOffset;
-	};
+		auto count = getFrameCount();
+		return (f_frame < count) ? (f_frame + std::min(f_count, count - f_frame)) : count;
+	}
 
+	// Recovery: skip the region up to the next frame sequence of the stream format (at most RecoverLimit bytes),
+	// return the size of the region (0 if there is no sequence)
+	size_t	skip		(const uchar* f_data, size_t f_offset, size_t f_size, const CHeader& f_first, MPEG::GapReason f_reason);
+	void	addGap		(size_t f_offset, size_t f_size, MPEG::GapReason f_reason);
+
+	// The sample at the time (negative times are the first sample)
+	uint64_t	toSample	(float f_time) const;
 private:
-	float						m_length;
+	// The number of samples of the stream before the edits
+	uint64_t					m_samples;
 
 	MPEG::Version				m_version;
 	uint						m_layer;
@@ -81,9 +187,33 @@ private:
 	//bool						m_original;
 	//bool						m_bCRC;
 
+	const MPEG::Options			m_options;
+
 	std::unique_ptr<CXingFrame>	m_xing;
-	std::vector<FrameInfo>		m_frames;
-	std::vector<uchar>			m_data;
+	std::unique_ptr<CVbriFrame>	m_vbri;
+	// By addInfoFrame(): serialize() fills the frame even if the stream is not edited
+	bool						m_infoAdded;
+	// The stream info is taken from m_xing / m_vbri, there is no frame index yet
+	bool						m_quick;
+	uint						m_quickFrames;
+	// The size reported by the header (the index covers all the data anyway)
+	size_t						m_quickSize;
+	// The frames of the data, m_pieces - the frames left after the edits
+	std::unique_ptr<CFrameIndex>	m_frames;
+	CPieceTable					m_pieces;
+	bool						m_bitrateDirty;
+	// The frame sizes of m_frames for the range queries (built on demand unless Options::RangeStats)
+	std::unique_ptr<CFrameStats>	m_stats;
+	// Layer III side information of m_frames (decoded on demand unless Options::SideInfo)
+	std::unique_ptr<CSideInfoIndex>	m_sideInfo;
+	// The regions skipped by the recovery
+	std::vector<MPEG::Gap>		m_gaps;
+
+	// Either borrowed from the caller or pointing to m_buffer
+	const uchar*				m_data;
+	size_t						m_size;
+	std::vector<uchar>			m_buffer;
+	std::shared_ptr<const void>	m_owner;
 
 	uint						m_warnings;
 };
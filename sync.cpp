@@ -0,0 +1,96 @@
+#include "sync.h"
+
+#include "header.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SYNC_X86
+#include <immintrin.h>
+#endif
+
+
+size_t CSync::find(const uchar* f_data, size_t f_size)
+{
+	using FindFunc = size_t (*)(const uchar*, size_t);
+	static const FindFunc s_find = hasAVX2() ? findAVX2 : (hasSSE2() ? findSSE2 : findScalar);
+	return s_find(f_data, f_size);
+}
+
+
+size_t CSync::findScalar(const uchar* f_data, size_t f_size)
+{
+	if(f_size < CHeader::getSize())
+		return f_size;
+
+	for(size_t i = 0, limit = f_size - CHeader::getSize(); i <= limit; ++i)
+	{
+		if(CHeader::isValid( *reinterpret_cast<const uint*>(f_data + i)) )
+			return i;
+	}
+
+	return f_size;
+}
+
+
+#ifdef SYNC_X86
+bool CSync::hasSSE2() { return __builtin_cpu_supports("sse2"); }
+bool CSync::hasAVX2() { return __builtin_cpu_supports("avx2"); }
+
+// Each vector iteration reads one byte ahead (the 2-nd sync byte) and
+// validates candidates with a 4-byte load, so keep (Width + 3) bytes available
+
+__attribute__((target("sse2")))
+size_t CSync::findSSE2(const uchar* f_data, size_t f_size)
+{
+	const auto ff = _mm_set1_epi8(static_cast<char>(0xFF));
+	const auto e0 = _mm_set1_epi8(static_cast<char>(0xE0));
+
+	size_t i = 0;
+	for(; i + sizeof(__m128i) + CHeader::getSize() - 1 <= f_size; i += sizeof(__m128i))
+	{
+		auto b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(f_data + i));
+		auto b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(f_data + i + 1));
+		auto m = _mm_and_si128(_mm_cmpeq_epi8(b0, ff),
+							   _mm_cmpeq_epi8(_mm_and_si128(b1, e0), e0));
+
+		for(auto mask = static_cast<uint>(_mm_movemask_epi8(m)); mask; mask &= mask - 1)
+		{
+			auto o = i + __builtin_ctz(mask);
+			if(CHeader::isValid( *reinterpret_cast<const uint*>(f_data + o)) )
+				return o;
+		}
+	}
+
+	return i + findScalar(f_data + i, f_size - i);
+}
+
+__attribute__((target("avx2")))
+size_t CSync::findAVX2(const uchar* f_data, size_t f_size)
+{
+	const auto ff = _mm256_set1_epi8(static_cast<char>(0xFF));
+	const auto e0 = _mm256_set1_epi8(static_cast<char>(0xE0));
+
+	size_t i = 0;
+	for(; i + sizeof(__m256i) + CHeader::getSize() - 1 <= f_size; i += sizeof(__m256i))
+	{
+		auto b0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(f_data + i));
+		auto b1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(f_data + i + 1));
+		auto m = _mm256_and_si256(_mm256_cmpeq_epi8(b0, ff),
+								  _mm256_cmpeq_epi8(_mm256_and_si256(b1, e0), e0));
+
+		for(auto mask = static_cast<uint>(_mm256_movemask_epi8(m)); mask; mask &= mask - 1)
+		{
+			auto o = i + __builtin_ctz(mask);
+			if(CHeader::isValid( *reinterpret_cast<const uint*>(f_data + o)) )
+				return o;
+		}
+	}
+
+	return i + findSSE2(f_data + i, f_size - i);
+}
+#else
+bool CSync::hasSSE2() { return false; }
+bool CSync::hasAVX2() { return false; }
+
+size_t CSync::findSSE2(const uchar* f_data, size_t f_size) { return findScalar(f_data, f_size); }
+size_t CSync::findAVX2(const uchar* f_data, size_t f_size) { return findScalar(f_data, f_size); }
+#endif
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+
+
+// MPEG sync word scanner
+// Candidates (0xFF followed by 0xE0-masked byte) are located 16/32 bytes at a time,
+// the full header validation is done for the candidates only
+class CSync
+{
+public:
+	// The number of consecutive frames to confirm synchronization
+	static const uint	HeadersToVerify = 3;
+
+	// Return the offset of the first valid MPEG header or f_size if there is none.
+	// The best implementation for the current CPU is picked at runtime
+	static size_t	find		(const uchar* f_data, size_t f_size);
+
+	// Particular implementations (exposed for testing)
+	static size_t	findScalar	(const uchar* f_data, size_t f_size);
+	static size_t	findSSE2	(const uchar* f_data, size_t f_size);
+	static size_t	findAVX2	(const uchar* f_data, size_t f_size);
+
+	static bool		hasSSE2		();
+	static bool		hasAVX2		();
+
+	CSync() = delete;
+};
@@ -0,0 +1,169 @@
+#include "tags.h"
+
+#include <algorithm>
+#include <cstring>
+
+
+const size_t CTags::ID3v1Size;
+const size_t CTags::ID3v2HeaderSize;
+const size_t CTags::APEHeaderSize;
+const size_t CTags::Lyrics3v1Max;
+
+
+static bool matches(const uchar* f_data, const char* f_magic)
+{
+	return !memcmp(f_data, f_magic, strlen(f_magic));
+}
+
+static uint fromLittleEndian(const uchar* f_p)
+{
+	return f_p[0] | (f_p[1] << 8) | (f_p[2] << 16) | (static_cast<uint>(f_p[3]) << 24);
+}
+
+// 7 bits per byte, the high bits must be clear
+static bool fromSynchsafe(const uchar* f_p, size_t& f_value)
+{
+	f_value = 0;
+	for(uint i = 0; i < 4; ++i)
+	{
+		if(f_p[i] & 0x80)
+			return false;
+		f_value = (f_value << 7) | f_p[i];
+	}
+	return true;
+}
+
+// "ID3" / "3DI", version, revision, flags, synchsafe size (without the header and the footer)
+static bool parseID3v2(const uchar* f_p, const char* f_magic, size_t& f_size)
+{
+	if(!matches(f_p, f_magic) || f_p[3] == 0xFF || f_p[4] == 0xFF || !fromSynchsafe(f_p + 6, f_size))
+		return false;
+	// The footer flag
+	f_size += CTags::ID3v2HeaderSize + ((f_p[5] & 0x10) ? CTags::ID3v2HeaderSize : 0);
+	return true;
+}
+
+
+size_t CTags::getID3v2Size(const uchar* f_data, size_t f_size)
+{
+	size_t size;
+	if(f_size < ID3v2HeaderSize || !parseID3v2(f_data, "ID3", size) || size > f_size)
+		return 0;
+	return size;
+}
+
+
+size_t CTags::findLeading(const uchar* f_data, size_t f_size, std::vector<MPEG::Tag>* f_tags)
+{
+	size_t offset = 0;
+	while(auto size = getID3v2Size(f_data + offset, f_size - offset))
+	{
+		if(f_tags)
+			f_tags->push_back({offset, size, MPEG::TagType::ID3v2});
+		offset += size;
+	}
+	return offset;
+}
+
+
+size_t CTags::getID3v1Size(const uchar* f_data, size_t f_begin, size_t f_end)
+{
+	return (f_end - f_begin >= ID3v1Size && matches(f_data + f_end - ID3v1Size, "TAG")) ? ID3v1Size : 0;
+}
+
+
+size_t CTags::getAPESize(const uchar* f_data, size_t f_begin, size_t f_end)
+{
+	// "APETAGEX", version, size (the items and the footer), item count, flags, reserved
+	if(f_end - f_begin < APEHeaderSize)
+		return 0;
+	auto footer = f_data + f_end - APEHeaderSize;
+	if(!matches(footer, "APETAGEX"))
+		return 0;
+
+	size_t size = fromLittleEndian(footer + 12);
+	// The header flag
+	if(fromLittleEndian(footer + 20) & 0x80000000)
+		size += APEHeaderSize;
+	return (size >= APEHeaderSize && size <= f_end - f_begin) ? size : 0;
+}
+
+
+size_t CTags::getLyrics3Size(const uchar* f_data, size_t f_begin, size_t f_end)
+{
+	static const size_t BeginSize = 11;
+	static const size_t EndSize = 9;
+	static const size_t SizeSize = 6;
+
+	auto available = f_end - f_begin;
+	if(available < BeginSize + EndSize)
+		return 0;
+	auto footer = f_data + f_end - EndSize;
+
+	// v2: "LYRICSBEGIN" ... 6 decimal digits of the size (up to the digits) "LYRICS200"
+	if(matches(footer, "LYRICS200") && available >= BeginSize + SizeSize + EndSize)
+	{
+		size_t size = 0;
+		for(auto p = footer - SizeSize; p != footer; ++p)
+		{
+			if(*p < '0' || *p > '9')
+				return 0;
+			size = size * 10 + (*p - '0');
+		}
+		size += SizeSize + EndSize;
+		return (size <= available && matches(f_data + f_end - size, "LYRICSBEGIN")) ? size : 0;
+	}
+
+	// v1: "LYRICSBEGIN" ... "LYRICSEND" (limited size)
+	if(matches(footer, "LYRICSEND"))
+	{
+		auto limit = std::min(available, Lyrics3v1Max + BeginSize + EndSize);
+		for(auto size = BeginSize + EndSize; size <= limit; ++size)
+		{
+			if(matches(f_data + f_end - size, "LYRICSBEGIN"))
+				return size;
+		}
+	}
+	return 0;
+}
+
+
+size_t CTags::getID3v2FooterSize(const uchar* f_data, size_t f_begin, size_t f_end)
+{
+	size_t size;
+	if(f_end - f_begin < 2 * ID3v2HeaderSize || !parseID3v2(f_data + f_end - ID3v2HeaderSize, "3DI", size) ||
+	   size > f_end - f_begin)
+		return 0;
+	// The header must agree
+	return (getID3v2Size(f_data + f_end - size, size) == size) ? size : 0;
+}
+
+
+size_t CTags::findTrailing(const uchar* f_data, size_t f_begin, size_t f_size, std::vector<MPEG::Tag>* f_tags)
+{
+	// The tags go from the end in any order (usually APEv2 / Lyrics3 and then ID3v1)
+	std::vector<MPEG::Tag> tags;
+	auto end = f_size;
+	for(;;)
+	{
+		MPEG::Tag tag = {0, 0, MPEG::TagType::ID3v1};
+		if((tag.Size = getID3v1Size(f_data, f_begin, end)))
+			tag.Type = MPEG::TagType::ID3v1;
+		else if((tag.Size = getAPESize(f_data, f_begin, end)))
+			tag.Type = MPEG::TagType::APEv2;
+		else if((tag.Size = getLyrics3Size(f_data, f_begin, end)))
+			tag.Type = MPEG::TagType::Lyrics3;
+		else if((tag.Size = getID3v2FooterSize(f_data, f_begin, end)))
+			tag.Type = MPEG::TagType::ID3v2;
+		else
+			break;
+
+		end -= tag.Size;
+		tag.Offset = end;
+		tags.push_back(tag);
+	}
+
+	if(f_tags)
+		f_tags->insert(f_tags->end(), tags.rbegin(), tags.rend());
+	return end;
+}
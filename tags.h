@@ -0,0 +1,39 @@
+#pragma once
+
+#include "common.h"
+#include "mpeg.h"
+
+#include <cstddef>
+#include <vector>
+
+
+// Tag containers around an MPEG stream, located by their headers / footers without scanning the tag data:
+// ID3v2 at the beginning, APEv2, Lyrics3 (v1 and v2), ID3v1 and appended ID3v2.4 at the end
+class CTags
+{
+public:
+	static const size_t	ID3v1Size		= 128;
+	// ID3v2 header / footer, APEv2 header / footer
+	static const size_t	ID3v2HeaderSize	= 10;
+	static const size_t	APEHeaderSize	= 32;
+	// Lyrics3 v1 has no size field: "LYRICSBEGIN" is searched at most that far from "LYRICSEND"
+	static const size_t	Lyrics3v1Max	= 5100;
+
+	// Return the end of the consecutive ID3v2 tags at the beginning of the data (0 if there are none).
+	// The tags are appended to f_tags (if any)
+	static size_t		findLeading		(const uchar* f_data, size_t f_size, std::vector<MPEG::Tag>* f_tags);
+	// Return the beginning of the tags at the end of the data, not before f_begin (f_size if there are none).
+	// The tags are appended to f_tags (if any) in the order of their offsets
+	static size_t		findTrailing	(const uchar* f_data, size_t f_begin, size_t f_size, std::vector<MPEG::Tag>* f_tags);
+
+	CTags() = delete;
+
+private:
+	// The size of a tag ending at f_end (0 if there is none)
+	static size_t		getID3v1Size	(const uchar* f_data, size_t f_begin, size_t f_end);
+	static size_t		getAPESize		(const uchar* f_data, size_t f_begin, size_t f_end);
+	static size_t		getLyrics3Size	(const uchar* f_data, size_t f_begin, size_t f_end);
+	static size_t		getID3v2FooterSize(const uchar* f_data, size_t f_begin, size_t f_end);
+	// The size of an ID3v2 tag starting at the beginning of the data (0 if there is none)
+	static size_t		getID3v2Size	(const uchar* f_data, size_t f_size);
+};
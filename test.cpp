@@ -1,13 +1,30 @@
 #include "common.h"
 
+#include "decode.h"
 #include "header.h"
+#include "index.h"
 #include "mpeg.h"
+#include "sync.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <system_error>
+#include <thread>
 #include <vector>
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
 
 #define LOG(msg)	std::cout << msg << std::endl
 #define ERROR(msg)	do { std::cerr << "ERROR @ " << __FILE__ << ":" << __LINE__ << ": " << msg << std::endl; } while(0)
+#define CHECK(X, msg)	do { if(!(X)) { ERROR(#X << ": " << msg); ++s_failures; } } while(0)
+
+
+static uint s_failures = 0;
 
 
 void test_header(uint f_val)
@@ -42,56 +59,1784 @@ void test_header(uint f_val)
 
 void test_file(const char* f_path)
 {
-	FILE* f;
+	try
+	{
+		auto file = MPEG::IStream::open(f_path);
+		if(!file.Stream)
+		{
+			ERROR("Failed to init MPEG stream");
+			return;
+		}
+		auto& mpeg = file.Stream;
 
-	f = fopen(f_path, "rb");
-	if(!f)
+		auto uDataOffset = mpeg->getFrameOffset(0);
+		auto uSize = mpeg->getSize();
+		LOG(f_path << std::endl << "===");
+		LOG("Offset : " << (file.Offset + uDataOffset) << (uDataOffset ? "*" : ""));
+		LOG("Next   : " << (file.Offset + uSize));
+		LOG("Tail   : " << file.Trailing);
+		LOG("Frames : " << mpeg->getFrameCount());
+		LOG("Length : " << mpeg->getLength());
+		LOG("MPEG " << MPEG::IStream::str(mpeg->getVersion()) << " Layer " << mpeg->getLayer());
+		LOG("Bitrate      : " << mpeg->getBitrate() << " kbps" << (mpeg->isVBR() ? " (VBR)" : ""));
+		LOG("Sampling Rate: " << mpeg->getSamplingRate() << " Hz");
+		LOG("Channel Mode : " << MPEG::IStream::str(mpeg->getChannelMode()));
+		LOG("Emphasis     : " << MPEG::IStream::str(mpeg->getEmphasis()));
+	}
+	catch(const std::system_error& e)
+	{
+		ERROR(e.what());
+	}
+}
+
+// Generate a stream of frames with the given header and zero payload
+static std::vector<uchar> gen_stream(uint f_header, uint f_frames)
+{
+	std::vector<uchar> buf;
+	const CHeader h(f_header);
+	for(uint i = 0; i < f_frames; ++i)
+	{
+		auto offset = buf.size();
+		buf.resize(offset + h.getFrameSize());
+		memcpy(&buf[offset], &f_header, sizeof(f_header));
+	}
+	return buf;
+}
+
+
+// Compare all the frames of two streams
+static bool same_frames(const MPEG::IStream& f_a, const MPEG::IStream& f_b)
+{
+	if(f_a.getFrameCount() != f_b.getFrameCount())
+		return false;
+	for(uint i = 0; i < f_a.getFrameCount(); ++i)
+	{
+		if(f_a.getFrameOffset(i) != f_b.getFrameOffset(i) ||
+		   f_a.getFrameSize(i) != f_b.getFrameSize(i) ||
+		   f_a.getFrameTime(i) != f_b.getFrameTime(i))
+			return false;
+	}
+	return true;
+}
+
+
+static void put_be(uchar* f_dst, uint f_value)
+{
+	f_dst[0] = static_cast<uchar>(f_value >> 24);
+	f_dst[1] = static_cast<uchar>(f_value >> 16);
+	f_dst[2] = static_cast<uchar>(f_value >> 8);
+	f_dst[3] = static_cast<uchar>(f_value);
+}
+
+// A VBR stream (MPEG 1 layer III, 44.1 kHz, joint stereo) with a Xing frame (frames, bytes, linear TOC)
+static std::vector<uchar> gen_xing_stream(uint f_frames)
+{
+	std::vector<uchar> body;
+	for(uint i = 0; i < f_frames; ++i)
+	{
+		auto frames = gen_stream((i % 3) ? 0x6CA0FBFF : 0x6C90FBFF, 1);
+		body.insert(body.end(), frames.begin(), frames.end());
+	}
+
+	auto buf = gen_stream(0x6CA0FBFF, 1);
+	auto p = &buf[4 + 32];
+	memcpy(p, "Xing", 4);
+	put_be(p + 4, 0x7);
+	put_be(p + 8, f_frames);
+	put_be(p + 12, static_cast<uint>(buf.size() + body.size()));
+	for(uint i = 0; i < 100; ++i)
+		p[16 + i] = static_cast<uchar>(i * 256 / 100);
+
+	buf.insert(buf.end(), body.begin(), body.end());
+	return buf;
+}
+
+
+// The same with a VBRI frame instead of Xing (a seek table entry per 100 frames)
+static std::vector<uchar> gen_vbri_stream(uint f_frames)
+{
+	auto xing = gen_xing_stream(f_frames);
+	auto frameSize = CHeader(0x6CA0FBFF).getFrameSize();
+
+	std::vector<uchar> buf(xing.begin(), xing.begin() + frameSize);
+	auto p = &buf[4 + 32];
+	memset(p, 0, frameSize - 36);
+	memcpy(p, "VBRI", 4);
+	p[5] = 1;
+	put_be(p + 10, static_cast<uint>(xing.size()));
+	put_be(p + 14, f_frames);
+	auto entries = f_frames / 100;
+	p[18] = static_cast<uchar>(entries >> 8);
+	p[19] = static_cast<uchar>(entries);
+	p[21] = 1;
+	p[23] = 2;
+	p[25] = 100;
+	for(uint i = 0; i < entries; ++i)
+	{
+		// The size of 100 frames
+		size_t size = 0;
+		for(uint j = i * 100; j < i * 100 + 100; ++j)
+			size += CHeader((j % 3) ? 0x6CA0FBFF : 0x6C90FBFF).getFrameSize();
+		p[26 + 2 * i] = static_cast<uchar>(size >> 8);
+		p[27 + 2 * i] = static_cast<uchar>(size);
+	}
+
+	buf.insert(buf.end(), xing.begin() + frameSize, xing.end());
+	return buf;
+}
+
+
+void test_first_header()
+{
+	// Junk full of free-bitrate headers that never form a sequence
+	std::vector<uchar> buf(1444 * 16);
+	static const uchar s_free[] = {0xFF, 0xFB, 0x08, 0xC4};
+	for(size_t base = 0; base < buf.size(); base += 1444)
+	{
+		for(size_t i = 0; i < 8; ++i)
+			memcpy(&buf[base + 4 * i], s_free, sizeof(s_free));
+	}
+	auto junk = buf.size();
+	CHECK(MPEG::IStream::calcFirstHeaderOffset(&buf[0], buf.size()) == buf.size(), "false sync in junk");
+
+	auto stream = gen_stream(0x6CA0FBFF, 10);
+	buf.insert(buf.end(), stream.begin(), stream.end());
+	auto offset = MPEG::IStream::calcFirstHeaderOffset(&buf[0], buf.size());
+	CHECK(offset == junk, "expected " << junk << ", actual " << offset);
+	CHECK(MPEG::IStream::verifyFrameSequence(&buf[junk], buf.size() - junk), "sequence not verified");
+	CHECK(!MPEG::IStream::verifyFrameSequence(&buf[junk], 2 * 522), "short sequence verified");
+
+	// Random headers, free-bitrate ones among them, chained in pairs and rarely in sequences: the search matches a plain one.
+	// The groups of free-bitrate headers above come in between, so the frame sizes are precalculated in the long searches
+	std::mt19937 rng(7);
+	for(uint seed = 0; seed < 4; ++seed)
 	{
-		ERROR("Failed to open \"" << f_path << "\"");
+		std::vector<uchar> data(64 << 10);
+		for(auto& b : data)
+			b = static_cast<uchar>(rng() & 0x7F);
+		for(size_t base = 0; base + 32 <= data.size(); base += 1444)
+		{
+			for(size_t i = 0; i < 8; ++i)
+				memcpy(&data[base + 4 * i], s_free, sizeof(s_free));
+		}
+		for(size_t o = 32 + rng() % 64; o + 4 <= data.size(); o += 64 + rng() % 256)
+		{
+			static const uint s_versions[] = {0, 2, 3};
+			for(uint chain = (rng() % 128) ? rng() % 2 : 2; o + 4 <= data.size(); --chain)
+			{
+				uchar raw[] = {0xFF, static_cast<uchar>(0xE1 | (s_versions[rng() % 3] << 3) | ((1 + rng() % 3) << 1)),
+							   static_cast<uchar>(((rng() % 2) ? 0 : (1 + rng() % 14)) << 4 | (rng() % 3) << 2 | (rng() % 2) << 1), 0xC4};
+				memcpy(&data[o], raw, sizeof(raw));
+				if(!chain)
+					break;
+				CHeader h(*reinterpret_cast<const uint*>(raw));
+				uint min, step, max;
+				if(h.isFreeBitrate())
+					h.getFreeSizes(min, step, max);
+				o += h.isFreeBitrate() ? min + step * (rng() % ((max - min) / step + 1)) : h.getFrameSize();
+			}
+		}
+
+		for(size_t begin = 0; begin < data.size(); )
+		{
+			auto expected = begin;
+			while(expected < data.size() && !MPEG::IStream::verifyFrameSequence(&data[expected], data.size() - expected))
+				++expected;
+			auto offset = begin + MPEG::IStream::calcFirstHeaderOffset(&data[begin], data.size() - begin);
+			CHECK(offset == expected, "seed " << seed << ": expected " << expected << ", actual " << offset);
+			begin = offset + 1;
+		}
+	}
+}
+
+
+void test_borrow()
+{
+	auto buf = gen_stream(0x6CA0FBFF, 10);
+	const auto orig = buf;
+
+	MPEG::Options options;
+	options.Borrow = true;
+	auto copy = MPEG::IStream::create(&buf[0], buf.size());
+	auto view = MPEG::IStream::create(&buf[0], buf.size(), options);
+	CHECK(view->getFrameCount() == copy->getFrameCount(), "frame count mismatch");
+	CHECK(view->getSize() == copy->getSize(), "size mismatch");
+
+	CHECK(view->truncate(2) == 2, "truncate failed");
+	CHECK(view->getSize() == 8 * 522, "unexpected size " << view->getSize());
+	CHECK(view->cut(1, 3) == 3, "cut failed");
+	CHECK(view->getFrameCount() == 5, "unexpected frame count " << view->getFrameCount());
+	CHECK(buf == orig, "borrowed data modified");
+}
+
+
+void test_open()
+{
+	auto stream = gen_stream(0x6CA0FBFF, 10);
+	std::vector<uchar> buf(100, 0);
+	buf.insert(buf.end(), stream.begin(), stream.end());
+	buf.resize(buf.size() + 128, 'T');
+
+	const char* path = "test_open.tmp";
+	auto f = fopen(path, "wb");
+	CHECK(f, "failed to create \"" << path << '"');
+	if(!f)
 		return;
+	auto written = fwrite(&buf[0], buf.size(), 1, f);
+	fclose(f);
+	CHECK(written == 1, "failed to write \"" << path << '"');
+
+	{
+		auto file = MPEG::IStream::open(path);
+		CHECK(file.Stream, "no stream");
+		CHECK(file.Size == buf.size(), "unexpected size " << file.Size);
+		CHECK(file.Offset == 100, "unexpected offset " << file.Offset);
+		CHECK(file.Trailing == 128, "unexpected trailing size " << file.Trailing);
+		if(file.Stream)
+			CHECK(file.Stream->getFrameCount() == 10, "unexpected frame count " << file.Stream->getFrameCount());
+	}
+	remove(path);
+
+	bool thrown = false;
+	try { MPEG::IStream::open(path); }
+	catch(const std::system_error&) { thrown = true; }
+	CHECK(thrown, "no error for a missing file");
+}
+
+
+// Free-format layer III frames (44.1 kHz) of the slot count with random data, every third one padded
+static std::vector<uchar> gen_free_stream(uint f_frames, uint f_slots, std::mt19937& f_rng)
+{
+	std::vector<uchar> buf;
+	for(uint i = 0; i < f_frames; ++i)
+	{
+		uint raw = (i % 3) ? 0x6C00FBFF : 0x6C02FBFF;
+		auto offset = buf.size();
+		buf.resize(offset + f_slots + !(i % 3));
+		memcpy(&buf[offset], &raw, sizeof(raw));
+		// No sync bytes in the data
+		for(auto j = offset + sizeof(raw); j < buf.size(); ++j)
+			buf[j] = static_cast<uchar>(f_rng() % 0xFF);
+	}
+	return buf;
+}
+
+static bool write_file(const char* f_path, const std::vector<uchar>& f_data)
+{
+	auto f = fopen(f_path, "wb");
+	if(!f)
+		return false;
+	auto written = fwrite(&f_data[0], f_data.size(), 1, f);
+	fclose(f);
+	return (written == 1);
+}
+
+static std::vector<uchar> read_file(const char* f_path)
+{
+	std::vector<uchar> data;
+	if(auto f = fopen(f_path, "rb"))
+	{
+		uchar buf[4096];
+		while(auto n = fread(buf, 1, sizeof(buf), f))
+			data.insert(data.end(), buf, buf + n);
+		fclose(f);
+	}
+	return data;
+}
+
+
+// An ID3v2 tag with the data (and a footer for v2.4)
+static std::vector<uchar> gen_id3v2(const std::vector<uchar>& f_data, bool f_footer)
+{
+	std::vector<uchar> tag = {'I', 'D', '3', static_cast<uchar>(f_footer ? 4 : 3), 0, static_cast<uchar>(f_footer ? 0x10 : 0)};
+	auto size = f_data.size();
+	for(int shift = 21; shift >= 0; shift -= 7)
+		tag.push_back(static_cast<uchar>((size >> shift) & 0x7F));
+	tag.insert(tag.end(), f_data.begin(), f_data.end());
+	if(f_footer)
+	{
+		tag.insert(tag.end(), {'3', 'D', 'I'});
+		tag.insert(tag.end(), tag.begin() + 3, tag.begin() + 10);
+	}
+	return tag;
+}
+
+
+void test_tags()
+{
+	// "Cover art" with a frame sequence inside
+	std::vector<uchar> art(3000, 0);
+	auto fake = gen_stream(0x6CA2FBFF, 5);
+	std::copy(fake.begin(), fake.end(), art.begin() + 100);
+	auto id3 = gen_id3v2(art, false);
+	auto id3Footer = gen_id3v2(std::vector<uchar>(20, 0), true);
+
+	// APEv2 with a header: 32 + items + footer (the size counts the items and the footer)
+	std::vector<uchar> ape(32 + 40 + 32, 0);
+	for(size_t p : {size_t(0), ape.size() - 32})
+	{
+		memcpy(&ape[p], "APETAGEX", 8);
+		ape[p + 8] = 0xD0;
+		ape[p + 9] = 0x07;
+		ape[p + 12] = 40 + 32;
+		ape[p + 23] = 0xA0;
+	}
+	std::string lyrics = "LYRICSBEGININD0000210";
+	lyrics += "000021LYRICS200";
+	std::vector<uchar> id3v1(128, ' ');
+	memcpy(&id3v1[0], "TAG", 3);
+
+	auto stream = gen_stream(0x6CA0FBFF, 50);
+	std::vector<uchar> buf;
+	for(auto* part : {&id3, &id3Footer, &stream, &ape})
+		buf.insert(buf.end(), part->begin(), part->end());
+	buf.insert(buf.end(), lyrics.begin(), lyrics.end());
+	buf.insert(buf.end(), id3v1.begin(), id3v1.end());
+
+	auto leading = id3.size() + id3Footer.size();
+	auto trailing = ape.size() + lyrics.size() + id3v1.size();
+	const MPEG::Tag expected[] =
+	{
+		{0,										id3.size(),			MPEG::TagType::ID3v2},
+		{id3.size(),							id3Footer.size(),	MPEG::TagType::ID3v2},
+		{leading + stream.size(),				ape.size(),			MPEG::TagType::APEv2},
+		{leading + stream.size() + ape.size(),	lyrics.size(),		MPEG::TagType::Lyrics3},
+		{buf.size() - id3v1.size(),				id3v1.size(),		MPEG::TagType::ID3v1}
+	};
+	auto same = [&expected](const std::vector<MPEG::Tag>& f_tags)
+	{
+		if(f_tags.size() != sizeof(expected) / sizeof(*expected))
+			return false;
+		for(size_t i = 0; i < f_tags.size(); ++i)
+		{
+			if(f_tags[i].Offset != expected[i].Offset || f_tags[i].Size != expected[i].Size || f_tags[i].Type != expected[i].Type)
+				return false;
+		}
+		return true;
+	};
+
+	CHECK(same(MPEG::IStream::findTags(&buf[0], buf.size())), "unexpected tags");
+	// The frames in the tag are never considered
+	auto offset = MPEG::IStream::calcFirstHeaderOffset(&buf[0], buf.size());
+	CHECK(offset == leading, "unexpected first header offset " << offset);
+
+	// An oversized ID3v2 tag (100 bytes declaring 255) doesn't hide the first frames
+	auto oversized = gen_id3v2(std::vector<uchar>(90, 0), false);
+	oversized[8] = 1;
+	oversized[9] = 255 - 10 - 128;
+	oversized.insert(oversized.end(), stream.begin(), stream.end());
+	offset = MPEG::IStream::calcFirstHeaderOffset(&oversized[0], oversized.size());
+	CHECK(offset == 100, "the oversized tag is trusted: first header offset " << offset);
+
+	const char* path = "test_tags.tmp";
+	const char* index = "test_tags.idx";
+	remove(index);
+	CHECK(write_file(path, buf), "failed to write \"" << path << '"');
+	for(bool sidecar : {false, true, true})
+	{
+		auto file = sidecar ? MPEG::IStream::open(path, index) : MPEG::IStream::open(path);
+		CHECK(file.Stream && file.Stream->getFrameCount() == 50, "no stream");
+		CHECK(file.Offset == leading && file.Trailing == trailing, "unexpected stream position " << file.Offset << ", " << file.Trailing);
+		CHECK(same(file.Tags), "unexpected file tags");
+	}
+
+	CHECK(write_file(path, oversized), "failed to write \"" << path << '"');
+	auto file = MPEG::IStream::open(path);
+	CHECK(file.Stream && file.Offset == 100 && file.Stream->getFrameCount() == 50, "the oversized tag hides frames");
+	remove(path);
+	remove(index);
+
+	// Lyrics3 v1, an appended ID3v2.4 tag, a broken APEv2 size
+	std::vector<uchar> tail = stream;
+	std::string lyrics1 = "LYRICSBEGINsome textLYRICSEND";
+	tail.insert(tail.end(), lyrics1.begin(), lyrics1.end());
+	tail.insert(tail.end(), id3Footer.begin(), id3Footer.end());
+	auto tags = MPEG::IStream::findTags(&tail[0], tail.size());
+	CHECK(tags.size() == 2 && tags[0].Type == MPEG::TagType::Lyrics3 && tags[0].Offset == stream.size() &&
+		  tags[1].Type == MPEG::TagType::ID3v2 && tags[1].Size == id3Footer.size(), "unexpected Lyrics3 v1 / ID3v2.4 tags");
+	ape[ape.size() - 32 + 13] = 0x7F;
+	tail = stream;
+	tail.insert(tail.end(), ape.begin(), ape.end());
+	CHECK(MPEG::IStream::findTags(&tail[0], tail.size()).empty(), "broken APEv2 tag accepted");
+}
+
+
+void test_sidecar()
+{
+	const char* path = "test_sidecar.tmp";
+	const char* index = "test_sidecar.idx";
+
+	// VBR with a Xing frame, CBR (implicit index)
+	for(bool vbr : {true, false})
+	{
+		auto stream = vbr ? gen_xing_stream(1000) : gen_stream(0x6CA0FBFF, 1000);
+		std::vector<uchar> buf(100, 0);
+		buf.insert(buf.end(), stream.begin(), stream.end());
+		buf.resize(buf.size() + 128, 'T');
+		remove(index);
+		CHECK(write_file(path, buf), "failed to write \"" << path << '"');
+
+		auto scanned = MPEG::IStream::open(path, index);
+		auto loaded = MPEG::IStream::open(path, index);
+		CHECK(scanned.Stream && loaded.Stream, "no stream");
+		if(!scanned.Stream || !loaded.Stream)
+			continue;
+		CHECK(loaded.Offset == scanned.Offset && loaded.Trailing == scanned.Trailing, "stream position mismatch");
+		CHECK(same_frames(*scanned.Stream, *loaded.Stream), "sidecar frames mismatch");
+		CHECK(loaded.Stream->getLength() == scanned.Stream->getLength() &&
+			  loaded.Stream->getBitrate() == scanned.Stream->getBitrate() &&
+			  loaded.Stream->isVBR() == scanned.Stream->isVBR() &&
+			  loaded.Stream->getSamplingRate() == scanned.Stream->getSamplingRate() &&
+			  loaded.Stream->getChannelMode() == scanned.Stream->getChannelMode(), "sidecar stream info mismatch");
+		if(vbr)
+			CHECK(!loaded.Stream->getIndexMemoryUsage() && scanned.Stream->getIndexMemoryUsage(), "the table is not used in place");
+
+		// The restored stream is editable
+		if(!vbr)
+		{
+			loaded.Stream->cut(0, 10);
+			scanned.Stream->cut(0, 10);
+			CHECK(same_frames(*scanned.Stream, *loaded.Stream), "cut mismatch");
+		}
+
+		// A changed file makes the sidecar stale
+		buf = gen_stream(0x6CA2FBFF, 500);
+		CHECK(write_file(path, buf), "failed to write \"" << path << '"');
+		auto changed = MPEG::IStream::open(path, index);
+		CHECK(changed.Stream && changed.Stream->getFrameCount() == 500, "stale sidecar is used");
+
+		// A broken sidecar is ignored (and rewritten)
+		CHECK(write_file(index, std::vector<uchar>(10, 'X')), "failed to write \"" << index << '"');
+		auto rescanned = MPEG::IStream::open(path, index);
+		CHECK(rescanned.Stream && same_frames(*rescanned.Stream, *changed.Stream), "broken sidecar is used");
+	}
+
+	// Concurrent first opens write unique temporary files: all of them succeed, one sidecar is left whole
+	auto buf = gen_xing_stream(1000);
+	CHECK(write_file(path, buf), "failed to write \"" << path << '"');
+	remove(index);
+	std::vector<MPEG::File> files(8);
+	std::vector<std::thread> threads;
+	for(auto& file : files)
+		threads.emplace_back([&file, path, index]{ file = MPEG::IStream::open(path, index); });
+	for(auto& thread : threads)
+		thread.join();
+	bool opened = true;
+	for(auto& file : files)
+		opened = opened && file.Stream && file.Stream->getFrameCount() == 1000;
+	CHECK(opened, "concurrent opens failed");
+	auto loaded = MPEG::IStream::open(path, index);
+	CHECK(loaded.Stream && !loaded.Stream->getIndexMemoryUsage(), "no sidecar after concurrent opens");
+	uint leftovers = 0;
+	if(auto dir = opendir("."))
+	{
+		while(auto entry = readdir(dir))
+			leftovers += !strncmp(entry->d_name, "test_sidecar.idx.", strlen("test_sidecar.idx."));
+		closedir(dir);
+	}
+	CHECK(!leftovers, leftovers << " temporary sidecar files left");
+
+	// A corrupted record (the size of a frame in the middle) fails the checksum: the file is scanned again
+	if(auto f = fopen(index, "r+b"))
+	{
+		fseek(f, -(500 * 24 + 8), SEEK_END);
+		fputc(0x7F, f);
+		fclose(f);
+	}
+	auto corrupted = MPEG::IStream::open(path, index);
+	CHECK(corrupted.Stream && corrupted.Stream->getIndexMemoryUsage() && same_frames(*corrupted.Stream, *files[0].Stream),
+		  "corrupted sidecar is used");
+
+	// A sidecar that can't be written doesn't fail the open
+	auto unwritable = MPEG::IStream::open(path, "no_such_dir/test_sidecar.idx");
+	CHECK(unwritable.Stream && unwritable.Stream->getFrameCount() == 1000, "failed sidecar write fails the open");
+
+	// Records out of order fail the bounds check even with a valid checksum (of the 1000 records at the end)
+	auto sidecar = read_file(index);
+	CHECK(sidecar.size() > 1000 * 24, "no sidecar");
+	if(sidecar.size() > 1000 * 24)
+	{
+		auto records = sidecar.size() - 1000 * 24;
+		std::swap_ranges(&sidecar[records + 500 * 24], &sidecar[records + 500 * 24 + 8], &sidecar[records + 501 * 24]);
+		// FNV-1a over 8-byte words, the last header field but one
+		uint64_t checksum = 0xCBF29CE484222325ull;
+		for(auto i = records; i < sidecar.size(); i += 8)
+		{
+			uint64_t word;
+			memcpy(&word, &sidecar[i], sizeof(word));
+			checksum = (checksum ^ word) * 0x100000001B3ull;
+		}
+		memcpy(&sidecar[records - 16], &checksum, sizeof(checksum));
+		CHECK(write_file(index, sidecar), "failed to write \"" << index << '"');
+		auto unordered = MPEG::IStream::open(path, index);
+		CHECK(unordered.Stream && unordered.Stream->getIndexMemoryUsage() && same_frames(*unordered.Stream, *files[0].Stream),
+			  "sidecar with unordered records is used");
+	}
+
+	// A sidecar scanned without the recovery is not used with it
+	MPEG::Options recover;
+	recover.Recover = true;
+	CHECK(MPEG::IStream::open(path, index).Stream, "no stream");
+	auto recovered = MPEG::IStream::open(path, index, recover);
+	CHECK(recovered.Stream && recovered.Stream->getIndexMemoryUsage(), "sidecar of another recovery is used");
+
+	// Nor a sidecar of an implicit CBR index with the implicit CBR index disabled
+	CHECK(write_file(path, gen_stream(0x6CA0FBFF, 1000)), "failed to write \"" << path << '"');
+	auto cbr = MPEG::IStream::open(path, index);
+	MPEG::Options table;
+	table.ImplicitCBR = false;
+	auto tabled = MPEG::IStream::open(path, index, table);
+	CHECK(cbr.Stream && tabled.Stream && tabled.Stream->getIndexMemoryUsage() && same_frames(*cbr.Stream, *tabled.Stream),
+		  "implicit CBR sidecar is used with ImplicitCBR disabled");
+
+	remove(path);
+	remove(index);
+}
+
+
+void test_parser()
+{
+	// Junk, a stream of mixed frame sizes and a trailing tag
+	std::vector<uchar> buf(333, 0xFF);
+	for(uint i = 0; i < 50; ++i)
+	{
+		auto frames = gen_stream((i & 1) ? 0x6CA2FBFF : 0x6CA0FBFF, 1 + i % 3);
+		buf.insert(buf.end(), frames.begin(), frames.end());
+	}
+	buf.resize(buf.size() + 128, 'T');
+
+	auto offset = MPEG::IStream::calcFirstHeaderOffset(&buf[0], buf.size());
+	auto stream = MPEG::IStream::create(&buf[offset], buf.size() - offset);
+
+	std::mt19937 rng(0xC0FFEE);
+	for(uint pass = 0; pass < 20; ++pass)
+	{
+		std::vector<MPEG::Frame> frames;
+		auto parser = MPEG::IParser::create([&](const MPEG::Frame& f_frame) { frames.push_back(f_frame); });
+
+		size_t maxBuffered = 0;
+		for(size_t pos = 0; pos < buf.size();)
+		{
+			auto n = std::min<size_t>(buf.size() - pos, (pass ? (1 + rng() % 2000) : buf.size()));
+			parser->feed(&buf[pos], n);
+			pos += n;
+			maxBuffered = std::max(maxBuffered, parser->getBufferedSize());
+		}
+
+		CHECK(parser->getSize() == buf.size(), "unexpected size " << parser->getSize());
+		CHECK(frames.size() == stream->getFrameCount(), "frame count mismatch: " << frames.size());
+		CHECK(maxBuffered <= 4 * 2881, "buffered " << maxBuffered << " bytes");
+		for(uint i = 0; i < frames.size() && i < stream->getFrameCount(); ++i)
+		{
+			if(frames[i].Offset != offset + stream->getFrameOffset(i) ||
+			   frames[i].Size != stream->getFrameSize(i) ||
+			   frames[i].Time != stream->getFrameTime(i))
+			{
+				CHECK(false, "frame #" << i << " mismatch (pass " << pass << ')');
+				break;
+			}
+		}
 	}
+}
+
 
-	do
+void test_index()
+{
+	// Random frames with gaps and more classes than the compact index table holds
+	std::mt19937 rng(0x1DE);
+	CFullIndex full;
+	CCompactIndex compact;
+	size_t offset = 0;
+	uint64_t sample = 0;
+	for(uint i = 0; i < 5000; ++i)
 	{
-		fseek(f, 0, SEEK_END);
-		size_t fsize = ftell(f);
-		rewind(f);
+		uint size = (i < 3000) ? (417 + rng() % 2) : (100 + rng() % 1000);
+		uint samples = (rng() % 16) ? 1152 : 576;
+		FrameInfo frame(offset, size, sample, 36);
+		full.push(frame, samples);
+		compact.push(frame, samples);
+		offset += size + ((rng() % 8) ? 0 : rng() % 100000);
+		sample += samples;
 
-		std::vector<uchar> buf(fsize);
+		if(!(rng() % 700))
+		{
+			auto n = rng() % (full.getCount() + 1);
+			full.shrink(n);
+			compact.shrink(n);
+			if(n)
+			{
+				auto last = full.get(n - 1);
+				offset = last.Offset + last.Size;
+				sample = last.Sample + 1152;
+			}
+			else
+			{
+				offset = 0;
+				sample = 0;
+			}
+		}
+	}
 
-		if(fread(&buf[0], buf.size(), 1, f) != 1)
+	CHECK(compact.getCount() == full.getCount(), "count mismatch");
+	for(uint i = 0; i < full.getCount(); ++i)
+	{
+		auto a = full.get(i);
+		auto b = compact.get(i);
+		if(a.Offset != b.Offset || a.Size != b.Size || a.Sample != b.Sample || a.DataRelOffset != b.DataRelOffset)
 		{
-			ERROR("Failed to read " << fsize << " bytes");
+			CHECK(false, "frame #" << i << " mismatch");
 			break;
 		}
+	}
+	CHECK(compact.getMemoryUsage() < full.getMemoryUsage(), "compact index is larger");
+
+	// Stream level
+	std::vector<uchar> buf;
+	for(uint i = 0; i < 100; ++i)
+	{
+		auto frames = gen_stream((i % 3) ? 0x6CA2FBFF : 0x6C90FBFF, 1 + i % 4);
+		buf.insert(buf.end(), frames.begin(), frames.end());
+	}
+	MPEG::Options options;
+	options.Index = MPEG::IndexMode::Compact;
+	auto a = MPEG::IStream::create(&buf[0], buf.size());
+	auto b = MPEG::IStream::create(&buf[0], buf.size(), options);
+	a->cut(17, 40);
+	b->cut(17, 40);
+	a->truncate(5);
+	b->truncate(5);
+	CHECK(same_frames(*a, *b), "compact stream mismatch");
+}
+
+
+void test_sparse_index()
+{
+	// Free-bitrate frames (420 bytes @ 44.1 kHz) followed by regular ones
+	std::vector<uchar> buf;
+	static const uint s_free = 0x4400FBFF;
+	for(uint i = 0; i < 7; ++i)
+	{
+		buf.resize(buf.size() + 420);
+		memcpy(&buf[buf.size() - 420], &s_free, sizeof(s_free));
+	}
+	for(uint i = 0; i < 100; ++i)
+	{
+		auto frames = gen_stream((i % 3) ? 0x6CA2FBFF : 0x6C90FBFF, 1 + i % 4);
+		buf.insert(buf.end(), frames.begin(), frames.end());
+	}
+
+	auto full = MPEG::IStream::create(&buf[0], buf.size());
+	MPEG::Options options;
+	options.Index = MPEG::IndexMode::Sparse;
+	options.SparseFrames = 5;
+	auto byFrames = MPEG::IStream::create(&buf[0], buf.size(), options);
+	options.SparseFrames = 1000;
+	options.SparseTime = 0.5f;
+	auto byTime = MPEG::IStream::create(&buf[0], buf.size(), options);
+
+	CHECK(same_frames(*full, *byFrames), "sparse (frames) mismatch");
+	CHECK(same_frames(*full, *byTime), "sparse (time) mismatch");
+	CHECK(byFrames->getIndexMemoryUsage() * 4 < full->getIndexMemoryUsage(), "sparse index is too large");
+
+	full->truncate(13);
+	byFrames->truncate(13);
+	CHECK(same_frames(*full, *byFrames), "truncated sparse mismatch");
+}
+
+
+void test_time_lookup()
+{
+	std::vector<uchar> buf;
+	for(uint i = 0; i < 100; ++i)
+	{
+		auto frames = gen_stream((i % 3) ? 0x6CA2FBFF : 0x6C90FBFF, 1 + i % 4);
+		buf.insert(buf.end(), frames.begin(), frames.end());
+	}
+
+	std::vector<float> times;
+	for(float t = -0.1f; t < 7.0f; t += 0.0173f)
+		times.push_back(t);
+
+	for(auto mode : {MPEG::IndexMode::Full, MPEG::IndexMode::Compact, MPEG::IndexMode::Sparse})
+	{
+		MPEG::Options options;
+		options.Index = mode;
+		options.SparseFrames = 7;
+		auto stream = MPEG::IStream::create(&buf[0], buf.size(), options);
+
+		std::vector<unsigned> frames;
+		stream->getFrameNumbers(times, frames);
+		CHECK(frames.size() == times.size(), "batch size mismatch");
+
+		for(size_t i = 0; i < times.size(); ++i)
+		{
+			// Linear reference
+			auto t = times[i];
+			uint expected = 0;
+			if(t >= stream->getLength())
+				expected = stream->getFrameCount();
+			else
+			{
+				while(expected + 1 < stream->getFrameCount() && stream->getFrameTime(expected + 1) <= t)
+					++expected;
+			}
+
+			auto single = stream->getFrameNumber(t);
+			if(single != expected || frames[i] != expected)
+			{
+				CHECK(false, "time " << t << ": expected " << expected << ", single " << single <<
+					  ", batch " << frames[i] << " (mode " << static_cast<int>(mode) << ')');
+				break;
+			}
+		}
+	}
+}
+
+
+void test_samples()
+{
+	// A float time accumulated over a long stream drifts, the sample counts are exact prefix sums
+	auto buf = gen_stream(0x6C90FBFF, 20000);
+	const uint64_t spf = CHeader(0x6C90FBFF).getFrameSamples();
+	CHECK(spf == 1152 && CHeader(0x6C90F3FF).getFrameSamples() == 576, "wrong samples per frame");
+
+	for(auto mode : {MPEG::IndexMode::Full, MPEG::IndexMode::Compact, MPEG::IndexMode::Sparse})
+	{
+		for(bool cbr : {false, true})
+		{
+			MPEG::Options options;
+			options.Index = mode;
+			options.ImplicitCBR = cbr;
+			auto stream = MPEG::IStream::create(&buf[0], buf.size(), options);
+
+			bool exact = (stream->getSampleCount() == spf * 20000) &&
+						 (stream->getFrameSample(stream->getFrameCount()) == stream->getSampleCount());
+			for(uint i = 0; exact && i < stream->getFrameCount(); i += 97)
+				exact = (stream->getFrameSample(i) == spf * i);
+			CHECK(exact, "inexact timeline (mode " << static_cast<int>(mode) << ", CBR " << cbr << ')');
+
+			CHECK(stream->getDuration(100, 50) == spf * 50 && stream->getDuration(19990, 50) == spf * 10 &&
+				  stream->getDuration(20000, 1) == 0 && stream->getDuration(0, ~0u) == stream->getSampleCount(),
+				  "wrong duration");
+
+			// The edited frames are renumbered, their samples too
+			stream->cut(1000, 500);
+			stream->cut(0, 10);
+			exact = (stream->getSampleCount() == spf * 19490);
+			for(uint i = 0; exact && i < stream->getFrameCount(); i += 89)
+				exact = (stream->getFrameSample(i) == spf * i);
+			CHECK(exact && stream->getDuration(980, 20) == spf * 20, "inexact edited timeline");
+		}
+	}
+}
+
+
+void test_range_stats()
+{
+	// VBR frames: blocks of one bitrate with rare peaks
+	std::mt19937 rng(17);
+	std::vector<uchar> buf;
+	for(uint i = 0; i < 3000; ++i)
+	{
+		auto raw = (rng() % 50) ? ((i / 200 % 2) ? 0x6C90FBFF : 0x6C80FBFF) : 0x6CE0FBFF;
+		auto frame = gen_stream(raw, 1);
+		buf.insert(buf.end(), frame.begin(), frame.end());
+	}
 
-		auto offset = MPEG::IStream::calcFirstHeaderOffset(&buf[0], buf.size());
-		if(offset >= fsize)
+	for(auto mode : {MPEG::IndexMode::Full, MPEG::IndexMode::Sparse})
+	{
+		for(bool scan : {false, true})
 		{
-			ERROR("Failed to init MPEG stream");
+			MPEG::Options options;
+			options.Index = mode;
+			options.RangeStats = scan;
+			auto stream = MPEG::IStream::create(&buf[0], buf.size(), options);
+
+			// The linear reference
+			auto check = [&](uint f_frame, uint f_count)
+			{
+				uint64_t bytes = 0;
+				uint size = 0;
+				for(auto i = f_frame; i < std::min(f_frame + f_count, stream->getFrameCount()); ++i)
+				{
+					bytes += stream->getFrameSize(i);
+					size = std::max(size, stream->getFrameSize(i));
+				}
+				auto rate = stream->getSamplingRate() / 1000.0;
+				auto samples = stream->getDuration(f_frame, f_count);
+				float average = samples ? static_cast<float>(bytes * 8 * rate / samples) : 0.0f;
+				float peak = samples ? static_cast<float>(size * 8 * rate / 1152) : 0.0f;
+				return std::fabs(stream->getAverageBitrate(f_frame, f_count) - average) < 1e-2f &&
+					   std::fabs(stream->getMaxBitrate(f_frame, f_count) - peak) < 1e-2f;
+			};
+
+			bool same = check(0, ~0u) && check(10, 0) && check(2990, 100) && check(5000, 1) &&
+						std::fabs(stream->getMaxBitrate(0, ~0u) - 320.0f) < 1.0f;
+			for(uint i = 0; same && i < 300; ++i)
+				same = check(rng() % 3000, rng() % ((i % 2) ? 100 : 3000));
+			CHECK(same, "range stats mismatch (mode " << static_cast<int>(mode) << ", scan " << scan << ')');
+
+			// The edited ranges span several pieces
+			for(uint i = 0; i < 20; ++i)
+				stream->cut(rng() % stream->getFrameCount(), 1 + rng() % 30);
+			for(uint i = 0; same && i < 300; ++i)
+				same = check(rng() % stream->getFrameCount(), rng() % 1000);
+			CHECK(same, "edited range stats mismatch (mode " << static_cast<int>(mode) << ", scan " << scan << ')');
+		}
+	}
+}
+
+
+// A CBR stream (MPEG 1 layer III, 128 kbps, 44.1 kHz) padded the way encoders do it:
+// a frame is padded when the accumulated fraction of a byte exceeds one
+static std::vector<uchar> gen_cbr_stream(uint f_frames)
+{
+	const uint sampling = 44100;
+	const uint frac = 144 * 128000 % sampling;
+	std::vector<uchar> buf;
+	int lag = frac;
+	for(uint i = 0; i < f_frames; ++i)
+	{
+		lag -= frac;
+		bool padded = (lag < 0);
+		if(padded)
+			lag += sampling;
+		auto frames = gen_stream(padded ? 0x6C92FBFF : 0x6C90FBFF, 1);
+		buf.insert(buf.end(), frames.begin(), frames.end());
+	}
+	return buf;
+}
+
+
+void test_cbr_index()
+{
+	auto buf = gen_cbr_stream(5000);
+	// ID3v1 tag
+	buf.resize(buf.size() + 128);
+	memcpy(&buf[buf.size() - 128], "TAG", 3);
+
+	MPEG::Options options;
+	options.ImplicitCBR = false;
+	auto full = MPEG::IStream::create(&buf[0], buf.size(), options);
+	auto cbr = MPEG::IStream::create(&buf[0], buf.size());
+	CHECK(!cbr->getIndexMemoryUsage(), "CBR stream is indexed");
+	CHECK(!cbr->isVBR() && cbr->getBitrate() == 128, "wrong CBR stream info");
+	CHECK(cbr->getSize() == full->getSize(), "size mismatch");
+	CHECK(cbr->getSampleCount() == full->getSampleCount(), "length mismatch");
+
+	bool same = (cbr->getFrameCount() == full->getFrameCount());
+	for(uint i = 0; same && i < full->getFrameCount(); ++i)
+	{
+		same = cbr->getFrameOffset(i) == full->getFrameOffset(i) &&
+			   cbr->getFrameSize(i) == full->getFrameSize(i) &&
+			   cbr->getFrameSample(i) == full->getFrameSample(i);
+	}
+	CHECK(same, "implicit CBR index mismatch");
+
+	// Time lookup in the middle of the frames (away from the rounding differences)
+	for(uint i = 0; i < full->getFrameCount(); i += 37)
+	{
+		auto t = full->getFrameTime(i) + 0.01f;
+		if(cbr->getFrameNumber(t) != i)
+		{
+			CHECK(false, "time " << t << ": expected " << i << ", actual " << cbr->getFrameNumber(t));
 			break;
 		}
+	}
 
-		auto mpeg = MPEG::IStream::create(&buf[offset], fsize - offset);
+	// All the frames padded / none of them
+	for(uint header : {0x6CA2FBFFu, 0x6CA4FBFFu})
+	{
+		auto same = gen_stream(header, 1000);
+		auto stream = MPEG::IStream::create(&same[0], same.size());
+		CHECK(!stream->getIndexMemoryUsage() && stream->getFrameCount() == 1000, "constant frame size is not detected");
+	}
 
-		auto uDataOffset = mpeg->getFrameOffset(0);
-		auto uSize = mpeg->getSize();
-		LOG(f_path << std::endl << "===");
-		LOG("Offset : " << (offset + uDataOffset) << (uDataOffset ? "*" : ""));
-		LOG("Next   : " << (offset + uSize));
-		LOG("Frames : " << mpeg->getFrameCount());
-		LOG("Length : " << mpeg->getLength());
-		LOG("MPEG " << MPEG::IStream::str(mpeg->getVersion()) << " Layer " << mpeg->getLayer());
-		LOG("Bitrate      : " << mpeg->getBitrate() << " kbps" << (mpeg->isVBR() ? " (VBR)" : ""));
-		LOG("Sampling Rate: " << mpeg->getSamplingRate() << " Hz");
-		LOG("Channel Mode : " << MPEG::IStream::str(mpeg->getChannelMode()));
-		LOG("Emphasis     : " << MPEG::IStream::str(mpeg->getEmphasis()));
+	// A different bitrate at the end: the header check falls back to the full index
+	auto tail = gen_stream(0x6CA0FBFF, 1);
+	auto vbr = gen_cbr_stream(5000);
+	vbr.insert(vbr.end(), tail.begin(), tail.end());
+	auto fallback = MPEG::IStream::create(&vbr[0], vbr.size());
+	CHECK(fallback->getIndexMemoryUsage() && fallback->isVBR(), "VBR stream has an implicit index");
+	CHECK(fallback->getFrameCount() == 5001, "wrong frame count " << fallback->getFrameCount());
+
+	// A broken sync word between any checked positions is found too: the stream ends there as with the full scan
+	auto broken = gen_cbr_stream(2000);
+	MPEG::Options scanOptions;
+	scanOptions.ImplicitCBR = false;
+	auto scanned = MPEG::IStream::create(&broken[0], broken.size(), scanOptions);
+	broken[scanned->getFrameOffset(1001)] = 0;
+	auto implicit = MPEG::IStream::create(&broken[0], broken.size());
+	scanned = MPEG::IStream::create(&broken[0], broken.size(), scanOptions);
+	CHECK(scanned->getFrameCount() == 1001 && same_frames(*implicit, *scanned) &&
+		  implicit->hasIssues() == scanned->hasIssues(), "a corrupt frame is hidden by the implicit index");
+
+	// Editing keeps the frames consistent
+	CHECK(cbr->truncate(100) == 100 && full->truncate(100) == 100, "truncate failed");
+	CHECK(cbr->getFrameCount() == full->getFrameCount() && cbr->getSize() == full->getSize(), "truncated CBR mismatch");
+	cbr->cut(10, 1);
+	full->cut(10, 1);
+	CHECK(cbr->getFrameCount() == full->getFrameCount() && cbr->getFrameOffset(4000) == full->getFrameOffset(4000),
+		  "cut CBR mismatch");
+}
+
+
+void test_parallel_index()
+{
+	// VBR frames with random payload (> 4 chunks of 1 MB)
+	static const uint s_headers[] = {0x6CA0FBFF, 0x6CA2FBFF, 0x6C90FBFF, 0x6CB0FBFF, 0x6C80FBFF};
+	std::mt19937 rng(13);
+	std::vector<uchar> buf;
+	for(uint i = 0; i < 12000; ++i)
+	{
+		auto raw = s_headers[rng() % (sizeof(s_headers) / sizeof(*s_headers))];
+		auto offset = buf.size();
+		buf.resize(offset + CHeader(raw).getFrameSize());
+		for(auto j = offset + 4; j < buf.size(); ++j)
+			buf[j] = static_cast<uchar>(rng());
+		memcpy(&buf[offset], &raw, sizeof(raw));
 	}
-	while(0);
 
-	fclose(f);
+	auto check = [](const std::vector<uchar>& f_buf, const char* f_name, MPEG::Options f_options)
+	{
+		auto sequential = MPEG::IStream::create(&f_buf[0], f_buf.size(), f_options);
+		for(uint threads : {2u, 3u, 4u, 0u})
+		{
+			f_options.Threads = threads;
+			auto parallel = MPEG::IStream::create(&f_buf[0], f_buf.size(), f_options);
+			CHECK(same_frames(*sequential, *parallel), f_name << ": frame mismatch (" << threads << " threads)");
+			CHECK(sequential->getSize() == parallel->getSize() &&
+				  sequential->getLength() == parallel->getLength() &&
+				  sequential->getBitrate() == parallel->getBitrate() &&
+				  sequential->isVBR() == parallel->isVBR(), f_name << ": stream info mismatch (" << threads << " threads)");
+
+			// The chunk tables are stitched with the samples, the statistics and the side information
+			auto n = sequential->getFrameCount();
+			bool same = parallel->getSampleCount() == sequential->getSampleCount();
+			for(uint i = 0; same && i < n; ++i)
+				same = parallel->getFrameSample(i) == sequential->getFrameSample(i);
+			for(uint i = 0; same && i + 1000 < n; i += 997)
+			{
+				same = parallel->getMaxBitrate(i, 1000) == sequential->getMaxBitrate(i, 1000) &&
+					   parallel->getAverageBitrate(i, 1000) == sequential->getAverageBitrate(i, 1000);
+			}
+			MPEG::SideInfo a, b;
+			for(uint i = 0; same && f_options.SideInfo && i < n; ++i)
+			{
+				same = sequential->getSideInfo(i, a) && parallel->getSideInfo(i, b) &&
+					   a.MainDataBegin == b.MainDataBegin && a.Part23Length[1][1] == b.Part23Length[1][1] &&
+					   a.GlobalGain[0][0] == b.GlobalGain[0][0];
+			}
+			CHECK(same, f_name << ": stitched table mismatch (" << threads << " threads)");
+		}
+	};
+	MPEG::Options options;
+	check(buf, "VBR", options);
+	options.RangeStats = true;
+	options.SideInfo = true;
+	check(buf, "VBR columns", options);
+	options.Index = MPEG::IndexMode::Compact;
+	check(buf, "VBR compact", options);
+	options = MPEG::Options();
+
+	// Constant halves of the same size and different bitrates (522 and 417 bytes):
+	// the stream is VBR across the chunk boundary only
+	auto halves = gen_stream(0x6CA0FBFF, 4170);
+	auto second = gen_stream(0x6C90FBFF, 5220);
+	halves.insert(halves.end(), second.begin(), second.end());
+	check(halves, "halves", options);
+
+	// A fake header just after the middle leads to a real frame: the second chunk starts with it
+	// and the sequential scan joins the chunk at its second frame
+	auto fake = gen_stream(0x6CA0FBFF, 8000);
+	// A different last frame keeps the constant frame size from being detected
+	auto last = gen_stream(0x6C90FBFF, 1);
+	fake.insert(fake.end(), last.begin(), last.end());
+	const uint fakeHeader = 0x6C52FBFF;
+	const uint frameSize = CHeader(0x6CA0FBFFu).getFrameSize(), fakeSize = CHeader(fakeHeader).getFrameSize();
+	auto next = (fake.size() / 2 + frameSize - 1) / frameSize * frameSize;
+	CHECK(next - fake.size() / 2 >= fakeSize, "the fake frame starts before the middle");
+	memcpy(&fake[next - fakeSize], &fakeHeader, sizeof(fakeHeader));
+	check(fake, "fake resync", options);
+
+	// Junk in the middle ends the stream
+	auto junk = buf;
+	memset(&junk[junk.size() / 2], 0, 4096);
+	check(junk, "junk", options);
+	options.Recover = true;
+	check(junk, "recovered junk", options);
+	options.Recover = false;
+
+	// Free-format runs of two sizes: every chunk must see the sizes the sequential scan predicts
+	auto free = gen_stream(0x6CA0FBFF, 1);
+	for(uint slots : {1000u, 400u, 1000u})
+	{
+		auto run = gen_free_stream(2000, slots, rng);
+		free.insert(free.end(), run.begin(), run.end());
+	}
+	check(free, "free format", options);
+}
+
+
+void test_pieces()
+{
+	std::vector<uchar> buf;
+	for(uint i = 0; i < 300; ++i)
+	{
+		auto frames = gen_stream((i % 3) ? 0x6CA2FBFF : 0x6C90FBFF, 1 + i % 4);
+		buf.insert(buf.end(), frames.begin(), frames.end());
+	}
+
+	for(auto mode : {MPEG::IndexMode::Full, MPEG::IndexMode::Compact, MPEG::IndexMode::Sparse})
+	{
+		MPEG::Options options;
+		options.Index = mode;
+		options.SparseFrames = 7;
+		auto stream = MPEG::IStream::create(&buf[0], buf.size(), options);
+
+		// The reference: the bytes erased for real
+		auto data = buf;
+		std::mt19937 rng(15);
+		for(uint i = 0; i < 40; ++i)
+		{
+			auto n = stream->getFrameCount();
+			auto frame = rng() % n;
+			auto count = 1 + rng() % 10;
+			auto begin = stream->getFrameOffset(frame);
+			auto end = (frame + count < n) ? stream->getFrameOffset(frame + count) : stream->getSize();
+			data.erase(data.begin() + begin, data.begin() + end);
+			stream->cut(frame, count);
+		}
+		stream->truncate(3);
+		data.resize(stream->getSize());
+
+		auto ref = MPEG::IStream::create(&data[0], data.size(), options);
+		bool same = (stream->getFrameCount() == ref->getFrameCount()) && (stream->getSize() == ref->getSize());
+		for(uint i = 0; same && i < ref->getFrameCount(); ++i)
+		{
+			same = stream->getFrameOffset(i) == ref->getFrameOffset(i) &&
+				   stream->getFrameSize(i) == ref->getFrameSize(i) &&
+				   std::fabs(stream->getFrameTime(i) - ref->getFrameTime(i)) < 1e-3f;
+		}
+		CHECK(same, "edited frames mismatch (mode " << static_cast<int>(mode) << ')');
+		CHECK(stream->getBitrate() == ref->getBitrate() && stream->isVBR() == ref->isVBR(), "edited bitrate mismatch");
+		CHECK(std::fabs(stream->getLength() - ref->getLength()) < 1e-3f, "edited length mismatch");
+
+		// Time lookup over the edited times
+		for(uint i = 0; i + 1 < stream->getFrameCount(); i += 5)
+		{
+			auto t = stream->getFrameTime(i);
+			if(stream->getFrameNumber(t) != i || stream->getFrameNumber(stream->getFrameTime(i + 1) - 1e-4f) != i)
+			{
+				CHECK(false, "edited time lookup mismatch @ frame " << i);
+				break;
+			}
+		}
+	}
+
+	// Editing with a Xing frame
+	auto xing = gen_xing_stream(100);
+	auto stream = MPEG::IStream::create(&xing[0], xing.size());
+	auto info = stream->getFrameOffset(0);
+	CHECK(stream->cut(0, 10) == 10 && stream->truncate(10) == 10, "edit with a Xing frame failed");
+	CHECK(stream->getFrameCount() == 80 && stream->getFrameOffset(0) == info, "unexpected edit with a Xing frame");
 }
 
+
+void test_edit()
+{
+	std::vector<uchar> buf;
+	for(uint i = 0; i < 300; ++i)
+	{
+		auto frames = gen_stream((i % 3) ? 0x6CA2FBFF : 0x6C90FBFF, 1 + i % 4);
+		buf.insert(buf.end(), frames.begin(), frames.end());
+	}
+
+	auto batch = MPEG::IStream::create(&buf[0], buf.size());
+	auto single = MPEG::IStream::create(&buf[0], buf.size());
+	auto n = batch->getFrameCount();
+
+	// Drop ranges between keep ones, the last one is past the end
+	std::vector<MPEG::EditRange> ranges;
+	for(uint frame = 3; frame + 20 < n; frame += 20)
+	{
+		ranges.push_back({frame, 5, false});
+		ranges.push_back({frame + 5, 1 + frame % 9, true});
+	}
+	ranges.push_back({n - 10, 100, true});
+
+	std::vector<unsigned> removed;
+	auto total = batch->edit(ranges, removed);
+	CHECK(removed.size() == ranges.size(), "no report");
+
+	// The same with single cuts from the end
+	unsigned expected = 0;
+	for(size_t i = ranges.size(); i--;)
+	{
+		auto count = ranges[i].Drop ? single->cut(ranges[i].Frame, ranges[i].Count) : 0;
+		CHECK(removed[i] == count, "range #" << i << ": expected " << count << ", removed " << removed[i]);
+		expected += count;
+	}
+	CHECK(total == expected && batch->getFrameCount() == n - total, "unexpected total " << total);
+
+	bool same = (batch->getFrameCount() == single->getFrameCount()) && (batch->getSize() == single->getSize());
+	for(uint i = 0; same && i < batch->getFrameCount(); ++i)
+	{
+		same = batch->getFrameOffset(i) == single->getFrameOffset(i) &&
+			   batch->getFrameSize(i) == single->getFrameSize(i) &&
+			   std::fabs(batch->getFrameTime(i) - single->getFrameTime(i)) < 1e-3f;
+	}
+	CHECK(same, "batch edit mismatch");
+	CHECK(batch->getBitrate() == single->getBitrate(), "batch edit bitrate mismatch");
+
+	// Invalid ranges change nothing
+	auto count = batch->getFrameCount();
+	bool thrown = false;
+	try { batch->edit({{10, 5, true}, {12, 1, true}}, removed); }
+	catch(const std::invalid_argument&) { thrown = true; }
+	CHECK(thrown && batch->getFrameCount() == count, "overlapping ranges accepted");
+	thrown = false;
+	try { batch->edit({{0, 1, true}, {count, 1, true}}, removed); }
+	catch(const std::out_of_range&) { thrown = true; }
+	CHECK(thrown && batch->getFrameCount() == count, "range past the end accepted");
+}
+
+
+void test_quick(const std::vector<uchar>& buf)
+{
+	auto full = MPEG::IStream::create(&buf[0], buf.size());
+	CHECK(!full->hasIssues(), "Xing/VBRI mismatch");
+
+	MPEG::Options options;
+	options.Borrow = true;
+	options.Quick = true;
+	auto quick = MPEG::IStream::create(&buf[0], buf.size(), options);
+	CHECK(!quick->getIndexMemoryUsage(), "quick stream is indexed");
+	CHECK(quick->getFrameCount() == full->getFrameCount(), "frame count mismatch");
+	CHECK(quick->getSize() == full->getSize(), "size mismatch");
+	CHECK(quick->isVBR() && quick->getSamplingRate() == 44100, "stream info mismatch");
+	CHECK(std::abs(quick->getLength() - full->getLength()) < 0.01f, "length mismatch");
+	CHECK(std::abs(static_cast<int>(quick->getBitrate()) - static_cast<int>(full->getBitrate())) <= 1,
+		  "bitrate mismatch: " << quick->getBitrate() << " vs " << full->getBitrate());
+
+	// Seek offsets are real frame offsets close to the exact ones
+	for(float t = 0.0f; t < full->getLength(); t += 1.3f)
+	{
+		auto offset = quick->getSeekOffset(t);
+		auto frame = full->getFrameNumber(t);
+		bool found = false;
+		for(uint i = (frame > 5) ? frame - 5 : 0; i < frame + 5 && !found; ++i)
+			found = (full->getFrameOffset(i) == offset);
+		CHECK(found, "seek to " << t << " is too far: " << offset << " vs " << full->getFrameOffset(frame));
+		if(!found)
+			break;
+	}
+	CHECK(!quick->getIndexMemoryUsage(), "seek indexed the stream");
+
+	// Per-frame access builds the index
+	CHECK(quick->getFrameOffset(10) == full->getFrameOffset(10), "offset mismatch");
+	CHECK(quick->getIndexMemoryUsage(), "no index");
+	CHECK(same_frames(*full, *quick), "indexed quick stream mismatch");
+}
+
+
+void test_free_format()
+{
+	// Normal frames around two free-format runs of different sizes
+	std::mt19937 rng(0xF4EE);
+	auto buf = gen_stream(0x6CA0FBFF, 1);
+	auto run1 = gen_free_stream(300, 1000, rng);
+	auto run2 = gen_free_stream(200, 800, rng);
+	auto tail = gen_stream(0x6CA0FBFF, 1);
+	buf.insert(buf.end(), run1.begin(), run1.end());
+	buf.insert(buf.end(), run2.begin(), run2.end());
+	buf.insert(buf.end(), tail.begin(), tail.end());
+
+	// The predicted sizes are the scanned ones, the prediction fails over to the scan at the size change
+	uint slots = 0;
+	bool same = true;
+	auto offset = CHeader(0x6CA0FBFF).getFrameSize();
+	for(uint i = 0; same && i < 500; ++i)
+	{
+		CHeader h(*reinterpret_cast<const uint*>(&buf[offset]));
+		auto scanned = h.calcFrameSize(&buf[offset], buf.size() - offset);
+		auto predicted = h.calcFrameSize(&buf[offset], buf.size() - offset, slots);
+		same = scanned && predicted == scanned && slots == ((i < 300) ? 1000 : 800);
+		offset += scanned;
+	}
+	CHECK(same && offset + tail.size() == buf.size(), "free-format size prediction mismatch");
+
+	for(auto mode : {MPEG::IndexMode::Full, MPEG::IndexMode::Sparse})
+	{
+		MPEG::Options options;
+		options.Index = mode;
+		auto stream = MPEG::IStream::create(&buf[0], buf.size(), options);
+		CHECK(stream->getFrameCount() == 502 && stream->getSize() == buf.size(), "free-format frames lost");
+		CHECK(stream->getFrameSize(300) == 1000 && stream->getFrameSize(301) == 801 && stream->getFrameSize(302) == 800,
+			  "unexpected free-format frame sizes");
+	}
+
+	// The same incrementally
+	uint frames = 0;
+	auto parser = MPEG::IParser::create([&](const MPEG::Frame&) { ++frames; });
+	for(size_t pos = 0; pos < buf.size(); pos += 777)
+		parser->feed(&buf[pos], std::min<size_t>(777, buf.size() - pos));
+	CHECK(frames == 502, "parsed " << frames << " free-format frames");
+}
+
+
+void test_recover()
+{
+	const char* path = "test_recover.tmp";
+	const char* index = "test_recover.idx";
+
+	// Mixed frame sizes
+	std::vector<uchar> buf;
+	std::vector<size_t> offsets;
+	for(uint i = 0; i < 200; ++i)
+	{
+		offsets.push_back(buf.size());
+		auto frame = gen_stream((i % 3) ? 0x6CA2FBFF : 0x6C90FBFF, 1);
+		buf.insert(buf.end(), frame.begin(), frame.end());
+	}
+
+	// Damaged bytes starting inside frame #50, 3 frames of another sampling rate after frame #120
+	std::mt19937 rng(0xBAD);
+	auto damage = offsets[50] + 10;
+	const size_t damaged = 1500;
+	for(auto i = damage; i < damage + damaged; ++i)
+		buf[i] = static_cast<uchar>(rng() % 0xFF);
+	auto other = gen_stream(0x6CA4FBFF, 3);
+	buf.insert(buf.begin() + offsets[121], other.begin(), other.end());
+	for(uint i = 121; i < offsets.size(); ++i)
+		offsets[i] += other.size();
+	buf.resize(buf.size() + 128, 'T');
+
+	// The frames left: the damaged one keeps its header
+	std::vector<size_t> kept;
+	for(uint i = 0; i < offsets.size(); ++i)
+	{
+		if(i <= 50 || offsets[i] >= damage + damaged)
+			kept.push_back(offsets[i]);
+	}
+	auto resynced = std::find(offsets.begin(), offsets.end(), *(std::find(kept.begin(), kept.end(), offsets[50]) + 1));
+
+	auto plain = MPEG::IStream::create(&buf[0], buf.size());
+	CHECK(plain->getFrameCount() == 51 && plain->getGaps().empty(), "the stream doesn't stop at the damage");
+
+	MPEG::Options options;
+	options.Recover = true;
+	auto stream = MPEG::IStream::create(&buf[0], buf.size(), options);
+	bool same = stream->getFrameCount() == kept.size();
+	for(uint i = 0; same && i < kept.size(); ++i)
+		same = stream->getFrameOffset(i) == kept[i];
+	CHECK(same, "recovered " << stream->getFrameCount() << " frames instead of " << kept.size());
+	CHECK(stream->hasIssues() && stream->getSize() == buf.size() - 128, "unexpected end " << stream->getSize());
+
+	// The bitrate of the edited stream is taken from the frames around the gaps
+	auto edited = MPEG::IStream::create(&buf[0], buf.size(), options);
+	edited->cut(10, 1);
+	CHECK(edited->getFrameCount() == kept.size() - 1 && edited->getBitrate() == stream->getBitrate() && edited->isVBR(),
+		  "edited recovered stream bitrate " << edited->getBitrate());
+
+	auto& gaps = stream->getGaps();
+	CHECK(gaps.size() == 2, "unexpected number of gaps " << gaps.size());
+	if(gaps.size() == 2)
+	{
+		CHECK(gaps[0].Reason == MPEG::GapReason::Corrupt && gaps[0].Offset == offsets[51] &&
+			  gaps[0].Offset + gaps[0].Size == *resynced, "unexpected damaged region");
+		CHECK(gaps[1].Reason == MPEG::GapReason::FormatChange && gaps[1].Offset == offsets[121] - other.size() &&
+			  gaps[1].Size == other.size(), "unexpected format change region");
+	}
+
+	// The gaps survive the sidecar
+	remove(index);
+	CHECK(write_file(path, buf), "failed to write \"" << path << '"');
+	auto scanned = MPEG::IStream::open(path, index, options);
+	auto loaded = MPEG::IStream::open(path, index, options);
+	CHECK(scanned.Stream && loaded.Stream, "no stream");
+	if(scanned.Stream && loaded.Stream)
+	{
+		auto& a = scanned.Stream->getGaps();
+		auto& b = loaded.Stream->getGaps();
+		same = (a.size() == b.size()) && same_frames(*scanned.Stream, *loaded.Stream);
+		for(size_t i = 0; same && i < a.size(); ++i)
+			same = a[i].Offset == b[i].Offset && a[i].Size == b[i].Size && a[i].Reason == b[i].Reason;
+		CHECK(same, "sidecar gaps mismatch");
+	}
+	remove(path);
+	remove(index);
+}
+
+
+void test_serialize()
+{
+	const char* path = "test_serialize.tmp";
+	auto buf = gen_xing_stream(500);
+	auto stream = MPEG::IStream::create(&buf[0], buf.size());
+
+	std::vector<uchar> out;
+	stream->serialize(out);
+	CHECK(out == buf, "unedited stream changed");
+
+	// Even with stale Xing counts
+	auto stale = buf;
+	stale[4 + 32 + 11] ^= 1;
+	out.clear();
+	MPEG::IStream::create(&stale[0], stale.size())->serialize(out);
+	CHECK(out == stale, "unedited stream with stale counts changed");
+
+	std::vector<MPEG::EditRange> ranges = {{10, 20, true}, {100, 1, true}, {250, 50, true}, {480, 100, true}};
+	std::vector<unsigned> removed;
+	stream->edit(ranges, removed);
+
+	// Gather the ranges straight into a file
+	std::vector<iovec> iov;
+	stream->serialize(iov);
+	// The Xing frame and the pieces (the last range drops the tail)
+	CHECK(iov.size() == 1 + ranges.size(), "unexpected number of ranges " << iov.size());
+	auto fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	CHECK(fd >= 0, "failed to create \"" << path << '"');
+	if(fd < 0)
+		return;
+	auto written = writev(fd, &iov[0], static_cast<int>(iov.size()));
+	close(fd);
+	CHECK(written == static_cast<ssize_t>(stream->getSize()), "written " << written << " of " << stream->getSize());
+
+	out.clear();
+	stream->serialize(out);
+	CHECK(out.size() == stream->getSize(), "serialized size mismatch");
+
+	// The Xing counts match the frames left: no warnings, the quick info is exact
+	auto file = MPEG::IStream::open(path);
+	MPEG::Options options;
+	options.Quick = true;
+	auto quick = MPEG::IStream::create(&out[0], out.size(), options);
+	CHECK(file.Stream && !file.Stream->hasIssues(), "the rewritten Xing frame mismatches the stream");
+	if(!file.Stream)
+		return;
+	CHECK(file.Stream->getFrameCount() == stream->getFrameCount() && file.Stream->getSize() == stream->getSize(),
+		  "serialized " << file.Stream->getFrameCount() << " frames, expected " << stream->getFrameCount());
+	CHECK(quick->getFrameCount() == stream->getFrameCount() && quick->getSize() == stream->getSize(), "stale Xing counts");
+
+	// The frames left are the original bytes
+	auto orig = MPEG::IStream::create(&buf[0], buf.size());
+	std::vector<uint> kept;
+	for(uint i = 0, r = 0; i < orig->getFrameCount(); ++i)
+	{
+		if(r < ranges.size() && i >= ranges[r].Frame + ranges[r].Count)
+			++r;
+		if(r == ranges.size() || i < ranges[r].Frame)
+			kept.push_back(i);
+	}
+	bool same = (kept.size() == stream->getFrameCount());
+	for(uint i = 0; same && i < kept.size(); ++i)
+	{
+		auto size = file.Stream->getFrameSize(i);
+		same = file.Stream->getFrameOffset(i) == stream->getFrameOffset(i) && size == orig->getFrameSize(kept[i]) &&
+			   !memcmp(&out[file.Stream->getFrameOffset(i)], &buf[orig->getFrameOffset(kept[i])], size);
+	}
+	CHECK(same, "serialized frames mismatch");
+
+	// The regenerated TOC seeks close to the frames
+	bool near = true;
+	for(uint i = 0; near && i < 20; ++i)
+	{
+		auto time = stream->getLength() * i / 20;
+		auto exact = static_cast<double>(stream->getSeekOffset(time));
+		near = std::fabs(quick->getSeekOffset(time) - exact) <= stream->getSize() / 256 + 2 * 1441;
+	}
+	CHECK(near, "stale Xing TOC");
+	remove(path);
+
+	// A VBRI frame is written as is until the frames change
+	auto vbriBuf = gen_vbri_stream(500);
+	auto vbri = MPEG::IStream::create(&vbriBuf[0], vbriBuf.size());
+	out.clear();
+	vbri->serialize(out);
+	CHECK(out == vbriBuf, "unedited VBRI stream changed");
+
+	vbri->cut(10, 20);
+	out.clear();
+	vbri->serialize(out);
+	auto reparsed = MPEG::IStream::create(&out[0], out.size());
+	quick = MPEG::IStream::create(&out[0], out.size(), options);
+	CHECK(!reparsed->hasIssues(), "a stale VBRI frame is serialized");
+	CHECK(reparsed->getFrameCount() == 480 && reparsed->getFrameCount() == vbri->getFrameCount() &&
+		  reparsed->getSize() == vbri->getSize() && out.size() == vbri->getSize(), "edited VBRI stream mismatch");
+	CHECK(quick->getFrameCount() == 480 && quick->getSize() == out.size(), "stale VBRI counts");
+}
+
+
+// MPEG 1 layer III frames borrowing 100 bytes of the bit reservoir, except every 5th one
+static std::vector<uchar> gen_reservoir_stream(uint f_frames)
+{
+	auto buf = gen_cbr_stream(f_frames);
+	for(size_t offset = 0, i = 0; offset < buf.size(); offset += CHeader(*reinterpret_cast<const uint*>(&buf[offset])).getFrameSize(), ++i)
+	{
+		// 9 bits of main_data_begin right after the header
+		uint begin = (i % 5) ? 100 : 0;
+		buf[offset + 4] = static_cast<uchar>(begin >> 1);
+		buf[offset + 5] = static_cast<uchar>((begin & 1) << 7);
+	}
+	return buf;
+}
+
+
+void test_segment()
+{
+	auto buf = gen_reservoir_stream(2000);
+	auto stream = MPEG::IStream::create(&buf[0], buf.size());
+
+	auto bytes = [](const MPEG::Segment& f_segment)
+	{
+		std::vector<uchar> result;
+		for(auto& range : f_segment.Ranges)
+			result.insert(result.end(), static_cast<const uchar*>(range.iov_base), static_cast<const uchar*>(range.iov_base) + range.iov_len);
+		return result;
+	};
+	// The segments follow each other and cover all the frames
+	auto covers = [&](const std::vector<MPEG::Segment>& f_segments)
+	{
+		uint frame = 0;
+		for(auto& segment : f_segments)
+		{
+			if(segment.Frame != frame || !segment.Count ||
+			   segment.Samples != stream->getDuration(segment.Frame, segment.Count) || segment.Sample != stream->getFrameSample(frame))
+				return false;
+			frame += segment.Count;
+		}
+		return frame == stream->getFrameCount();
+	};
+
+	MPEG::SegmentOptions options;
+	options.Duration = 4.0f;
+	std::vector<MPEG::Segment> segments;
+	stream->segment(options, segments);
+	CHECK(covers(segments) && segments.size() == 14, "wrong segments " << segments.size());
+	// The boundaries move to the self-contained frames, the data is the stream data
+	bool reservoir = true;
+	std::vector<uchar> all;
+	for(size_t i = 0; i < segments.size(); ++i)
+	{
+		auto& segment = segments[i];
+		auto target = static_cast<uint64_t>(i * 4 * stream->getSamplingRate());
+		reservoir = reservoir && !(segment.Frame % 5) && !segment.Preroll &&
+					segment.Sample >= target && segment.Sample < target + 5 * 1152;
+		auto data = bytes(segment);
+		all.insert(all.end(), data.begin(), data.end());
+	}
+	CHECK(reservoir, "segment boundaries use the bit reservoir");
+	CHECK(all == buf, "segment bytes mismatch");
+
+	// No search: the segments start with the frame holding the reservoir
+	options.ReservoirSearch = 0;
+	stream->segment(options, segments);
+	CHECK(covers(segments), "wrong segments without the reservoir search");
+	reservoir = true;
+	for(size_t i = 1; i < segments.size(); ++i)
+	{
+		auto& segment = segments[i];
+		auto preroll = (segment.Frame % 5) ? 1u : 0u;
+		auto from = stream->getFrameOffset(segment.Frame - preroll);
+		auto to = stream->getFrameOffset(segment.Frame + segment.Count);
+		auto data = bytes(segment);
+		reservoir = reservoir && (segment.Preroll == preroll) && std::equal(data.begin(), data.end(), buf.begin() + from) &&
+					(data.size() == to - from);
+	}
+	CHECK(reservoir, "wrong segment preroll");
+
+	// The edited stream: a range per piece, the same bytes as serialized
+	stream->cut(100, 30);
+	stream->cut(500, 1);
+	options.Preroll = false;
+	options.Duration = 10.0f;
+	stream->segment(options, segments);
+	all.clear();
+	size_t nRanges = 0;
+	for(auto& segment : segments)
+	{
+		auto data = bytes(segment);
+		all.insert(all.end(), data.begin(), data.end());
+		nRanges += segment.Ranges.size();
+	}
+	std::vector<uchar> out;
+	stream->serialize(out);
+	CHECK(covers(segments) && all == out && nRanges == segments.size() + 2, "edited segments mismatch");
+
+	auto playlist = MPEG::IStream::playlist(segments, stream->getSamplingRate(),
+											[](size_t f_index) { return "segment" + std::to_string(f_index) + ".mp3"; });
+	size_t entries = 0;
+	for(auto p = playlist.find("#EXTINF:"); p != std::string::npos; p = playlist.find("#EXTINF:", p + 1))
+		++entries;
+	CHECK(!playlist.find("#EXTM3U\n") && playlist.find("#EXT-X-TARGETDURATION:11\n") != std::string::npos &&
+		  entries == segments.size() && playlist.find("segment0.mp3\n") != std::string::npos &&
+		  playlist.find("#EXT-X-ENDLIST\n") != std::string::npos, "wrong playlist:\n" << playlist);
+
+	bool thrown = false;
+	try
+	{
+		options.Duration = 0.0f;
+		stream->segment(options, segments);
+	}
+	catch(const std::invalid_argument&)
+	{
+		thrown = true;
+	}
+	CHECK(thrown, "zero duration accepted");
+}
+
+
+// The side information read field by field the way a decoder does it (ISO/IEC 11172-3, 13818-3)
+static MPEG::SideInfo parse_side_info(const uchar* f_p, bool f_v2, bool f_mono)
+{
+	uint pos = 0;
+	auto read = [&](uint f_bits)
+	{
+		uint value = 0;
+		for(uint i = 0; i < f_bits; ++i, ++pos)
+			value = (value << 1) | ((f_p[pos / 8] >> (7 - pos % 8)) & 1);
+		return value;
+	};
+
+	MPEG::SideInfo info = {};
+	info.Granules = f_v2 ? 1 : 2;
+	info.Channels = f_mono ? 1 : 2;
+	info.MainDataBegin = read(f_v2 ? 8 : 9);
+	read(f_v2 ? info.Channels : (f_mono ? 5 : 3));
+	if(!f_v2)
+		read(4 * info.Channels);
+	for(uint gr = 0; gr < info.Granules; ++gr)
+	{
+		for(uint ch = 0; ch < info.Channels; ++ch)
+		{
+			info.Part23Length[gr][ch] = read(12);
+			read(9);
+			info.GlobalGain[gr][ch] = read(8);
+			read(f_v2 ? 9 : 4);
+			// Window switching: block type, mixed block, 2 tables, 3 subblock gains or 3 tables, 2 region counts
+			if(read(1))
+				read(2 + 1 + 2 * 5 + 3 * 3);
+			else
+				read(3 * 5 + 4 + 3);
+			read(f_v2 ? 2 : 3);
+		}
+	}
+	return info;
+}
+
+
+void test_side_info()
+{
+	// MPEG 1 / 2 stereo and mono, with a CRC
+	static const uint s_headers[] = {0x6C90FBFF, 0xEC90FBFF, 0x6C90F3FF, 0xEC90F3FF, 0x6C90FAFF};
+	std::mt19937 rng(25);
+	for(auto raw : s_headers)
+	{
+		const CHeader h(raw);
+		auto buf = gen_stream(raw, 300);
+		for(size_t offset = 0; offset < buf.size(); offset += h.getFrameSize())
+		{
+			for(auto i = offset + CHeader::getSize(); i < offset + h.getFrameSize(); ++i)
+				buf[i] = static_cast<uchar>(rng());
+		}
+		auto v2 = (h.getVersion() != MPEG::Version::v1);
+		auto mono = (h.getChannelMode() == MPEG::ChannelMode::Mono);
+		auto crc = h.isProtected() ? 2u : 0u;
+
+		for(auto mode : {MPEG::IndexMode::Full, MPEG::IndexMode::Sparse})
+		{
+			for(bool scan : {false, true})
+			{
+				MPEG::Options options;
+				options.Index = mode;
+				options.SideInfo = scan;
+				auto stream = MPEG::IStream::create(&buf[0], buf.size(), options);
+				CHECK(stream->getFrameCount() == 300, "frames lost");
+
+				auto same = [&](uint f_frame, size_t f_offset)
+				{
+					MPEG::SideInfo info;
+					auto expected = parse_side_info(&buf[f_offset + CHeader::getSize() + crc], v2, mono);
+					return stream->getSideInfo(f_frame, info) &&
+						   info.MainDataBegin == expected.MainDataBegin && info.Granules == expected.Granules &&
+						   info.Channels == expected.Channels &&
+						   std::equal(&info.Part23Length[0][0], &info.Part23Length[0][0] + 4, &expected.Part23Length[0][0]) &&
+						   std::equal(&info.GlobalGain[0][0], &info.GlobalGain[0][0] + 4, &expected.GlobalGain[0][0]);
+				};
+				bool ok = true;
+				for(uint i = 0; ok && i < stream->getFrameCount(); ++i)
+					ok = same(i, stream->getFrameOffset(i));
+				MPEG::SideInfo info;
+				CHECK(ok && !stream->getSideInfo(300, info), "side info mismatch (header 0x" << std::hex << raw << std::dec <<
+					  ", mode " << static_cast<int>(mode) << ", scan " << scan << ')');
+
+				// The edited frames are mapped to the indexed ones
+				auto offset = stream->getFrameOffset(20);
+				stream->cut(10, 5);
+				CHECK(same(15, offset), "edited side info mismatch");
+			}
+		}
+	}
+
+	// Layer II has none
+	auto buf = gen_stream(0x6CA0FDFF, 10);
+	auto stream = MPEG::IStream::create(&buf[0], buf.size());
+	MPEG::SideInfo info;
+	CHECK(!stream->getSideInfo(0, info), "layer II side info");
+
+	// The segmenter takes main_data_begin from the columns
+	buf = gen_reservoir_stream(1000);
+	MPEG::Options options;
+	options.SideInfo = true;
+	auto a = MPEG::IStream::create(&buf[0], buf.size());
+	auto b = MPEG::IStream::create(&buf[0], buf.size(), options);
+	MPEG::SegmentOptions segmentOptions;
+	segmentOptions.Duration = 2.0f;
+	segmentOptions.ReservoirSearch = 1;
+	std::vector<MPEG::Segment> sa, sb;
+	a->segment(segmentOptions, sa);
+	b->segment(segmentOptions, sb);
+	bool same = (sa.size() == sb.size());
+	for(size_t i = 0; same && i < sa.size(); ++i)
+		same = sa[i].Frame == sb[i].Frame && sa[i].Preroll == sb[i].Preroll;
+	CHECK(same && b->getIndexMemoryUsage() > a->getIndexMemoryUsage(), "segments differ with the side info columns");
+}
+
+
+void test_info_frame()
+{
+	// CBR gets an Info frame with the same bitrate, VBR - a Xing one
+	auto cbr = gen_stream(0x6CA0FBFF, 1000);
+	auto vbr = gen_xing_stream(1000);
+	vbr.erase(vbr.begin(), vbr.begin() + CHeader(0x6CA0FBFF).getFrameSize());
+	for(auto* buf : {&cbr, &vbr})
+	{
+		auto stream = MPEG::IStream::create(&(*buf)[0], buf->size());
+		auto n = stream->getFrameCount();
+		auto second = stream->getFrameOffset(1);
+		CHECK(stream->addInfoFrame(), "no info frame");
+		auto added = stream->getFrameOffset(0);
+		CHECK(added && stream->getFrameOffset(1) == second + added && stream->getSize() == buf->size() + added,
+			  "the frames are not moved by the info frame");
+
+		stream->cut(100, 10);
+		std::vector<uchar> out;
+		stream->serialize(out);
+		auto parsed = MPEG::IStream::create(&out[0], out.size());
+		CHECK(!parsed->hasIssues() && parsed->getFrameCount() == n - 10 && parsed->isVBR() == (buf == &vbr),
+			  "invalid info frame");
+		// The sample timeline is exact across the edits
+		bool same = parsed->getFrameCount() == stream->getFrameCount();
+		for(uint i = 0; same && i < stream->getFrameCount(); ++i)
+		{
+			same = parsed->getFrameOffset(i) == stream->getFrameOffset(i) && parsed->getFrameSize(i) == stream->getFrameSize(i) &&
+				   parsed->getFrameSample(i) == stream->getFrameSample(i);
+		}
+		CHECK(same, "info frame stream mismatch");
+
+		MPEG::Options options;
+		options.Quick = true;
+		auto quick = MPEG::IStream::create(&out[0], out.size(), options);
+		CHECK(quick->getFrameCount() == n - 10 && quick->getSize() == out.size(), "no seek info");
+	}
+
+	// Layer III only
+	auto layer2 = gen_stream(0x6CA0FDFF, 10);
+	auto stream = MPEG::IStream::create(&layer2[0], layer2.size());
+	CHECK(stream->getFrameCount() == 10 && !stream->addInfoFrame() && stream->getSize() == layer2.size(), "layer II info frame");
+}
+
+
+void test_quick()
+{
+	for(auto vbri : {false, true})
+		test_quick(vbri ? gen_vbri_stream(1000) : gen_xing_stream(1000));
+
+	// A stale byte count limits the figures reported before indexing, not the index
+	auto stale = gen_xing_stream(1000);
+	put_be(&stale[4 + 32 + 12], 50000);
+	auto full = MPEG::IStream::create(&stale[0], stale.size());
+	for(bool borrow : {false, true})
+	{
+		MPEG::Options options;
+		options.Borrow = borrow;
+		options.Quick = true;
+		auto quick = MPEG::IStream::create(&stale[0], stale.size(), options);
+		CHECK(quick->getSize() == 50000, "the quick size is not the header one");
+		CHECK(quick->getFrameOffset(999) == full->getFrameOffset(999) && same_frames(*full, *quick) &&
+			  quick->getSize() == full->getSize(), "the stale byte count truncates the index (borrow " << borrow << ')');
+	}
+}
+
+
+void test_decode_table()
+{
+	// All the table bits with sync, no emphasis and every channel mode
+	for(uint key = 0; key < CDecodeTable::Size; ++key)
+	{
+		for(uint channel = 0; channel < 4; ++channel)
+		{
+			uint raw = 0xE0FF | ((key & 0xF) << 9) | (((key >> 4) & 0x7F) << 17) | (channel << 30);
+			if(CDecodeTable::getKey(raw) != (key & 0x7FF) + ((channel == 3) << 11))
+				continue;
+
+			auto& info = CDecodeTable::get(raw);
+			bool valid = CHeader::isValid(raw);
+			CHECK(CDecodeTable::isValid(raw) == valid, "validity mismatch for 0x" << OUT_HEX(raw));
+			if(!valid)
+				continue;
+
+			const CHeader h(raw);
+			CHECK(info.Length == h.getFrameLength(), "length mismatch for 0x" << OUT_HEX(raw));
+			CHECK(info.Bitrate * 1000 == h.getBitrate(), "bitrate mismatch for 0x" << OUT_HEX(raw));
+			CHECK(CHeader::getSize() + info.SideInfoSize == h.getFrameDataOffset(), "side info mismatch for 0x" << OUT_HEX(raw));
+			if(!h.isFreeBitrate())
+				CHECK(info.FrameSize == h.getFrameSize(), "frame size mismatch for 0x" << OUT_HEX(raw));
+			else
+				CHECK(!info.FrameSize, "free-bitrate frame size for 0x" << OUT_HEX(raw));
+		}
+	}
+
+	// Random headers (sync and emphasis included)
+	std::mt19937 rng(0xDEC0DE);
+	for(uint i = 0; i < 100000; ++i)
+	{
+		uint raw = rng() | ((i & 1) ? 0xE0FF : 0);
+		CHECK(CDecodeTable::isValid(raw) == CHeader::isValid(raw), "validity mismatch for 0x" << OUT_HEX(raw));
+	}
+}
+
+
+void test_sync()
+{
+	std::mt19937 rng(0x5EED);
+	// Sync-heavy noise: plenty of 0xFF bytes and valid-looking second bytes
+	static const uchar s_alphabet[] = {0xFF, 0xFF, 0xFB, 0xE3, 0xF3, 0x90, 0x44, 0x64, 0x00, 0xC4};
+
+	uint nHits = 0;
+	for(uint n = 0; n < 20000; ++n)
+	{
+		std::vector<uchar> buf(rng() % 300);
+		for(auto& b : buf)
+			b = (rng() & 1) ? s_alphabet[rng() % sizeof(s_alphabet)] : static_cast<uchar>(rng());
+
+		// Unaligned starting offsets
+		size_t skip = buf.empty() ? 0 : rng() % std::min<size_t>(buf.size(), 64);
+		const uchar* data = buf.data() + skip;
+		size_t size = buf.size() - skip;
+
+		auto expected = CSync::findScalar(data, size);
+		CHECK(CSync::findSSE2(data, size) == expected, "SSE2 mismatch (size " << size << ')');
+		if(CSync::hasAVX2())
+			CHECK(CSync::findAVX2(data, size) == expected, "AVX2 mismatch (size " << size << ')');
+		CHECK(CSync::find(data, size) == expected, "dispatch mismatch (size " << size << ')');
+		nHits += (expected != size);
+	}
+	LOG("Sync scan:     " << nHits << " hits, SSE2 " << CSync::hasSSE2() << ", AVX2 " << CSync::hasAVX2());
+}
+
+
 int main(int, char**)
 {
 	//test_header(0x00A2FBFF);
@@ -105,7 +1850,32 @@ int main(int, char**)
 	//test_header(0x44C0FBFF);
 	LOG("================");
 	test_file("test.mp3");
+	LOG("================");
+	test_sync();
+	test_first_header();
+	test_borrow();
+	test_open();
+	test_tags();
+	test_sidecar();
+	test_parser();
+	test_index();
+	test_sparse_index();
+	test_time_lookup();
+	test_samples();
+	test_range_stats();
+	test_cbr_index();
+	test_parallel_index();
+	test_pieces();
+	test_edit();
+	test_free_format();
+	test_recover();
+	test_serialize();
+	test_segment();
+	test_side_info();
+	test_info_frame();
+	test_quick();
+	test_decode_table();
 
-	return 0;
+	return s_failures ? 1 : 0;
 }
 